@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "DDTrace.h"
 
@@ -66,13 +67,34 @@ void initThread() {
     threadInitialized = true;
 }
 
+/**
+  * Thread-specific key whose destructor closes the calling thread's
+  * RecordSink when the thread exits
+  */
+static pthread_key_t sinkCloserKey;
+static pthread_once_t sinkCloserOnce = PTHREAD_ONCE_INIT;
+
+static void closeSinkOnThreadExit(void* sink){
+    static_cast<RecordSink*>(sink)->close();
+}
+
+static void makeSinkCloserKey(){
+    int rc = pthread_key_create(&sinkCloserKey, closeSinkOnThreadExit);
+    assert(rc == 0);
+}
+
 void initThreadSink(const std::string& logName){
     initThread();
     recordSinks[threadid].init(logName);
+    pthread_once(&sinkCloserOnce, makeSinkCloserKey);
+    pthread_setspecific(sinkCloserKey, &recordSinks[threadid]);
 }
 
 RecordSink::RecordSink()
-    : logFile()
+    : logFile(),
+    records(NULL),
+    registry(NULL),
+    firstQueuedCycles()
 { }
 
 //TODO(bjmnbraun@gmail.com) breaches of style...
@@ -121,16 +143,16 @@ err:
     throw std::runtime_error("Could not open storage file");
 }
 
-std::atomic<ChannelsVersion>* ChannelsVersionUtils::openChannelsVersion(const std::string& baseName){
+ChannelRegistry* ChannelRegistryUtils::openChannelRegistry(const std::string& baseName){
     std::string schemaDir = makeStorageInnerDirname(baseName);
-    std::string channelVersionsFile = schemaDir + "/channelsVersions";
-    std::atomic<ChannelsVersion>* channelsVersion;
+    std::string registryFile = schemaDir + "/channelsRegistry";
+    ChannelRegistry* registry;
     int rc = 0;
 
     //open makes the file get permissions & umask
     //so temporarily override umask
     mode_t oldUmask = umask(0);
-    int fd = open(channelVersionsFile.c_str(), O_CREAT | O_RDWR, 0667); //nonexclusive
+    int fd = open(registryFile.c_str(), O_CREAT | O_RDWR, 0667); //nonexclusive
     umask(oldUmask);
     assert(fd >= 0);
     if (!(fd >= 0)) {
@@ -138,32 +160,46 @@ std::atomic<ChannelsVersion>* ChannelsVersionUtils::openChannelsVersion(const st
     }
     //ftruncate file to the right size
     //multiple consistent ftruncates do not error
-    //the first ftruncate zeros out the atomic
-    //hmm. This may not ensure correct initialization of the atomic. Oh well, it'll
+    //the first ftruncate zeros out the registry
+    //hmm. This may not ensure correct initialization of the atomics. Oh well, it'll
     //work on x86 at least, where atomic is essentially a typedef - TODO portability
-    rc = ftruncate(fd, sizeof(std::atomic<ChannelsVersion>));
+    rc = ftruncate(fd, sizeof(ChannelRegistry));
     assert(rc == 0);
     if (!(rc == 0)){
         goto err;
     }
 
-    channelsVersion = 
-        static_cast<std::atomic<ChannelsVersion>*>(mmap(
+    registry = 
+        static_cast<ChannelRegistry*>(mmap(
         NULL,
-        sizeof(std::atomic<ChannelsVersion>),
+        sizeof(ChannelRegistry),
         PROT_READ | PROT_WRITE,
         MAP_SHARED,
         fd,
         0));
 
-    assert(channelsVersion != MAP_FAILED);
-    if(!(channelsVersion != MAP_FAILED)){
+    assert(registry != MAP_FAILED);
+    if(!(registry != MAP_FAILED)){
+        goto err;
+    }
+
+    rc = close(fd);
+    assert(rc == 0);
+    if (!(rc == 0)){
         goto err;
     }
 
-    return channelsVersion;
+    return registry;
 err:
-    throw std::runtime_error("Could not open shared ChannelsVersion");
+    throw std::runtime_error("Could not open shared ChannelRegistry");
+}
+
+void ChannelRegistryUtils::closeChannelRegistry(ChannelRegistry* registry){
+    int rc = munmap(registry, sizeof(ChannelRegistry));
+    assert(rc == 0);
+    if (!(rc == 0)){
+        throw std::runtime_error("Could not close shared ChannelRegistry");
+    }
 }
 
 int mkPublicDir(const std::string& dirName){
@@ -211,7 +247,6 @@ err:
 void RecordSink::init(const std::string& baseName) {
     std::string storageDir = makeStorageDirname(baseName);
     int rc;
-    std::atomic<ChannelsVersion>* channelsAvailableVersion;
     const int tempNameLen = 1024;
     char tempName [tempNameLen];
     char finalName [tempNameLen];
@@ -257,7 +292,7 @@ void RecordSink::init(const std::string& baseName) {
     if (!(records != MAP_FAILED)){
         goto err;
     }
-    rc = close(fd);
+    rc = ::close(fd);
     assert(rc == 0);
     if (!(rc == 0)){
         goto err;
@@ -276,18 +311,14 @@ void RecordSink::init(const std::string& baseName) {
         goto err;
     }
     
-    channelsAvailableVersion = ChannelsVersionUtils::openChannelsVersion(baseName);
-    //This atomic add will lock the cache line, ensuring that the value changes
-    //This isn't actually necessary - if two threads simultaneously add, we're
-    //O.K. with only one increment occuring because it will still correctly
-    //cause any sources to look for new channels
-    //Whatever, this is not worth optimizing.
-    channelsAvailableVersion->fetch_add(1);
-    //Finally, close the mmap
-    rc = munmap(channelsAvailableVersion, sizeof(channelsAvailableVersion));
-    assert(rc == 0);
-    if (!(rc == 0)) {
-        goto err;
+    //Tell any sources about the new channel, and wake them to look
+    registry = ChannelRegistryUtils::openChannelRegistry(baseName);
+    registry->append(strrchr(finalName, '/') + 1);
+    {
+        Doorbell* doorbell = registry->getDoorbell(0);
+        if (doorbell->isArmed()){
+            doorbell->ring();
+        }
     }
     return;
 err:
@@ -295,107 +326,348 @@ err:
     throw std::runtime_error("Could not create RecordSink file");
 }
 
+void RecordSink::close() {
+    if (!records) return;
+    records->producerExited.store(1, std::memory_order_release);
+    //Let a sleeping source retire the channel promptly
+    Doorbell* doorbell = registry->getDoorbell(
+        records->consumerDoorbell.load(std::memory_order_relaxed));
+    if (doorbell->isArmed()){
+        doorbell->ring();
+    }
+}
+
 RecordSink::~RecordSink() {
 //    terminateBackgroundThread();
 }
 
-void RecordSource::init(const std::string& _baseName) {
+RecordSource::RecordSource() :
+    discovery(),
+    channelSet(),
+    droppedByRemovedChannels(0)
+{ }
+
+void RecordSource::init(const std::string& baseName) {
+    discovery.init(baseName);
+    updateChannels();
+}
+
+ChannelDiscovery::ChannelDiscovery() :
+    baseName(),
+    registry(NULL),
+    registryPosition(0),
+    stuckPosition(~0UL),
+    stuckSinceCycles(0)
+{ }
+
+ChannelDiscovery::~ChannelDiscovery(){
+    if (registry){
+        ChannelRegistryUtils::closeChannelRegistry(registry);
+    }
+}
+
+void ChannelDiscovery::init(const std::string& _baseName) {
     baseName = _baseName;
     int rc = makeSHMDirs(baseName);
     assert(rc == 0);
     if (!(rc == 0)){
         goto err;
     }
-    channelsAvailableVersion = ChannelsVersionUtils::openChannelsVersion(baseName);
-    updateChannels();
+    //Re-initializing must not leak the mapping of the last registry
+    if (registry){
+        ChannelRegistryUtils::closeChannelRegistry(registry);
+        registry = NULL;
+    }
+    registryPosition = 0;
+    registry = ChannelRegistryUtils::openChannelRegistry(baseName);
     return;
 err:
     throw std::runtime_error("Could not initialize RecordSource");
 }
 
-/**
-  * Close the mapping to a record sink and delete the backing file
-  * Should only be called after the channel is dead
-  */
-void closeAndRemoveRecordSink(const std::string& fileName, 
-                              RecordStorage* records){
-    assert(records);
-    int rc;
-    rc = munmap(records, sizeof(RecordStorage));
+void ChannelDiscovery::scanDirectory(std::vector<std::string>* fileNames){
+    //Anything appended to the registry from here on will also be in the
+    //directory, so the scan covers it
+    registryPosition = registry->size();
+    //scan for any new record sinks
+    std::string schemaDir = makeStorageInnerDirname(baseName);
+    DIR* channels = opendir(schemaDir.c_str());
+    struct dirent* entry;
+    if (!channels){
+        //This can occur if the directory hasn't been created yet
+        return; 
+    }
+    while((entry = readdir(channels)) != NULL){
+        //Only pay attention to files that have a "rec_" prefix
+        if (strstr(entry->d_name, "rec_") ==
+                entry->d_name){
+            //Valid channel
+            fileNames->push_back(schemaDir+"/"+entry->d_name);
+        }
+    }
+    closedir(channels);
+}
+
+void ChannelDiscovery::poll(std::vector<std::string>* fileNames){
+    std::string schemaDir = makeStorageInnerDirname(baseName);
+    uint64_t available = registry->size();
+    char name[MAX_CHANNEL_NAME_LENGTH];
+    while (registryPosition < available){
+        switch (registry->read(registryPosition, name)){
+            case ChannelRegistry::READ_OK:
+                break;
+            case ChannelRegistry::READ_NOT_YET:
+                //Try again next time around, unless the producer seems to
+                //have died before finishing the entry
+                if (registryPosition != stuckPosition){
+                    stuckPosition = registryPosition;
+                    stuckSinceCycles = Cycles::rdtsc();
+                } else if (Cycles::toMicroseconds(Cycles::rdtsc() -
+                               stuckSinceCycles) >=
+                           CHANNEL_REGISTRY_STUCK_TIMEOUT){
+                    scanDirectory(fileNames);
+                }
+                return;
+            case ChannelRegistry::READ_LAPPED:
+                //Too far behind, we may have missed channels
+                scanDirectory(fileNames);
+                return;
+        }
+        registryPosition++;
+        fileNames->push_back(schemaDir + "/" + name);
+    }
+}
+
+#define DEBUG_CHANNEL_DETECTION 1
+Channel ChannelUtils::openChannel(const std::string& fileName){
+#if DEBUG_CHANNEL_DETECTION == 1
+    fprintf(stderr,"Found new channel: %s\n", fileName.c_str());
+#endif
+    Channel channel;
+    channel.records = RecordStorageUtils::openStorageFile(fileName);
+    //Take a pidfd now, while the pid still refers to the
+    //producer, so that pid reuse cannot fool us later
+    channel.producerPidfd = Util::pidfdOpen(channel.records->producerPid);
+    channel.fileName = fileName;
+    return channel;
+}
+
+void ChannelUtils::closeChannel(Channel* channel){
+    assert(channel->records);
+    if (channel->producerPidfd >= 0){
+        close(channel->producerPidfd);
+        channel->producerPidfd = -1;
+    }
+    int rc = munmap(channel->records, sizeof(RecordStorage));
     assert(rc == 0);
     if (!(rc == 0)){
-        goto err;
+        fprintf(stderr, "Could not unmap channel %s\n",
+                channel->fileName.c_str());
+        throw std::runtime_error("Could not unmap channel\n");
     }
-    rc = remove(fileName.c_str());
+    channel->records = NULL;
+}
+
+void ChannelUtils::closeAndRemoveChannel(Channel* channel){
+    int rc;
+#if DEBUG_CHANNEL_DETECTION == 1
+    fprintf(stderr,"Detected dead channel: %s\n", channel->fileName.c_str());
+#endif
+    closeChannel(channel);
+    rc = remove(channel->fileName.c_str());
     assert(rc == 0);
     if (!(rc == 0)){
         goto err;
     }
     return;
     err:
-    fprintf(stderr, "Could not remove dead channel %s\n", fileName.c_str());
+    fprintf(stderr, "Could not remove dead channel %s\n", channel->fileName.c_str());
     throw std::runtime_error("Could not remove dead channel\n");
 }
 
-#define DEBUG_CHANNEL_DETECTION 1
-void RecordSource::cleanupDeadChannels(){
-    //Iterate through recordStorageSet and remove any dead entries      
-    for(auto itr = recordStorageSet.begin();
-        itr != recordStorageSet.end();
-        ){
-        const std::string& fileName = itr->first;
-        int fileRefCount = Util::getNumFileReferences(fileName);
-        //Hmph... fileRefCount is flaking out and not always returning
-        //our reference. This only seems to happen rarely.
-        //assert(fileRefCount > 0); //We are referencing this file
-        assert(fileRefCount < 3); //There is at most one other reference
-        bool should_delete = false;
-        if (fileRefCount <= 1){  //At most us referencing the file
-#if DEBUG_CHANNEL_DETECTION == 1
-            fprintf(stderr,"Detected dead channel: %s\n", fileName.c_str());
-#endif
-            should_delete = true;
+bool ChannelUtils::isDead(const Channel& channel){
+    const RecordStorage* records = channel.records;
+    //A clean thread exit tells us directly
+    if (records->producerExited.load(std::memory_order_acquire)){
+        return true;
+    }
+    //Otherwise the producer may have crashed or called exit()
+    if (channel.producerPidfd >= 0){
+        if (Util::pidfdExited(channel.producerPidfd)){
+            return true;
         }
-        if (should_delete){
-            closeAndRemoveRecordSink(fileName, itr->second);
-            itr = recordStorageSet.erase(itr);
-        } else {
-            ++itr;
+    } else if (kill(records->producerPid, 0) != 0 && errno == ESRCH){
+        return true;
+    }
+    return !Util::isThreadAlive(records->producerPid, records->producerTid);
+}
+
+bool ChannelUtils::isDrained(const Channel& channel){
+    return channel.records->all.empty() && channel.records->SLAexceeded.empty();
+}
+
+void ChannelUtils::setConsumerDoorbell(const Channel& channel, uint32_t i){
+    //Ordered before the consumer's next prepareWait, so a producer that
+    //still rings the old doorbell pushed early enough for the consumer's
+    //last check to see it
+    channel.records->consumerDoorbell.store(i, std::memory_order_seq_cst);
+}
+
+uint64_t ChannelUtils::getDroppedRecords(const Channel& channel){
+    return channel.records->droppedRecords.load(std::memory_order_relaxed);
+}
+
+ChannelSet::ChannelSet() :
+    channels(),
+    channelIndex(),
+    allScheduler(&RecordStorage::all),
+    SLAexceededScheduler(&RecordStorage::SLAexceeded)
+{ }
+
+void ChannelSet::add(const Channel& channel){
+    assert(!contains(channel.fileName));
+    channelIndex[channel.fileName] = channels.size();
+    channels.push_back(channel);
+}
+
+bool ChannelSet::remove(const std::string& fileName, Channel* out){
+    auto itr = channelIndex.find(fileName);
+    if (itr == channelIndex.end()){
+        return false;
+    }
+    size_t index = itr->second;
+    channelIndex.erase(itr);
+    *out = channels[index];
+    //Keep channels dense by moving the last channel into the hole
+    if (index != channels.size() - 1){
+        channels[index] = channels.back();
+        channelIndex[channels[index].fileName] = index;
+    }
+    channels.pop_back();
+    //Indices have moved, so start picking afresh
+    allScheduler.burstRemaining = 0;
+    SLAexceededScheduler.burstRemaining = 0;
+    return true;
+}
+
+uint64_t ChannelSet::getDroppedRecords() const {
+    uint64_t dropped = 0;
+    for(auto itr = channels.begin(); itr != channels.end(); ++itr){
+        dropped += ChannelUtils::getDroppedRecords(*itr);
+    }
+    return dropped;
+}
+
+bool ChannelSet::hasRecords() const {
+    for(auto itr = channels.begin(); itr != channels.end(); ++itr){
+        if (!ChannelUtils::isDrained(*itr)){
+            return true;
         }
     }
-    recordsIterator = recordStorageSet.begin();
+    return false;
 }
 
-void RecordSource::updateChannels(){
-    //scan for any new record sinks
-    std::string schemaDir = makeStorageInnerDirname(baseName);
-    DIR* channels = opendir(schemaDir.c_str());
-    struct dirent* entry;
-    if (!channels){
-        //This can occur if the directory hasn't been created yet
-        goto out; 
+RecordStorage* ChannelSet::pickChannel(Scheduler* scheduler){
+    size_t numChannels = channels.size();
+    if (numChannels == 0){
+        return NULL;
     }
-    while((entry = readdir(channels)) != NULL){
-        //Only pay attention to files that have a "rec_" prefix
-        if (strstr(entry->d_name, "rec_") ==
-                entry->d_name){
-            //Valid channel
-            std::string fileName = schemaDir+"/"+entry->d_name;
-            //Do we already have this channel open?
-            if (recordStorageSet.find(fileName) == recordStorageSet.end()){
-#if DEBUG_CHANNEL_DETECTION == 1
-                fprintf(stderr,"Found new channel: %s\n", fileName.c_str());
-#endif
-                RecordStorage* records = RecordStorageUtils::openStorageFile(
-                    fileName);
-                recordStorageSet[fileName] = records;
+    size_t best = numChannels;
+    size_t bestSize = 0;
+    if (++scheduler->picks % SELECT_RECORDS_FAIRNESS_INTERVAL == 0){
+        //Round-robin pick, bounds how long any channel can be starved
+        for(size_t i = 0; i < numChannels; i++){
+            size_t index = (scheduler->roundRobinCursor + i) % numChannels;
+            size_t size = (channels[index].records->*(scheduler->queue)).size();
+            if (size > 0){
+                best = index;
+                bestSize = size;
+                scheduler->roundRobinCursor = (index + 1) % numChannels;
+                break;
+            }
+        }
+    } else {
+        //Fullest channel first, it is the closest to dropping records
+        for(size_t i = 0; i < numChannels; i++){
+            size_t size = (channels[i].records->*(scheduler->queue)).size();
+            if (size > bestSize){
+                best = i;
+                bestSize = size;
             }
         }
     }
-out:
-    //timeLastUpdateRecords = Cycles::rdtsc();    
-    channelsVersion = channelsAvailableVersion->load(std::memory_order_relaxed);
-    recordsIterator = recordStorageSet.begin();
+    if (best == numChannels){
+        //All empty
+        return NULL;
+    }
+    scheduler->current = best;
+    //This call pops one, stay for the rest of what was there
+    scheduler->burstRemaining = bestSize - 1;
+    return channels[best].records;
+}
+
+void RecordSource::cleanupDeadChannels(){
+    //Iterate through channels and remove any dead entries      
+    std::vector<std::string> dead;
+    for(size_t i = 0; i < channelSet.size(); i++){
+        const Channel& channel = channelSet.get(i);
+        //Hang on to the channel until its records have been popped
+        if (ChannelUtils::isDead(channel) && ChannelUtils::isDrained(channel)){
+            dead.push_back(channel.fileName);
+        }
+    }
+    for(auto itr = dead.begin(); itr != dead.end(); ++itr){
+        Channel channel;
+        channelSet.remove(*itr, &channel);
+        droppedByRemovedChannels += ChannelUtils::getDroppedRecords(channel);
+        ChannelUtils::closeAndRemoveChannel(&channel);
+    }
+}
+
+bool RecordSource::waitForRecords(uint64_t timeoutMicros){
+    if (!initialized) return false;
+    checkForNewChannels();
+    if (channelSet.hasRecords()){
+        return true;
+    }
+    Doorbell* doorbell = discovery.getDoorbell(0);
+    uint32_t ticket = doorbell->prepareWait();
+    //Producers that pushed before they could see us waiting did not ring,
+    //so look once more now that they can
+    if (!channelSet.hasRecords() && !discovery.hasNewChannels()){
+        doorbell->wait(ticket, timeoutMicros);
+    }
+    doorbell->finishWait();
+    checkForNewChannels();
+    return channelSet.hasRecords();
+}
+
+void RecordSource::openChannels(const std::vector<std::string>& fileNames){
+    for(auto itr = fileNames.begin(); itr != fileNames.end(); ++itr){
+        //Do we already have this channel open?
+        if (channelSet.contains(*itr)){
+            continue;
+        }
+        //The channel may already have died and been removed
+        if (access(itr->c_str(), F_OK) != 0){
+            continue;
+        }
+        Channel channel = ChannelUtils::openChannel(*itr);
+        ChannelUtils::setConsumerDoorbell(channel, 0);
+        channelSet.add(channel);
+    }
+}
+
+void RecordSource::updateChannels(){
+    std::vector<std::string> fileNames;
+    discovery.scanDirectory(&fileNames);
+    openChannels(fileNames);
+}
+
+void RecordSource::discoverChannels(){
+    std::vector<std::string> fileNames;
+    discovery.poll(&fileNames);
+    openChannels(fileNames);
 }
 
 } //namespace DDTrace
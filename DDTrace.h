@@ -63,10 +63,56 @@ const size_t MAX_COUNTERS_PER_COUNTERTYPE = 1;
 const uint64_t CHECK_RECORDS_INTERVAL = 1000000;
 
 /**
-  * When round-robining around worker thread's records, stay on a
-  * particular worker thread for at least this many record poll attempts
+  * When the RecordSource picks the next worker thread's records to drain, it
+  * normally picks the fullest. Every this many picks it round-robins
+  * instead, so that no worker thread is starved by busier ones.
   */
-const size_t SELECT_RECORDS_REUSE_COUNTER = 8;
+const size_t SELECT_RECORDS_FAIRNESS_INTERVAL = 8;
+
+/**
+  * Room for the name of a channel file within the schema directory,
+  * including the null terminator. Channels are named rec_XXXXXX.
+  */
+const size_t MAX_CHANNEL_NAME_LENGTH = 16;
+
+/**
+  * Number of channel creations remembered by the ChannelRegistry. A
+  * RecordSource that falls further behind than this rescans the schema
+  * directory.
+  */
+const size_t CHANNEL_REGISTRY_SIZE = 1024;
+
+/**
+  * Time, in microseconds, a RecordSource waits on a ChannelRegistry entry
+  * that is still being written before it rescans the schema directory
+  * instead. A producer that dies while appending never finishes its entry,
+  * and every entry after it would go unread until the ring laps it.
+  */
+const uint64_t CHANNEL_REGISTRY_STUCK_TIMEOUT = 10000;
+
+/**
+  * A RecordSink rings the Doorbell of its channel's consumer, once that
+  * consumer has gone to sleep, when this many records are waiting in a
+  * queue. 1 rings on the first record pushed after the consumer found its
+  * queues empty; larger values trade wakeup latency for fewer syscalls when
+  * the consumer is idle.
+  */
+const size_t DOORBELL_BATCH_SIZE = 1;
+
+/**
+  * Time interval, in microseconds, after which a RecordSink rings for its
+  * sleeping consumer even if fewer than DOORBELL_BATCH_SIZE records are
+  * waiting. Only checked when the producer pushes, so a producer that goes
+  * quiet leaves its last records to the consumer's wait timeout.
+  */
+const uint64_t DOORBELL_MAX_DELAY = 100;
+
+/**
+  * Number of Doorbells in a ChannelRegistry. Doorbell 0 belongs to
+  * RecordSources and is also rung when a channel is created; each shard of a
+  * ShardedRecordSource has one of the others to itself.
+  */
+const size_t CHANNEL_DOORBELLS = 256;
 
 /** 
   * Annotations can have this many characters in them (not including the
@@ -127,6 +173,8 @@ extern __thread bool threadInitialized;
   */
 class PerfRecord {
   friend class PerfCounters;
+  friend class TraceCodec;
+  friend class ColumnStoreWriter;
   public:
         /**
          * Extract the userspace cycles from this record.
@@ -181,6 +229,13 @@ class PerfRecord {
             }
         }
 
+        /**
+         * The CounterType that was in use when this record was taken
+         */
+        CounterType getCounterType() const {
+            return recordCounterType;
+        }
+
         PerfRecord() :
         counters{0},
         recordCounterType(INVALID_COUNTER_TYPE) {}
@@ -222,6 +277,9 @@ struct IntervalRecord {
     const char* getAnnotation() const {
         return annotation;
     }
+    double getCyclesPerSec() const {
+        return cyclesPerSec;
+    }
     //TODO fill in the rest of the functions needed here. Maybe use macros to
     //make this easier to write?
     uint64_t getStartNanoseconds() const {        
@@ -301,7 +359,7 @@ struct IntervalRecord {
  * the old RecordState data-incompatible with new ones
  */
 inline const char* getRecordStateSchema(){
-    return "5";
+    return "9";
 }
 
 /*
@@ -314,19 +372,58 @@ inline const char* getRecordStateSchema(){
  */
 class RecordStorage {
   friend class RecordSink;
-  friend class RecordSource;
+  friend class ChannelSet;
+  friend class ChannelUtils;
   friend class RecordStorageUtils;
   private:
-    RecordStorage () : all(), SLAexceeded() {
+    RecordStorage () : 
+    producerPid(getpid()),
+    producerTid(Util::gettid()),
+    producerExited(0),
+    consumerDoorbell(0),
+    droppedRecords(0),
+    all(), 
+    SLAexceeded() {
         //counterType = DDTrace::counterType;
     }
 
+    /**
+      * The process and thread writing to this channel. Used by the
+      * RecordSource to notice producers that died without closing the
+      * channel.
+      */
+    pid_t producerPid;
+    pid_t producerTid;
+    /**
+      * Set to 1 by the producer when its thread exits cleanly, so the
+      * RecordSource can retire the channel without asking the kernel.
+      */
+    std::atomic<uint32_t> producerExited;
+    /**
+      * The Doorbell in the ChannelRegistry that the consumer of this channel
+      * sleeps on. Set by the consumer when it takes the channel over.
+      */
+    std::atomic<uint32_t> consumerDoorbell;
+    /**
+      * Number of records the producer could not push because a queue was
+      * full. Only written by the producer.
+      */
+    std::atomic<uint64_t> droppedRecords;
+
+    void recordDropped(){
+        droppedRecords.store(
+            droppedRecords.load(std::memory_order_relaxed) + 1,
+            std::memory_order_relaxed);
+    }
+
     /**
       * A queue on which all intervals are recorded
       */
     SPSCQueue<IntervalRecord, RECORD_QUEUE_SIZE> all;
     /**
-      * A queue on which only exceptional intervals are recorded
+      * Overflow for all: exceptional intervals (see SLARules) that did not
+      * fit on it are recorded here instead. Every interval is on at most one
+      * of the two queues, so consumers must pop both.
       */
     SPSCQueue<IntervalRecord, RECORD_QUEUE_SIZE> SLAexceeded;
 
@@ -349,10 +446,190 @@ class RecordStorageUtils {
   public:
     static RecordStorage* openStorageFile(const std::string& storageFile);  
 };
-typedef uint64_t ChannelsVersion;
-class ChannelsVersionUtils {
+/**
+  * Lets an idle consumer sleep until a RecordSink has records for it. Lives
+  * in the ChannelRegistry, which holds CHANNEL_DOORBELLS of them; the
+  * producer of a channel rings the one its consumer named in the channel.
+  *
+  * A consumer arms its doorbell before making a final check of its queues,
+  * and producers check it after publishing a record, so at least one of the
+  * two sees the other: a record is never left behind with the consumer
+  * asleep until its timeout. The first producer to see the doorbell armed
+  * disarms it and makes the one syscall that wakes the consumer, so the push
+  * path stays a fence and a few loads whether or not the consumer is busy.
+  */
+class Doorbell {
+  public:
+    /**
+      * Called by producers after publishing a record. Returns true iff the
+      * consumer is sleeping or about to, and nobody has rung for it since.
+      */
+    bool isArmed() const {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return armed.load(std::memory_order_relaxed) != 0;
+    }
+
+    /**
+      * Wakes the sleeping consumer, unless another producer already did
+      */
+    void ring(){
+        uint32_t expected = 1;
+        if (!armed.compare_exchange_strong(expected, 0)){
+            return;
+        }
+        sequence.fetch_add(1, std::memory_order_release);
+        Util::futexWake(reinterpret_cast<uint32_t*>(&sequence));
+    }
+
+    /**
+      * Called by a consumer before its last check for records. Returns a
+      * ticket to pass to wait.
+      */
+    uint32_t prepareWait(){
+        armed.store(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return sequence.load(std::memory_order_acquire);
+    }
+
+    /**
+      * Sleeps for up to timeoutMicros microseconds, unless the doorbell has
+      * been rung since prepareWait returned ticket
+      */
+    void wait(uint32_t ticket, uint64_t timeoutMicros){
+        Util::futexWait(reinterpret_cast<uint32_t*>(&sequence), ticket,
+                        timeoutMicros);
+    }
+
+    /**
+      * Must follow every prepareWait, whether or not we went to sleep
+      */
+    void finishWait(){
+        armed.store(0, std::memory_order_relaxed);
+    }
+
+  private:
+    /**
+      * Lives in shared memory and is zero-initialized by ftruncate
+      */
+    Doorbell();
+
+    /**
+      * The futex word, bumped on every ring
+      */
+    std::atomic<uint32_t> sequence;
+    /**
+      * 1 from prepareWait until finishWait or the first ring. A consumer
+      * that dies while sleeping leaves this set, which only costs one
+      * needless ring.
+      */
+    std::atomic<uint32_t> armed;
+} __attribute__((aligned(64)));
+
+/**
+  * Append-only log of the names of channels created under a baseName, shared
+  * by every RecordSink and RecordSource using it.
+  *
+  * Producers append the name of each channel they create, and each
+  * RecordSource tails the log from where it last stopped. This replaces
+  * rescanning the schema directory every time any thread anywhere starts.
+  *
+  * The log is a ring holding the CHANNEL_REGISTRY_SIZE most recent names;
+  * a reader that falls further behind than that is told it was lapped and
+  * must rescan the directory instead.
+  */
+class ChannelRegistry {
+  friend class ChannelRegistryUtils;
   public:
-    static std::atomic<ChannelsVersion>* openChannelsVersion(const std::string& baseName);
+    enum ReadResult {
+        READ_OK,
+        READ_NOT_YET, //The producer is still writing this entry
+        READ_LAPPED   //This entry has already been overwritten
+    };
+
+    /**
+      * Appends a channel name. Called by producers, may be called by any
+      * number of them concurrently.
+      */
+    void append(const char* name){
+        uint64_t position = numAppended.fetch_add(1);
+        Entry& entry = entries[position % CHANNEL_REGISTRY_SIZE];
+        //Seqlock-style: readers that see the sequence change under them
+        //throw away what they read
+        entry.sequence.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        strncpy(entry.name, name, MAX_CHANNEL_NAME_LENGTH - 1);
+        entry.name[MAX_CHANNEL_NAME_LENGTH - 1] = 0;
+        entry.sequence.store(position + 1, std::memory_order_release);
+    }
+
+    /**
+      * Returns the number of names ever appended
+      */
+    uint64_t size() const {
+        return numAppended.load(std::memory_order_acquire);
+    }
+
+    /**
+      * Copies the name appended at position (counting from 0 since the
+      * registry was created) into name, which must have room for
+      * MAX_CHANNEL_NAME_LENGTH characters.
+      */
+    ReadResult read(uint64_t position, char* name) const {
+        if (size() - position > CHANNEL_REGISTRY_SIZE){
+            return READ_LAPPED;
+        }
+        const Entry& entry = entries[position % CHANNEL_REGISTRY_SIZE];
+        uint64_t before = entry.sequence.load(std::memory_order_acquire);
+        if (before < position + 1){
+            return READ_NOT_YET;
+        }
+        if (before > position + 1){
+            return READ_LAPPED;
+        }
+        memcpy(name, entry.name, MAX_CHANNEL_NAME_LENGTH);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (entry.sequence.load(std::memory_order_relaxed) != before){
+            return READ_LAPPED;
+        }
+        name[MAX_CHANNEL_NAME_LENGTH - 1] = 0;
+        return READ_OK;
+    }
+
+  private:
+    /**
+      * Lives in shared memory and is zero-initialized by ftruncate
+      */
+    ChannelRegistry();
+
+    struct Entry {
+        /**
+          * position + 1 of the name in this entry, or 0 while it is being
+          * written
+          */
+        std::atomic<uint64_t> sequence;
+        char name[MAX_CHANNEL_NAME_LENGTH];
+    };
+
+    std::atomic<uint64_t> numAppended;
+    Entry entries[CHANNEL_REGISTRY_SIZE];
+
+  public:
+    /**
+      * Returns Doorbell i. i comes from shared memory, so it is wrapped
+      * rather than trusted.
+      */
+    Doorbell* getDoorbell(uint32_t i){
+        return &doorbells[i % CHANNEL_DOORBELLS];
+    }
+
+  private:
+    Doorbell doorbells[CHANNEL_DOORBELLS];
+};
+
+class ChannelRegistryUtils {
+  public:
+    static ChannelRegistry* openChannelRegistry(const std::string& baseName);
+    static void closeChannelRegistry(ChannelRegistry* registry);
 };
 
 class ThreadInitializer {
@@ -554,26 +831,22 @@ class RecordSink {
 #if ENABLE_EXTRA_LOGGING == 1
        IntervalRecord intervalRecord (startCycles, endCycles, *clock, 
        serverId, Cycles::perSecond(), countersDiff, annotation);
-       {
-#if DEBUG_DROPPED_RECORDS == 1
-           bool couldPush = records->all.push(intervalRecord);
-           if (!couldPush){
-                fprintf(stderr, "Disk thread has fallen behind, dropping a packet\n");
-           }
-#else
-           records->all.push(intervalRecord);
-#endif
+       size_t queued;
+       if (records->all.push(intervalRecord, &queued)){
+           signalConsumer(&firstQueuedCycles[0], queued, endCycles);
+           return;
        }
-       if (slaRules.exceedsSLAs(intervalRecord)){
+       //The consumer has fallen behind. Keep the records it most needs on
+       //the overflow queue rather than lose them with the rest.
+       if (slaRules.exceedsSLAs(intervalRecord) &&
+           records->SLAexceeded.push(intervalRecord, &queued)){
+           signalConsumer(&firstQueuedCycles[1], queued, endCycles);
+           return;
+       }
+       records->recordDropped();
 #if DEBUG_DROPPED_RECORDS == 1
-           bool couldPush = records->SLAexceeded.push(intervalRecord);
-           if (!couldPush){
-                fprintf(stderr, "Disk thread has fallen behind, dropping a packet\n");
-           }
-#else
-           records->SLAexceeded.push(intervalRecord);
+       fprintf(stderr, "Disk thread has fallen behind, dropping a packet\n");
 #endif
-       }
 #if 0
        auto openIntervals = &records->getPerThreadStorage()->openIntervals;
        if (openIntervals->empty()){
@@ -584,8 +857,38 @@ class RecordSink {
 #endif
     }
 
+    /**
+      * Marks the channel as no longer being written to. Called automatically
+      * when the thread that called init exits.
+      */
+    void close();
+
     ~RecordSink();
   private:
+    /**
+      * Rings the doorbell of our consumer if it is sleeping and the queue we
+      * just pushed to, now holding queued records, is worth waking it for.
+      *
+      * queued can be stale (too high) if the consumer popped concurrently,
+      * so we ring whenever the threshold is met rather than only when it is
+      * crossed; ringing disarms the doorbell, so this still makes one
+      * syscall per time the consumer goes idle.
+      */
+    void signalConsumer(uint64_t* firstQueued, size_t queued, uint64_t now){
+        if (queued == 1){
+            *firstQueued = now;
+        }
+        Doorbell* doorbell = registry->getDoorbell(
+            records->consumerDoorbell.load(std::memory_order_relaxed));
+        if (!doorbell->isArmed()){
+            return;
+        }
+        if (queued >= DOORBELL_BATCH_SIZE ||
+            Cycles::toMicroseconds(now - *firstQueued) >= DOORBELL_MAX_DELAY){
+            doorbell->ring();
+        }
+    }
+
     /**
      * The name of the file that we write our self-describing counters
      * to.
@@ -596,6 +899,283 @@ class RecordSink {
      * Communication buffer between RecordSink and RecordSource
      */ 
     RecordStorage* records;
+
+    /**
+      * Kept mapped for its Doorbells
+      */
+    ChannelRegistry* registry;
+
+    /**
+      * When the oldest record in each queue (all, then SLAexceeded) was
+      * pushed, as of the last time that queue was empty
+      */
+    uint64_t firstQueuedCycles[2];
+};
+
+/**
+ * A channel from a RecordSink, as seen by a consumer
+ */
+struct Channel {
+    RecordStorage* records;
+    /**
+      * pidfd of the producer process, or -1 if pidfds are unsupported
+      */
+    int producerPidfd;
+    std::string fileName;
+};
+
+class ChannelUtils {
+  public:
+    /**
+      * Maps the channel in fileName.
+      * Throws a std::runtime_error if it cannot be opened.
+      */
+    static Channel openChannel(const std::string& fileName);
+    /**
+      * Unmaps the channel and closes its pidfd, leaving the channel itself
+      * for the next consumer
+      */
+    static void closeChannel(Channel* channel);
+    /**
+      * Unmaps the channel and deletes its backing file.
+      * Should only be called after the channel is dead
+      */
+    static void closeAndRemoveChannel(Channel* channel);
+    /**
+      * Returns true iff the producer of channel has gone away
+      */
+    static bool isDead(const Channel& channel);
+    /**
+      * Returns true iff both of channel's queues are empty
+      */
+    static bool isDrained(const Channel& channel);
+    /**
+      * Has the producer of channel ring Doorbell i when it has records for
+      * us. Must be called by the channel's consumer before it next waits.
+      */
+    static void setConsumerDoorbell(const Channel& channel, uint32_t i);
+    /**
+      * Returns the number of records the producer of channel has dropped
+      */
+    static uint64_t getDroppedRecords(const Channel& channel);
+};
+
+/**
+ * Finds the channels created under a baseName, by tailing the
+ * ChannelRegistry.
+ */
+class ChannelDiscovery {
+  public:
+    ChannelDiscovery();
+    /**
+      * Unmaps the ChannelRegistry
+      */
+    ~ChannelDiscovery();
+
+    /**
+      * Opens the ChannelRegistry of baseName.
+      * Throws a std::runtime_error on failure.
+      */
+    void init(const std::string& baseName);
+
+    /**
+      * Returns true iff channels have been created since the last call to
+      * poll or scanDirectory. Cheap enough to call on every pop.
+      */
+    bool hasNewChannels() const {
+        return registryPosition != registry->size();
+    }
+
+    /**
+      * Appends the file names of channels created since the last call to
+      * fileNames. If we fell too far behind the registry, or an entry has
+      * been half written for CHANNEL_REGISTRY_STUCK_TIMEOUT, appends every
+      * channel in the schema directory instead, so callers must ignore
+      * channels they already have.
+      */
+    void poll(std::vector<std::string>* fileNames);
+
+    /**
+      * Appends the file name of every channel in the schema directory
+      */
+    void scanDirectory(std::vector<std::string>* fileNames);
+
+    /**
+      * Doorbell i of baseName's ChannelRegistry, see CHANNEL_DOORBELLS
+      */
+    Doorbell* getDoorbell(uint32_t i){
+        return registry->getDoorbell(i);
+    }
+
+  private:
+    /**
+      * Base name used for locating shared memory files
+      * Must equal the name passed to RecordSink::init
+      */
+    std::string baseName;
+
+    /**
+      * Log of channel names used to discover new channels.
+      * registryPosition is the number of entries we have consumed.
+      */
+    ChannelRegistry* registry;
+    uint64_t registryPosition;
+
+    /**
+      * The entry poll last found still being written, and when it first
+      * did, see CHANNEL_REGISTRY_STUCK_TIMEOUT
+      */
+    uint64_t stuckPosition;
+    uint64_t stuckSinceCycles;
+};
+
+/**
+ * The channels drained by one consumer thread, and the state used to decide
+ * which of them to pop from next.
+ *
+ * Channels are kept in a dense vector. When a new channel is needed we read
+ * every queue's fill level and drain the fullest, popping up to the number
+ * of records it held when picked. Every SELECT_RECORDS_FAIRNESS_INTERVAL
+ * picks, the next non-empty channel in round-robin order is taken instead,
+ * so a channel with records waits at most SELECT_RECORDS_FAIRNESS_INTERVAL
+ * * (number of channels) picks.
+ */
+class ChannelSet {
+  public:
+    ChannelSet();
+
+    bool contains(const std::string& fileName) const {
+        return channelIndex.find(fileName) != channelIndex.end();
+    }
+
+    void add(const Channel& channel);
+
+    /**
+      * Removes the channel in fileName from the set, without closing it.
+      * Returns false if there is no such channel.
+      */
+    bool remove(const std::string& fileName, Channel* out);
+
+    size_t size() const {
+        return channels.size();
+    }
+
+    const Channel& get(size_t index) const {
+        return channels[index];
+    }
+
+    /**
+      * Returns the channel in fileName, or NULL if it is not in the set
+      */
+    const Channel* find(const std::string& fileName) const {
+        auto itr = channelIndex.find(fileName);
+        if (itr == channelIndex.end()){
+            return NULL;
+        }
+        return &channels[itr->second];
+    }
+
+    /**
+      * Pops an IntervalRecord from the ALL queue of some channel
+      *
+      * Returns false if there are no records to get
+      */
+    bool popRecord(IntervalRecord* out){
+        RecordStorage* records = selectRecords(&allScheduler);
+        if (!records){
+            return false;
+        }
+        return records->all.pop(out);
+    }
+
+    /**
+      * Pops an IntervalRecord from the SLAexceeded queue of some channel,
+      * see RecordStorage::SLAexceeded
+      *
+      * Returns false if there are no records to get
+      */
+    bool popSLAExceededRecord(IntervalRecord* out){
+        RecordStorage* records = selectRecords(&SLAexceededScheduler);
+        if (!records){
+            return false;
+        }
+        return records->SLAexceeded.pop(out);
+    }
+
+    /**
+      * Returns the number of records dropped by the producers of the
+      * channels currently in the set
+      */
+    uint64_t getDroppedRecords() const;
+
+    /**
+      * Returns true iff some queue of some channel has records to pop
+      */
+    bool hasRecords() const;
+
+  private:
+    typedef SPSCQueue<IntervalRecord, RECORD_QUEUE_SIZE> RecordQueue;
+
+    /**
+      * Where we are in draining one of the two queues of every channel
+      */
+    struct Scheduler {
+        /**
+          * Which of the queues of RecordStorage this schedules
+          */
+        RecordQueue RecordStorage::*queue;
+        /**
+          * Index in channels of the channel being drained
+          */
+        size_t current;
+        /**
+          * Number of records left to pop from current before picking
+          * again
+          */
+        size_t burstRemaining;
+        /**
+          * Number of picks made, used to interleave round-robin picks
+          */
+        uint64_t picks;
+        /**
+          * Next channel to consider on a round-robin pick
+          */
+        size_t roundRobinCursor;
+
+        Scheduler(RecordQueue RecordStorage::*queue) :
+        queue(queue),
+        current(0),
+        burstRemaining(0),
+        picks(0),
+        roundRobinCursor(0) {}
+    };
+
+    /**
+      * Arbitrates access to the RecordSinks (one for each worker
+      * thread) in this set.
+      */
+    RecordStorage* selectRecords(Scheduler* scheduler){
+        if (scheduler->burstRemaining > 0){
+            scheduler->burstRemaining--;
+            return channels[scheduler->current].records;
+        }
+        return pickChannel(scheduler);
+    }
+
+    /**
+      * Picks the next channel for scheduler to drain, or returns NULL if
+      * every channel is empty
+      */
+    RecordStorage* pickChannel(Scheduler* scheduler);
+
+    std::vector<Channel> channels;
+    /**
+      * The index in channels of each channel, by fileName
+      */
+    std::unordered_map<std::string, size_t> channelIndex;
+
+    Scheduler allScheduler;
+    Scheduler SLAexceededScheduler;
 };
 
 /**
@@ -604,6 +1184,8 @@ class RecordSink {
  */
 class RecordSource {
   public:
+    RecordSource();
+
     /**
      * The name passed into this function is recommended to be derived from
      * serverId, but it suffices for it to be different for each server.
@@ -616,15 +1198,21 @@ class RecordSource {
     void init(const std::string& logFile);
     
     /**
-      * Scans for new channels and connects to them.
-      * Resets recordsIterator 
+      * Scans the schema directory for new channels and connects to them.
       */
     void updateChannels();
 
+    /**
+      * Connects to any channels appended to the ChannelRegistry since we
+      * last looked, falling back to updateChannels if we fell too far
+      * behind.
+      */
+    void discoverChannels();
+
     /**
       * Scans through all open channels, permanently removing any
-      * channels where the RecordSink has terminated
-      * Resets recordsIterator 
+      * channels where the RecordSink has terminated and every record has
+      * been popped.
       */
     void cleanupDeadChannels();
 
@@ -635,25 +1223,47 @@ class RecordSource {
       */
     bool popRecord(IntervalRecord* out){
         if (!initialized) return false;
-        RecordStorage* records = selectRecords();
-        if (!records){
-            return false;
-        }
-        return records->all.pop(out);
+        checkForNewChannels();
+        return channelSet.popRecord(out);
     }
     
     /**
-      * Pops an IntervalRecord from the SLAexceeded queue
+      * Pops an IntervalRecord from the SLAexceeded queue, which holds
+      * exceptional records that did not fit on the ALL queue
       *
       * Returns false if there are no records to get
       */
     bool popSLAExceededRecord(IntervalRecord* out) {
         if (!initialized) return false;
-        RecordStorage* records = selectRecords();
-        if (!records){
-            return false;
-        }
-        return records->SLAexceeded.pop(out);
+        checkForNewChannels();
+        return channelSet.popSLAExceededRecord(out);
+    }
+
+    /**
+      * Sleeps until some channel has records to pop, a new channel
+      * appears, or timeoutMicros microseconds pass, whichever is first.
+      * Also returns early if a signal arrives.
+      *
+      * Returns true iff there are records to pop. Lets a consumer that has
+      * nothing to do sleep instead of spinning on popRecord. Sleeps on
+      * Doorbell 0, so only one thread per baseName should call this.
+      */
+    bool waitForRecords(uint64_t timeoutMicros);
+
+    /**
+      * Returns the number of records producers have had to drop (from
+      * either queue) because we did not keep up, summed over every channel
+      * this source has ever been connected to.
+      */
+    uint64_t getDroppedRecords() const {
+        return droppedByRemovedChannels + channelSet.getDroppedRecords();
+    }
+
+    /**
+      * Returns the number of channels we are connected to
+      */
+    size_t getNumChannels() const {
+        return channelSet.size();
     }
 
     /*
@@ -664,15 +1274,9 @@ class RecordSource {
     */
     
   private:
-    /**
-      * Arbitrates access to the RecordSinks (one for each worker
-      * thread) by this RecordSource.
-      */
-    RecordStorage* selectRecords(){
-        //Check if we have new channels
-        if (channelsVersion != channelsAvailableVersion->load(std::memory_order_relaxed)){
-            //Updates records and updates channelsVersion
-            updateChannels(); 
+    void checkForNewChannels(){
+        if (discovery.hasNewChannels()){
+            discoverChannels(); 
         }
 
         /*
@@ -682,43 +1286,20 @@ class RecordSource {
             updateChannels(); 
         }
         */
-        if (++selectRecordsCounter >= SELECT_RECORDS_REUSE_COUNTER){
-            if (recordsIterator == recordStorageSet.end()){
-                recordsIterator = recordStorageSet.begin();
-            } else {
-                ++recordsIterator;
-            }
-            selectRecordsCounter = 0;
-        }
-        if (recordsIterator == recordStorageSet.end()){
-            //No open channels.
-            return NULL;
-        }
-        return recordsIterator->second;
     }
 
-    typedef std::unordered_map<std::string, RecordStorage*> RecordStorageSet;
-    RecordStorageSet recordStorageSet;
-    typedef RecordStorageSet::iterator RecordsIterator;
-    RecordsIterator recordsIterator;
-    /** 
-      * Number of selectRecords called made since last call to
-      * checkUpdateRecords
-      */
-    uint64_t selectRecordsCounter;
-
     /**
-      * Base name used for locating shared memory files
-      * Must equal the name passed to RecordSink::init
+      * Connects to the channels in fileNames we are not connected to already
       */
-    std::string baseName;
+    void openChannels(const std::vector<std::string>& fileNames);
+
+    ChannelDiscovery discovery;
+    ChannelSet channelSet;
 
     /**
-     * Communication integer used to discover new channels
-     * channelsVersion is the current version loaded
-     */
-    std::atomic<ChannelsVersion>* channelsAvailableVersion;
-    ChannelsVersion channelsVersion;
+      * Records dropped by channels we have since removed
+      */
+    uint64_t droppedByRemovedChannels;
 };
 
 /**
@@ -0,0 +1,104 @@
+#include <unistd.h>
+
+#include "Aggregator.h"
+
+namespace DDTrace {
+
+Aggregator::Aggregator() :
+source(),
+buffers(),
+sinks(),
+pipelineDropped(0),
+consumedRecords(0),
+running(false),
+sinkThread() {}
+
+Aggregator::~Aggregator(){
+    stop();
+}
+
+void Aggregator::addSink(AggregatorSink* sink){
+    assert(!running.load());
+    sinks.emplace_back(sink);
+}
+
+void Aggregator::init(const std::string& baseName, size_t numDrainThreads){
+    buffers.clear();
+    for(size_t i = 0; i < numDrainThreads; i++){
+        buffers.emplace_back(new DoubleBuffer());
+        buffers.back()->front.reserve(AGGREGATOR_BUFFER_CAPACITY);
+        buffers.back()->back.reserve(AGGREGATOR_BUFFER_CAPACITY);
+    }
+    //SLAexceeded records are the exceptional ones that did not fit on the
+    //ALL queue, so the sinks get them like any other
+    ShardedRecordSource::BatchCallback callback =
+        [this](size_t shard, const IntervalRecord* records, size_t count){
+            onRecords(shard, records, count);
+        };
+    source.init(baseName, numDrainThreads, callback, callback);
+}
+
+void Aggregator::start(){
+    running.store(true);
+    sinkThread = std::thread(&Aggregator::runSinks, this);
+    source.start();
+}
+
+void Aggregator::stop(){
+    if (!sinkThread.joinable()){
+        return;
+    }
+    //Drain every channel into the buffers first, then let the sink thread
+    //pass on what is left
+    source.stop();
+    running.store(false);
+    sinkThread.join();
+}
+
+void Aggregator::onRecords(size_t shard, const IntervalRecord* records,
+                           size_t count){
+    DoubleBuffer* buffer = buffers[shard].get();
+    std::lock_guard<std::mutex> lock(buffer->mutex);
+    size_t room = AGGREGATOR_BUFFER_CAPACITY - buffer->front.size();
+    if (count > room){
+        pipelineDropped.fetch_add(count - room, std::memory_order_relaxed);
+        count = room;
+    }
+    buffer->front.insert(buffer->front.end(), records, records + count);
+}
+
+void Aggregator::flushBuffers(){
+    for(auto buffer = buffers.begin(); buffer != buffers.end(); ++buffer){
+        {
+            std::lock_guard<std::mutex> lock((*buffer)->mutex);
+            (*buffer)->front.swap((*buffer)->back);
+        }
+        std::vector<IntervalRecord>& back = (*buffer)->back;
+        if (back.empty()){
+            continue;
+        }
+        for(auto sink = sinks.begin(); sink != sinks.end(); ++sink){
+            (*sink)->consume(&back[0], back.size());
+        }
+        consumedRecords.fetch_add(back.size(), std::memory_order_relaxed);
+        back.clear();
+    }
+}
+
+void Aggregator::runSinks(){
+    while (running.load()){
+        usleep(AGGREGATOR_FLUSH_INTERVAL);
+        flushBuffers();
+        uint64_t now = Cycles::rdtsc();
+        for(auto sink = sinks.begin(); sink != sinks.end(); ++sink){
+            (*sink)->tick(now);
+        }
+    }
+    //The drain threads have stopped, so this gets everything
+    flushBuffers();
+    for(auto sink = sinks.begin(); sink != sinks.end(); ++sink){
+        (*sink)->close();
+    }
+}
+
+} //namespace DDTrace
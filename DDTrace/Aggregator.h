@@ -0,0 +1,133 @@
+#ifndef PERFGRAPH_AGGREGATOR_H
+#define PERFGRAPH_AGGREGATOR_H
+
+#include <memory>
+
+#include "DDTrace.h"
+#include "DDTrace/ShardedRecordSource.h"
+
+namespace DDTrace {
+
+/**
+  * Time interval, in microseconds, between handoffs of drained records from
+  * the drain threads to the sinks
+  */
+const uint64_t AGGREGATOR_FLUSH_INTERVAL = 10000;
+
+/**
+  * Records a drain thread may buffer for the sinks before it starts dropping
+  * them. Bounds memory when the sinks fall behind (say, a stalled network
+  * export) without ever making the drain thread wait on them.
+  */
+const size_t AGGREGATOR_BUFFER_CAPACITY = 1 << 16;
+
+/**
+  * Somewhere the Aggregator sends records: a file, a live summary, another
+  * machine. All methods are called on the Aggregator's sink thread, so a sink
+  * may block (to write, rotate a file, reconnect) without holding up the
+  * threads draining channels.
+  */
+class AggregatorSink {
+  public:
+    virtual ~AggregatorSink() {}
+
+    /**
+      * Receives records drained since the last call, in no particular order
+      * across channels
+      */
+    virtual void consume(const IntervalRecord* records, size_t count) = 0;
+
+    /**
+      * Called at least every AGGREGATOR_FLUSH_INTERVAL, even when there are no
+      * records, for time-based work such as rotating files
+      */
+    virtual void tick(uint64_t nowCycles) {}
+
+    /**
+      * Called once, after the last records have been consumed
+      */
+    virtual void close() {}
+};
+
+/**
+ * Drains every channel of a baseName on a ShardedRecordSource and feeds what
+ * it drains to a set of AggregatorSinks.
+ *
+ * Each drain thread appends to the front half of its own double buffer; the
+ * sink thread swaps the halves every AGGREGATOR_FLUSH_INTERVAL and hands the
+ * back half to each sink in turn. The only thing the two sides ever wait on
+ * is the swap itself.
+ */
+class Aggregator {
+  public:
+    Aggregator();
+    ~Aggregator();
+
+    /**
+      * Takes ownership of sink. Must be called before start.
+      */
+    void addSink(AggregatorSink* sink);
+
+    /**
+      * Connects to the channels of baseName. See ShardedRecordSource::init.
+      */
+    void init(const std::string& baseName, size_t numDrainThreads);
+
+    void start();
+
+    /**
+      * Drains every channel, hands the last records to the sinks and closes
+      * them
+      */
+    void stop();
+
+    /**
+      * Returns the number of records lost, either by producers because we
+      * did not drain them fast enough, or by us because the sinks did not
+      * keep up
+      */
+    uint64_t getDroppedRecords() const {
+        return source.getDroppedRecords() +
+            pipelineDropped.load(std::memory_order_relaxed);
+    }
+
+    /**
+      * Returns the number of records handed to the sinks
+      */
+    uint64_t getConsumedRecords() const {
+        return consumedRecords.load(std::memory_order_relaxed);
+    }
+
+  private:
+    struct DoubleBuffer {
+        std::mutex mutex;
+        /**
+          * Filled by the drain thread, under mutex
+          */
+        std::vector<IntervalRecord> front;
+        /**
+          * Emptied by the sink thread, only touched by it
+          */
+        std::vector<IntervalRecord> back;
+    };
+
+    void onRecords(size_t shard, const IntervalRecord* records, size_t count);
+    void runSinks();
+
+    /**
+      * Swaps every double buffer and feeds the back halves to the sinks
+      */
+    void flushBuffers();
+
+    ShardedRecordSource source;
+    std::vector<std::unique_ptr<DoubleBuffer>> buffers;
+    std::vector<std::unique_ptr<AggregatorSink>> sinks;
+
+    std::atomic<uint64_t> pipelineDropped;
+    std::atomic<uint64_t> consumedRecords;
+    std::atomic<bool> running;
+    std::thread sinkThread;
+};
+
+} // End DDTrace
+#endif
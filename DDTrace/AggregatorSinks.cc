@@ -0,0 +1,620 @@
+#include <sys/socket.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "AggregatorSinks.h"
+
+namespace DDTrace {
+
+RotatingFileSink::RotatingFileSink(const std::string& directory,
+                                   const std::string& prefix,
+                                   uint64_t maxBytes, double maxSeconds,
+                                   bool indexRequests) :
+directory(directory),
+prefix(prefix),
+maxBytes(maxBytes),
+maxSeconds(maxSeconds),
+indexRequests(indexRequests),
+file(),
+fileName(),
+requestIndex(),
+openedCycles(0),
+sequence(0) {
+    if (indexRequests){
+        file.setBlockCallback([this](size_t block, const TraceBlockInfo& info,
+                                     const IntervalRecord* records,
+                                     size_t count){
+            requestIndex.addBlock(block, info, records, count);
+        });
+    }
+}
+
+RotatingFileSink::~RotatingFileSink(){
+    //A destructor must not throw, so errors can only be reported here
+    try {
+        closeFile();
+    } catch (const std::exception& e) {
+        fprintf(stderr, "Could not finish %s: %s\n", fileName.c_str(),
+                e.what());
+    }
+}
+
+void RotatingFileSink::openNextFile(uint64_t nowCycles){
+    char name[1024];
+    int written = snprintf(name, sizeof(name), "%s/%s-%ld-%06lu.ddt",
+                           directory.c_str(), prefix.c_str(),
+                           static_cast<long>(time(NULL)), sequence);
+    if (written >= static_cast<int>(sizeof(name))){
+        throw std::runtime_error("RotatingFileSink file name too long");
+    }
+    sequence++;
+    fileName = name;
+    requestIndex.clear();
+    file.open(fileName);
+    openedCycles = nowCycles;
+}
+
+void RotatingFileSink::closeFile(){
+    if (!file.isOpen()){
+        return;
+    }
+    file.close();
+    if (indexRequests){
+        requestIndex.write(RequestIndexUtils::getIndexFileName(fileName),
+                           file.getBytesWritten());
+    }
+}
+
+void RotatingFileSink::consume(const IntervalRecord* records, size_t count){
+    while (count > 0){
+        if (!file.isOpen()){
+            openNextFile(Cycles::rdtsc());
+        }
+        //Split the batch so files stay within maxBytes
+        size_t batch = count;
+        if (maxBytes){
+            uint64_t bytesWritten = file.getBytesWritten();
+            uint64_t room = maxBytes > bytesWritten ?
+                (maxBytes - bytesWritten) / sizeof(IntervalRecord) : 0;
+            batch = std::min<uint64_t>(count, std::max<uint64_t>(room, 1));
+        }
+        file.append(records, batch);
+        records += batch;
+        count -= batch;
+        if (maxBytes && file.getBytesWritten() >= maxBytes){
+            closeFile();
+        }
+    }
+}
+
+void RotatingFileSink::tick(uint64_t nowCycles){
+    if (file.isOpen() && maxSeconds > 0 &&
+        Cycles::toSeconds(nowCycles - openedCycles) >= maxSeconds){
+        closeFile();
+    }
+}
+
+void RotatingFileSink::close(){
+    closeFile();
+}
+
+HistogramSink::HistogramSink(FILE* out, double intervalSeconds) :
+out(out),
+intervalSeconds(intervalSeconds),
+lastPrintCycles(Cycles::rdtsc()),
+histograms() {}
+
+void HistogramSink::consume(const IntervalRecord* records, size_t count){
+    for(size_t i = 0; i < count; i++){
+        Histogram& histogram = histograms[records[i].getAnnotation()];
+        uint64_t elapsed = records[i].getElapsedNanoseconds();
+        size_t bucket = elapsed ? 64 - __builtin_clzll(elapsed) : 0;
+        histogram.buckets[std::min(bucket, NUM_BUCKETS - 1)]++;
+        histogram.count++;
+        histogram.sumNs += elapsed;
+        histogram.maxNs = std::max(histogram.maxNs, elapsed);
+    }
+}
+
+uint64_t HistogramSink::quantileNs(const Histogram& histogram,
+                                   double quantile){
+    uint64_t rank = static_cast<uint64_t>(quantile * histogram.count);
+    uint64_t seen = 0;
+    for(size_t i = 0; i < NUM_BUCKETS; i++){
+        seen += histogram.buckets[i];
+        if (seen > rank){
+            return i == 0 ? 0 : std::min(histogram.maxNs, (1UL << i) - 1);
+        }
+    }
+    return histogram.maxNs;
+}
+
+void HistogramSink::print(){
+    fprintf(out, "%-16s %10s %12s %12s %12s %12s\n", "annotation", "count",
+            "mean ns", "p50 ns", "p99 ns", "max ns");
+    for(auto itr = histograms.begin(); itr != histograms.end(); ++itr){
+        const Histogram& h = itr->second;
+        fprintf(out, "%-16s %10lu %12lu %12lu %12lu %12lu\n",
+                itr->first.empty() ? "-" : itr->first.c_str(), h.count,
+                h.sumNs / h.count, quantileNs(h, 0.5), quantileNs(h, 0.99),
+                h.maxNs);
+    }
+    fflush(out);
+    histograms.clear();
+}
+
+void HistogramSink::tick(uint64_t nowCycles){
+    if (Cycles::toSeconds(nowCycles - lastPrintCycles) < intervalSeconds){
+        return;
+    }
+    lastPrintCycles = nowCycles;
+    if (!histograms.empty()){
+        print();
+    }
+}
+
+void HistogramSink::close(){
+    if (!histograms.empty()){
+        print();
+    }
+}
+
+/**
+  * Returns CLOCK_REALTIME in nanoseconds
+  */
+static uint64_t getUnixNanoseconds(){
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+HdrHistogramSink::HdrHistogramSink(const std::string& fileName,
+                                   double intervalSeconds, size_t topK) :
+fileName(fileName),
+out(fopen(fileName.c_str(), "a")),
+intervalSeconds(intervalSeconds),
+topK(topK),
+lastSnapshotCycles(Cycles::rdtsc()),
+lastSnapshotUnixNanoseconds(getUnixNanoseconds()),
+entries() {
+    if (!out){
+        fprintf(stderr, "Could not open %s for appending\n", fileName.c_str());
+        throw std::runtime_error("Could not open histogram snapshot file");
+    }
+}
+
+HdrHistogramSink::~HdrHistogramSink(){
+    close();
+}
+
+void HdrHistogramSink::add(HistogramField field, Entry& entry,
+                           uint64_t value){
+    if (!entry.histograms[field]){
+        entry.histograms[field].reset(new HdrHistogram());
+    }
+    entry.histograms[field]->record(value);
+}
+
+void HdrHistogramSink::consume(const IntervalRecord* records, size_t count){
+    Key key;
+    memset(&key, 0, sizeof(key));
+    Entry* last = NULL;
+    for(size_t i = 0; i < count; i++){
+        const IntervalRecord& record = records[i];
+        //Records of a channel come in runs from the same server, and often
+        //the same annotation
+        if (!last || key.serverId != record.getServerID() ||
+            strncmp(key.annotation, record.getAnnotation(),
+                    MAX_ANNOTATION_LENGTH)){
+            memset(&key, 0, sizeof(key));
+            memcpy(key.annotation, record.getAnnotation(),
+                   strnlen(record.getAnnotation(), MAX_ANNOTATION_LENGTH));
+            key.serverId = record.getServerID();
+            last = &entries[key];
+            if (!last->histograms[HISTOGRAM_ELAPSED]){
+                last->histograms[HISTOGRAM_ELAPSED].reset(
+                        new HdrHistogram(true));
+                last->slowest.reset(new SlowestIntervals(topK));
+            }
+        }
+        uint64_t elapsed = record.getElapsedNanoseconds();
+        uint64_t requestId = record.getClock().id;
+        last->histograms[HISTOGRAM_ELAPSED]->record(elapsed, requestId);
+        last->slowest->offer(elapsed, requestId);
+
+        const PerfRecord& counters = record.getCountersDiff();
+        uint64_t value;
+        if (counters.getUserspaceCycles(&value)){
+            add(HISTOGRAM_USERSPACE_CYCLES, *last, value);
+        }
+        if (counters.getL3Misses(&value)){
+            add(HISTOGRAM_L3_MISSES, *last, value);
+        }
+        if (counters.getL3References(&value)){
+            add(HISTOGRAM_L3_REFERENCES, *last, value);
+        }
+    }
+}
+
+void HdrHistogramSink::snapshot(){
+    uint64_t now = getUnixNanoseconds();
+    size_t numLines = 0;
+    for(auto itr = entries.begin(); itr != entries.end(); ++itr){
+        for(size_t f = 0; f < NUM_HISTOGRAM_FIELDS; f++){
+            numLines += itr->second.histograms[f] &&
+                itr->second.histograms[f]->getCount();
+        }
+        numLines += itr->second.slowest && itr->second.slowest->size();
+    }
+    HistogramUtils::writeSnapshotHeader(out, lastSnapshotUnixNanoseconds, now,
+                                        numLines);
+    for(auto itr = entries.begin(); itr != entries.end(); ){
+        const Key& key = itr->first;
+        Entry& entry = itr->second;
+        //Every record lands in the elapsed histogram, so an empty one means
+        //the key was idle the whole interval. Free it rather than keep
+        //histograms for every annotation and server ever seen
+        if (!entry.histograms[HISTOGRAM_ELAPSED] ||
+            entry.histograms[HISTOGRAM_ELAPSED]->getCount() == 0){
+            itr = entries.erase(itr);
+            continue;
+        }
+        for(size_t f = 0; f < NUM_HISTOGRAM_FIELDS; f++){
+            HdrHistogram* histogram = entry.histograms[f].get();
+            if (!histogram || histogram->getCount() == 0){
+                continue;
+            }
+            HistogramUtils::writeHistogram(out, key.serverId, key.annotation,
+                    static_cast<HistogramField>(f), *histogram);
+            histogram->clear();
+        }
+        if (entry.slowest && entry.slowest->size()){
+            HistogramUtils::writeSlowest(out, key.serverId, key.annotation,
+                                         *entry.slowest);
+            entry.slowest->clear();
+        }
+        ++itr;
+    }
+    fflush(out);
+    lastSnapshotUnixNanoseconds = now;
+}
+
+void HdrHistogramSink::tick(uint64_t nowCycles){
+    if (Cycles::toSeconds(nowCycles - lastSnapshotCycles) < intervalSeconds){
+        return;
+    }
+    lastSnapshotCycles = nowCycles;
+    snapshot();
+}
+
+void HdrHistogramSink::close(){
+    if (!out){
+        return;
+    }
+    snapshot();
+    fclose(out);
+    out = NULL;
+}
+
+TailSamplingSink::TailSamplingSink(AggregatorSink* durable,
+                                   double windowSeconds, double sampleRate,
+                                   size_t maxRecords) :
+durable(durable),
+windowCycles(Cycles::fromSeconds(windowSeconds)),
+sampleRate(sampleRate),
+maxRecords(std::max<size_t>(1, maxRecords)),
+slots(),
+freeSlots(),
+requests(),
+arrivals(),
+nextSequence(0),
+kept(),
+promotedRequests(0),
+sampledRequests(0),
+discardedRequests(0),
+earlyRequests(0) {}
+
+bool TailSamplingSink::isSampled(uint64_t id) const {
+    //splitmix64 finalizer, so sequential ids are sampled evenly
+    id = (id ^ (id >> 30)) * 0xbf58476d1ce4e5b9UL;
+    id = (id ^ (id >> 27)) * 0x94d049bb133111ebUL;
+    id ^= id >> 31;
+    return id < sampleRate * 18446744073709551616.0;
+}
+
+void TailSamplingSink::release(Request& request, bool keep){
+    for(uint32_t slot = request.first; slot != NO_SLOT; ){
+        if (keep){
+            kept.push_back(slots[slot].record);
+        }
+        freeSlots.push_back(slot);
+        slot = slots[slot].next;
+    }
+    request.first = request.last = NO_SLOT;
+}
+
+bool TailSamplingSink::decideOldest(){
+    Arrival oldest = arrivals.front();
+    arrivals.pop_front();
+    auto itr = requests.find(oldest.id);
+    if (itr == requests.end() || itr->second.sequence != oldest.sequence){
+        return false;
+    }
+    Request& request = itr->second;
+    if (!request.promoted){
+        bool keep = sampleRate > 0 && isSampled(oldest.id);
+        release(request, keep);
+        if (keep){
+            sampledRequests++;
+        } else {
+            discardedRequests++;
+        }
+    }
+    requests.erase(itr);
+    return true;
+}
+
+uint32_t TailSamplingSink::allocateSlot(uint64_t nowCycles){
+    while (freeSlots.empty() && slots.size() >= maxRecords &&
+           !arrivals.empty()){
+        earlyRequests += decideOldest();
+    }
+    if (!freeSlots.empty()){
+        uint32_t slot = freeSlots.back();
+        freeSlots.pop_back();
+        return slot;
+    }
+    slots.push_back(Slot());
+    return slots.size() - 1;
+}
+
+std::unordered_map<uint64_t, TailSamplingSink::Request>::iterator
+TailSamplingSink::findRequest(uint64_t id, uint64_t nowCycles){
+    auto itr = requests.find(id);
+    if (itr != requests.end()){
+        return itr;
+    }
+    Request request;
+    request.first = request.last = NO_SLOT;
+    request.sequence = nextSequence++;
+    request.promoted = false;
+    Arrival arrival;
+    arrival.id = id;
+    arrival.sequence = request.sequence;
+    arrival.cycles = nowCycles;
+    arrivals.push_back(arrival);
+    return requests.insert(std::make_pair(id, request)).first;
+}
+
+void TailSamplingSink::consume(const IntervalRecord* records, size_t count){
+    uint64_t now = Cycles::rdtsc();
+    for(size_t i = 0; i < count; i++){
+        const IntervalRecord& record = records[i];
+        uint64_t id = record.getClock().id;
+        if (findRequest(id, now)->second.promoted){
+            kept.push_back(record);
+            continue;
+        }
+
+        uint32_t slot = allocateSlot(now);
+        //Making room may have decided this very request, look it up after
+        Request& request = findRequest(id, now)->second;
+        slots[slot].record = record;
+        slots[slot].next = NO_SLOT;
+        if (request.last == NO_SLOT){
+            request.first = slot;
+        } else {
+            slots[request.last].next = slot;
+        }
+        request.last = slot;
+
+        if (slaRules.exceedsSLAs(record)){
+            release(request, true);
+            request.promoted = true;
+            promotedRequests++;
+        }
+    }
+    flush();
+}
+
+void TailSamplingSink::tick(uint64_t nowCycles){
+    while (!arrivals.empty() &&
+           nowCycles - arrivals.front().cycles >= windowCycles){
+        decideOldest();
+    }
+    flush();
+    durable->tick(nowCycles);
+}
+
+void TailSamplingSink::flush(){
+    if (!kept.empty()){
+        durable->consume(&kept[0], kept.size());
+        kept.clear();
+    }
+}
+
+void TailSamplingSink::close(){
+    while (!arrivals.empty()){
+        decideOldest();
+    }
+    flush();
+    durable->close();
+}
+
+RequestAssemblySink::RequestAssemblySink(FILE* out, double idleSeconds,
+                                         size_t maxRecords) :
+out(out),
+idleCycles(Cycles::fromSeconds(idleSeconds)),
+maxRecords(std::max<size_t>(1, maxRecords)),
+requests(),
+arrivals(),
+numRecords(0),
+summary(),
+graph(),
+path(),
+summarizedRequests(0),
+earlyRequests(0) {
+    RequestSummaryUtils::writeHeader(out);
+}
+
+void RequestAssemblySink::summarizeOldest(bool complete){
+    auto itr = requests.find(arrivals.front().id);
+    std::pop_heap(arrivals.begin(), arrivals.end());
+    arrivals.pop_back();
+    Request& request = itr->second;
+    RequestSummaryUtils::summarize(&request.records[0], request.records.size(),
+                                   &summary, &graph, &path);
+    summary.complete = complete;
+    RequestSummaryUtils::write(out, summary);
+    numRecords -= request.records.size();
+    requests.erase(itr);
+    summarizedRequests++;
+}
+
+void RequestAssemblySink::consume(const IntervalRecord* records,
+                                  size_t count){
+    uint64_t now = Cycles::rdtsc();
+    for(size_t i = 0; i < count; i++){
+        while (numRecords >= maxRecords){
+            summarizeOldest(false);
+            earlyRequests++;
+        }
+        uint64_t id = records[i].getClock().id;
+        auto inserted = requests.insert(std::make_pair(id, Request()));
+        Request& request = inserted.first->second;
+        if (inserted.second){
+            Arrival arrival;
+            arrival.id = id;
+            arrival.cycles = now;
+            arrivals.push_back(arrival);
+            std::push_heap(arrivals.begin(), arrivals.end());
+        }
+        request.records.push_back(records[i]);
+        request.lastCycles = now;
+        numRecords++;
+    }
+}
+
+void RequestAssemblySink::tick(uint64_t nowCycles){
+    while (!arrivals.empty() &&
+           nowCycles - arrivals.front().cycles >= idleCycles){
+        Arrival& oldest = arrivals.front();
+        uint64_t lastCycles = requests.find(oldest.id)->second.lastCycles;
+        if (nowCycles - lastCycles >= idleCycles){
+            summarizeOldest(true);
+            continue;
+        }
+        //Still active, look again idleCycles after its last interval
+        std::pop_heap(arrivals.begin(), arrivals.end());
+        arrivals.back().cycles = lastCycles;
+        std::push_heap(arrivals.begin(), arrivals.end());
+    }
+    fflush(out);
+}
+
+void RequestAssemblySink::close(){
+    while (!arrivals.empty()){
+        summarizeOldest(true);
+    }
+    fflush(out);
+}
+
+NetworkSink::NetworkSink(const std::string& host, const std::string& port) :
+host(host),
+port(port),
+fd(-1),
+lastConnectCycles(0),
+droppedRecords(0) {}
+
+NetworkSink::~NetworkSink(){
+    disconnect();
+}
+
+bool NetworkSink::connect(){
+    //Don't hammer a receiver that is down
+    uint64_t now = Cycles::rdtsc();
+    if (lastConnectCycles && Cycles::toSeconds(now - lastConnectCycles) < 1){
+        return false;
+    }
+    lastConnectCycles = now;
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* addresses;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0){
+        return false;
+    }
+    for(struct addrinfo* a = addresses; a; a = a->ai_next){
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0){
+            continue;
+        }
+        //Bounds connect as well as send
+        struct timeval timeout;
+        timeout.tv_sec = NETWORK_SINK_SEND_TIMEOUT / 1000000;
+        timeout.tv_usec = NETWORK_SINK_SEND_TIMEOUT % 1000000;
+        if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                       sizeof(timeout)) == 0 &&
+            ::connect(fd, a->ai_addr, a->ai_addrlen) == 0){
+            break;
+        }
+        ::close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addresses);
+    if (fd >= 0){
+        fprintf(stderr, "Connected to %s:%s\n", host.c_str(), port.c_str());
+    }
+    return fd >= 0;
+}
+
+void NetworkSink::disconnect(){
+    if (fd >= 0){
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+void NetworkSink::consume(const IntervalRecord* records, size_t count){
+    if (fd < 0 && !connect()){
+        droppedRecords += count;
+        return;
+    }
+    const char* data = reinterpret_cast<const char*>(records);
+    size_t remaining = count * sizeof(IntervalRecord);
+    while (remaining > 0){
+        ssize_t sent = send(fd, data, remaining, MSG_NOSIGNAL);
+        if (sent < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK){
+                fprintf(stderr, "%s:%s stopped reading, disconnecting\n",
+                        host.c_str(), port.c_str());
+            } else {
+                fprintf(stderr, "Lost connection to %s:%s\n", host.c_str(),
+                        port.c_str());
+            }
+            disconnect();
+            //Count whole records, a partly sent one is lost with the stream
+            droppedRecords += (remaining + sizeof(IntervalRecord) - 1) /
+                sizeof(IntervalRecord);
+            return;
+        }
+        data += sent;
+        remaining -= sent;
+    }
+}
+
+void NetworkSink::close(){
+    disconnect();
+}
+
+} //namespace DDTrace
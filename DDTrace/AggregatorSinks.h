@@ -0,0 +1,417 @@
+#ifndef PERFGRAPH_AGGREGATORSINKS_H
+#define PERFGRAPH_AGGREGATORSINKS_H
+
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <unordered_map>
+
+#include "DDTrace/Aggregator.h"
+#include "DDTrace/TraceFile.h"
+#include "DDTrace/RequestIndex.h"
+#include "DDTrace/Histogram.h"
+#include "DDTrace/RequestSummary.h"
+
+namespace DDTrace {
+
+/**
+ * Writes records to a series of .ddt files named
+ * <directory>/<prefix>-<unix time>-<sequence>.ddt, starting a new file
+ * once the current one reaches maxBytes or is maxSeconds old (0 disables
+ * either limit). See TraceFile.h for the format. Unless indexRequests is
+ * false, each file gets a request index (see RequestIndex.h) when it is
+ * closed.
+ *
+ * Destroying the sink closes the current file but can only print errors;
+ * call close first to have them thrown.
+ */
+class RotatingFileSink : public AggregatorSink {
+  public:
+    RotatingFileSink(const std::string& directory, const std::string& prefix,
+                     uint64_t maxBytes, double maxSeconds,
+                     bool indexRequests = true);
+    ~RotatingFileSink();
+
+    void consume(const IntervalRecord* records, size_t count);
+    void tick(uint64_t nowCycles);
+    void close();
+
+  private:
+    void openNextFile(uint64_t nowCycles);
+    void closeFile();
+
+    std::string directory;
+    std::string prefix;
+    uint64_t maxBytes;
+    double maxSeconds;
+
+    bool indexRequests;
+
+    TraceFileWriter file;
+    std::string fileName;
+    RequestIndexBuilder requestIndex;
+    uint64_t openedCycles;
+    uint64_t sequence;
+};
+
+/**
+ * Keeps a log2-bucketed histogram of elapsed time per annotation and prints
+ * count, mean, median, 99th percentile and max for each every
+ * intervalSeconds, then starts over.
+ */
+class HistogramSink : public AggregatorSink {
+  public:
+    HistogramSink(FILE* out, double intervalSeconds);
+
+    void consume(const IntervalRecord* records, size_t count);
+    void tick(uint64_t nowCycles);
+    void close();
+
+  private:
+    /**
+      * Bucket i counts elapsed times in [2^(i-1), 2^i) nanoseconds
+      */
+    static const size_t NUM_BUCKETS = 64;
+
+    struct Histogram {
+        uint64_t count;
+        uint64_t sumNs;
+        uint64_t maxNs;
+        uint64_t buckets[NUM_BUCKETS];
+    };
+
+    /**
+      * Upper bound of the bucket holding the given quantile
+      */
+    static uint64_t quantileNs(const Histogram& histogram, double quantile);
+
+    void print();
+
+    FILE* out;
+    double intervalSeconds;
+    uint64_t lastPrintCycles;
+    std::map<std::string, Histogram> histograms;
+};
+
+/**
+ * Keeps an HdrHistogram of elapsed time and of each counter delta per
+ * (serverId, annotation), and every intervalSeconds appends a snapshot of
+ * them to fileName (see HistogramUtils for the format), then starts over.
+ * Each bucket of the elapsed time histograms keeps a request id as an
+ * exemplar, and each (serverId, annotation) keeps the topK slowest intervals
+ * of the snapshot, so a spike can be traced to requests to look up.
+ *
+ * A histogram is only allocated the first time its (serverId, annotation)
+ * and field show up, so consuming a record allocates nothing. A snapshot
+ * frees the histograms of every (serverId, annotation) that saw no records
+ * since the previous one, so memory follows the keys in use rather than
+ * every key ever seen. Snapshots only hold the non-empty buckets of the
+ * histograms that saw records, and add up into percentiles over any span
+ * of time and set of servers.
+ */
+class HdrHistogramSink : public AggregatorSink {
+  public:
+    HdrHistogramSink(const std::string& fileName, double intervalSeconds,
+                     size_t topK = HISTOGRAM_DEFAULT_TOP_K);
+    ~HdrHistogramSink();
+
+    void consume(const IntervalRecord* records, size_t count);
+    void tick(uint64_t nowCycles);
+    void close();
+
+  private:
+    struct Key {
+        char annotation[MAX_ANNOTATION_LENGTH];
+        uint16_t serverId;
+
+        bool operator==(const Key& other) const {
+            return memcmp(this, &other, sizeof(Key)) == 0;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            return TraceFileUtils::checksum(&key, sizeof(key));
+        }
+    };
+
+    struct Entry {
+        std::unique_ptr<HdrHistogram> histograms[NUM_HISTOGRAM_FIELDS];
+        std::unique_ptr<SlowestIntervals> slowest;
+    };
+
+    void add(HistogramField field, Entry& entry, uint64_t value);
+    void snapshot();
+
+    std::string fileName;
+    FILE* out;
+    double intervalSeconds;
+    size_t topK;
+    uint64_t lastSnapshotCycles;
+    uint64_t lastSnapshotUnixNanoseconds;
+    std::unordered_map<Key, Entry, KeyHash> entries;
+};
+
+/**
+ * Intervals TailSamplingSink buffers at most, unless told otherwise
+ */
+const size_t TAIL_SAMPLING_DEFAULT_MAX_RECORDS = 1 << 20;
+
+/**
+ * Tail-based sampling in front of a durable sink (a RotatingFileSink, say):
+ * keeps whole requests that breached an SLA, and only those, or a sample of
+ * the rest.
+ *
+ * Intervals are buffered by request id (VectorClock::id) for windowSeconds
+ * after the first interval of their request arrives. As soon as any of them
+ * exceedsSLAs (see SLARules), the request is promoted: what is buffered goes
+ * to the durable sink, and so does every interval of it that arrives until
+ * the window closes, from whatever thread or server. Requests whose window
+ * closes without a breach are kept with probability sampleRate, decided by a
+ * hash of the id so that every aggregator keeps the same requests, and
+ * discarded otherwise.
+ *
+ * At most maxRecords intervals are buffered. Past that, the oldest requests
+ * are decided early, as if their window had closed.
+ */
+class TailSamplingSink : public AggregatorSink {
+  public:
+    /**
+      * Takes ownership of durable
+      */
+    TailSamplingSink(AggregatorSink* durable, double windowSeconds,
+                     double sampleRate = 0,
+                     size_t maxRecords = TAIL_SAMPLING_DEFAULT_MAX_RECORDS);
+
+    void consume(const IntervalRecord* records, size_t count);
+    void tick(uint64_t nowCycles);
+    void close();
+
+    uint64_t getPromotedRequests() const {
+        return promotedRequests;
+    }
+    uint64_t getSampledRequests() const {
+        return sampledRequests;
+    }
+    uint64_t getDiscardedRequests() const {
+        return discardedRequests;
+    }
+    /**
+      * Requests decided before their window closed, to stay in maxRecords
+      */
+    uint64_t getEarlyRequests() const {
+        return earlyRequests;
+    }
+
+  private:
+    static const uint32_t NO_SLOT = ~0U;
+
+    /**
+      * A buffered interval, and the next one of its request
+      */
+    struct Slot {
+        IntervalRecord record;
+        uint32_t next;
+    };
+
+    struct Request {
+        uint32_t first;
+        uint32_t last;
+        /**
+          * Tells this request from an earlier one with the same id that was
+          * decided early
+          */
+        uint64_t sequence;
+        bool promoted;
+    };
+
+    struct Arrival {
+        uint64_t id;
+        uint64_t sequence;
+        uint64_t cycles;
+    };
+
+    /**
+      * Returns the request of id, starting its window if there is none
+      */
+    std::unordered_map<uint64_t, Request>::iterator findRequest(uint64_t id,
+            uint64_t nowCycles);
+
+    /**
+      * Returns a free slot, deciding the oldest requests early if they hold
+      * every slot
+      */
+    uint32_t allocateSlot(uint64_t nowCycles);
+
+    /**
+      * Hands the buffered intervals of request to the durable sink (or just
+      * frees them, if keep is false)
+      */
+    void release(Request& request, bool keep);
+
+    /**
+      * Keeps or discards the oldest request, unless it was promoted, and
+      * forgets it. Returns whether there was one to decide.
+      */
+    bool decideOldest();
+
+    /**
+      * Hands the intervals queued for the durable sink over
+      */
+    void flush();
+
+    bool isSampled(uint64_t id) const;
+
+    std::unique_ptr<AggregatorSink> durable;
+    uint64_t windowCycles;
+    double sampleRate;
+    size_t maxRecords;
+
+    std::vector<Slot> slots;
+    std::vector<uint32_t> freeSlots;
+    std::unordered_map<uint64_t, Request> requests;
+    /**
+      * Requests in the order their windows started
+      */
+    std::deque<Arrival> arrivals;
+    uint64_t nextSequence;
+    /**
+      * Intervals to hand to the durable sink at the end of this call
+      */
+    std::vector<IntervalRecord> kept;
+
+    uint64_t promotedRequests;
+    uint64_t sampledRequests;
+    uint64_t discardedRequests;
+    uint64_t earlyRequests;
+};
+
+/**
+ * Intervals RequestAssemblySink buffers at most, unless told otherwise
+ */
+const size_t REQUEST_ASSEMBLY_DEFAULT_MAX_RECORDS = 1 << 20;
+
+/**
+ * Assembles requests as their intervals arrive and writes a summary of each
+ * (see RequestSummary) to out, as a line of comma separated values, once it
+ * is over, for live per-request latency without waiting for EventParser.
+ *
+ * Intervals are grouped by request id (VectorClock::id). A request is taken
+ * to be over once none of its intervals has arrived for idleSeconds. At most
+ * maxRecords intervals are buffered. Past that, the requests that have been
+ * idle longest are summarized early, marked incomplete.
+ */
+class RequestAssemblySink : public AggregatorSink {
+  public:
+    RequestAssemblySink(FILE* out, double idleSeconds,
+                        size_t maxRecords = REQUEST_ASSEMBLY_DEFAULT_MAX_RECORDS);
+
+    void consume(const IntervalRecord* records, size_t count);
+    void tick(uint64_t nowCycles);
+    void close();
+
+    uint64_t getSummarizedRequests() const {
+        return summarizedRequests;
+    }
+    /**
+      * Requests summarized before they were idle, to stay in maxRecords
+      */
+    uint64_t getEarlyRequests() const {
+        return earlyRequests;
+    }
+
+  private:
+    struct Request {
+        std::vector<IntervalRecord> records;
+        uint64_t lastCycles;
+    };
+
+    /**
+      * A request and when it was last known to be active, which may be
+      * before its lastCycles. Every buffered request has exactly one.
+      */
+    struct Arrival {
+        uint64_t id;
+        uint64_t cycles;
+
+        /**
+          * Orders arrivals into a min-heap on cycles
+          */
+        bool operator<(const Arrival& other) const {
+            return cycles > other.cycles;
+        }
+    };
+
+    /**
+      * Writes the summary of the request at the top of arrivals and forgets
+      * it
+      */
+    void summarizeOldest(bool complete);
+
+    FILE* out;
+    uint64_t idleCycles;
+    size_t maxRecords;
+
+    std::unordered_map<uint64_t, Request> requests;
+    /**
+      * A heap, earliest cycles on top. As no arrival is later than its
+      * request's lastCycles, no request is idle while the top is not.
+      */
+    std::vector<Arrival> arrivals;
+    size_t numRecords;
+    /**
+      * Reused for every request summarized, along with their memory
+      */
+    RequestSummary summary;
+    RequestGraph graph;
+    CriticalPath path;
+
+    uint64_t summarizedRequests;
+    uint64_t earlyRequests;
+};
+
+/**
+ * Longest time, in microseconds, NetworkSink waits for a connection to be
+ * made or for the receiver to take any more of the stream. Past it the
+ * receiver is taken to be stalled and the connection is dropped, so that
+ * the sink thread never waits on the network for long.
+ */
+const uint64_t NETWORK_SINK_SEND_TIMEOUT = 100000;
+
+/**
+ * Streams records over a TCP connection to host:port as raw IntervalRecord
+ * structs, back to back. There is no header, block, checksum or version,
+ * so the receiver must be built with the same IntervalRecord layout; it
+ * can save the stream as a raw dump, which TraceFileUtils::readRecords
+ * still reads. If the connection drops, or the receiver stops reading for
+ * NETWORK_SINK_SEND_TIMEOUT, records are counted as dropped until we
+ * manage to reconnect, which we try at most once a second. A record cut
+ * short by a drop is lost with the stream.
+ */
+class NetworkSink : public AggregatorSink {
+  public:
+    NetworkSink(const std::string& host, const std::string& port);
+    ~NetworkSink();
+
+    void consume(const IntervalRecord* records, size_t count);
+    void close();
+
+    uint64_t getDroppedRecords() const {
+        return droppedRecords;
+    }
+
+  private:
+    bool connect();
+    void disconnect();
+
+    std::string host;
+    std::string port;
+    int fd;
+    uint64_t lastConnectCycles;
+    uint64_t droppedRecords;
+};
+
+} // End DDTrace
+#endif
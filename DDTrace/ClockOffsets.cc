@@ -0,0 +1,318 @@
+#include <math.h>
+
+#include <algorithm>
+#include <limits>
+#include <queue>
+
+#include "ClockOffsets.h"
+
+namespace DDTrace {
+
+/**
+  * Returns the count that serverId has in clock, or 0 if the clock has no
+  * entry for the server
+  */
+static uint8_t getClockCount(const VectorClock& clock, uint16_t serverId){
+    for(uint64_t i = 0; i < clock.length && i < MAX_VECTORCLOCK_ENTRIES; i++){
+        if (clock.entries[i].serverId == serverId){
+            return clock.entries[i].count;
+        }
+    }
+    return 0;
+}
+
+/**
+  * Appends to wrapped the servers whose count wrapped around somewhere in
+  * the request, in increasing order. A count is a uint8_t, so after 255
+  * increments unrelated intervals of the same server share counts. Counts
+  * start at 1, so the 0 a wrap leaves behind, or the 255 before it, shows
+  * in the clock of the interval that made it and of every one after it.
+  */
+static void findWrappedServers(const IntervalRecord* records, size_t count,
+                               std::vector<uint16_t>* wrapped){
+    for(size_t i = 0; i < count; i++){
+        const VectorClock& clock = records[i].getClock();
+        for(uint64_t e = 0; e < clock.length && e < MAX_VECTORCLOCK_ENTRIES;
+            e++){
+            uint8_t entryCount = clock.entries[e].count;
+            if (entryCount == 0 ||
+                entryCount == std::numeric_limits<uint8_t>::max()){
+                wrapped->push_back(clock.entries[e].serverId);
+            }
+        }
+    }
+    std::sort(wrapped->begin(), wrapped->end());
+    wrapped->erase(std::unique(wrapped->begin(), wrapped->end()),
+                   wrapped->end());
+}
+
+void ClockOffsetEstimator::addRequest(const IntervalRecord* records,
+                                      size_t count){
+    //Counts of a server that wrapped no longer name one interval, so that
+    //server's intervals are left out as the ends of edges
+    std::vector<uint16_t> wrapped;
+    findWrappedServers(records, count, &wrapped);
+
+    //Every interval bumps its own server's entry when it ends, so the
+    //interval on server S whose clock has S=k is the one that produced k.
+    //Index the intervals of this request that way. Intervals recorded
+    //before the next increment share k too, and may end after a message
+    //carrying k left, so keep the earliest end: a later one would make
+    //the delay to the receiver look shorter than it was.
+    typedef std::unordered_map<uint32_t, size_t> CountIndex;
+    CountIndex byCount;
+    for(size_t i = 0; i < count; i++){
+        uint16_t server = records[i].getServerID();
+        recordsPerServer[server]++;
+        uint8_t ownCount = getClockCount(records[i].getClock(), server);
+        if (ownCount == 0){
+            //Clock overflowed before it reached this server
+            continue;
+        }
+        if (std::binary_search(wrapped.begin(), wrapped.end(), server)){
+            continue;
+        }
+        uint32_t key = (static_cast<uint32_t>(server) << 8) | ownCount;
+        auto itr = byCount.find(key);
+        if (itr == byCount.end() ||
+            records[i].getEndCycles() < records[itr->second].getEndCycles()){
+            byCount[key] = i;
+        }
+    }
+
+    //Interval b has seen the end of the interval a that produced each
+    //count of another server in its clock, so a ended before b ended.
+    for(size_t b = 0; b < count; b++){
+        const VectorClock& clock = records[b].getClock();
+        uint16_t bServer = records[b].getServerID();
+        for(uint64_t e = 0; e < clock.length && e < MAX_VECTORCLOCK_ENTRIES; e++){
+            uint16_t aServer = clock.entries[e].serverId;
+            if (aServer == bServer){
+                continue;
+            }
+            uint32_t key = (static_cast<uint32_t>(aServer) << 8) |
+                clock.entries[e].count;
+            auto itr = byCount.find(key);
+            if (itr == byCount.end()){
+                continue;
+            }
+            double aEnd = static_cast<double>(
+                    records[itr->second].getEndNanoseconds());
+            double bEnd = static_cast<double>(records[b].getEndNanoseconds());
+            if (aServer < bServer){
+                Sample sample = {aEnd, bEnd - aEnd};
+                pairs[pairKey(aServer, bServer)].forward.push_back(sample);
+            } else {
+                Sample sample = {bEnd, aEnd - bEnd};
+                pairs[pairKey(bServer, aServer)].reverse.push_back(sample);
+            }
+        }
+    }
+}
+
+/**
+  * Replaces points with its lower (or upper) convex hull, in order of
+  * increasing x. Andrew's monotone chain.
+  */
+template <class Sample>
+static void convexHull(std::vector<Sample>* points, bool lower){
+    std::sort(points->begin(), points->end());
+    std::vector<Sample> hull;
+    for(auto p = points->begin(); p != points->end(); ++p){
+        while (hull.size() >= 2){
+            const Sample& o = hull[hull.size() - 2];
+            const Sample& a = hull[hull.size() - 1];
+            double cross = (a.x - o.x) * (p->y - o.y) - (a.y - o.y) * (p->x - o.x);
+            if ((lower && cross <= 0) || (!lower && cross >= 0)){
+                hull.pop_back();
+            } else {
+                break;
+            }
+        }
+        hull.push_back(*p);
+    }
+    points->swap(hull);
+}
+
+bool ClockOffsetEstimator::fitPair(const PairSamples& samples, PairFit* fit){
+    const double inf = std::numeric_limits<double>::infinity();
+    if (samples.forward.empty() && samples.reverse.empty()){
+        return false;
+    }
+
+    //Center x so that beta * x stays small next to alpha
+    double x0 = inf;
+    double forwardSpan = 0, reverseSpan = 0;
+    std::vector<Sample> forward(samples.forward);
+    std::vector<Sample> reverse(samples.reverse);
+    convexHull(&forward, true);
+    convexHull(&reverse, false);
+    if (!forward.empty()){
+        x0 = std::min(x0, forward.front().x);
+        forwardSpan = forward.back().x - forward.front().x;
+    }
+    if (!reverse.empty()){
+        x0 = std::min(x0, reverse.front().x);
+        reverseSpan = reverse.back().x - reverse.front().x;
+    }
+    for(auto p = forward.begin(); p != forward.end(); ++p){
+        p->x -= x0;
+    }
+    for(auto p = reverse.begin(); p != reverse.end(); ++p){
+        p->x -= x0;
+    }
+
+    //For a given beta, alpha may be anywhere in [lo, hi]
+    auto upperBound = [&](double beta) -> double {
+        double hi = inf;
+        for(auto p = forward.begin(); p != forward.end(); ++p){
+            hi = std::min(hi, p->y - beta * p->x);
+        }
+        return hi;
+    };
+    auto lowerBound = [&](double beta) -> double {
+        double lo = -inf;
+        for(auto p = reverse.begin(); p != reverse.end(); ++p){
+            lo = std::max(lo, p->y - beta * p->x);
+        }
+        return lo;
+    };
+
+    //The gap hi - lo is concave in beta (a min of lines minus a max of
+    //lines), so a ternary search finds the widest one.
+    double beta = 0;
+    if (forwardSpan >= SKEW_MIN_SPAN_NS && reverseSpan >= SKEW_MIN_SPAN_NS){
+        double left = -MAX_CLOCK_SKEW, right = MAX_CLOCK_SKEW;
+        for(int i = 0; i < 100; i++){
+            double m1 = left + (right - left) / 3;
+            double m2 = right - (right - left) / 3;
+            if (upperBound(m1) - lowerBound(m1) <
+                upperBound(m2) - lowerBound(m2)){
+                left = m1;
+            } else {
+                right = m2;
+            }
+        }
+        beta = (left + right) / 2;
+    }
+
+    double hi = upperBound(beta);
+    double lo = lowerBound(beta);
+    double alpha;
+    if (forward.empty()){
+        alpha = lo;
+        fit->errorNs = inf;
+        fit->bounded = false;
+    } else if (reverse.empty()){
+        alpha = hi;
+        fit->errorNs = inf;
+        fit->bounded = false;
+    } else {
+        alpha = (hi + lo) / 2;
+        fit->errorNs = fabs(hi - lo) / 2;
+        //hi < lo means some edge contradicts every line we could pick
+        fit->bounded = hi >= lo;
+    }
+    fit->beta = beta;
+    fit->alpha = alpha - beta * x0;
+    return true;
+}
+
+void ClockOffsetEstimator::solve(ClockOffsets* out) const {
+    out->corrections.clear();
+    out->referenceServer = INVALID_SERVER_ID;
+    if (recordsPerServer.empty()){
+        return;
+    }
+
+    //Reference is the server with the most records
+    uint64_t mostRecords = 0;
+    for(auto itr = recordsPerServer.begin(); itr != recordsPerServer.end(); ++itr){
+        if (itr->second > mostRecords ||
+            (itr->second == mostRecords && itr->first < out->referenceServer)){
+            mostRecords = itr->second;
+            out->referenceServer = itr->first;
+        }
+    }
+
+    std::unordered_map<uint16_t, std::vector<PairFit> > links;
+    for(auto itr = pairs.begin(); itr != pairs.end(); ++itr){
+        PairFit fit;
+        fit.low = itr->first >> 16;
+        fit.high = itr->first & 0xffff;
+        if (!fitPair(itr->second, &fit)){
+            continue;
+        }
+        links[fit.low].push_back(fit);
+        links[fit.high].push_back(fit);
+    }
+
+    //Dijkstra over accumulated error, so each server is corrected via the
+    //tightest chain of estimates. Unbounded links are only used if there is
+    //no other way to reach a server.
+    const double UNBOUNDED_COST = 1e18;
+    typedef std::pair<double, uint16_t> QueueEntry;
+    std::priority_queue<QueueEntry, std::vector<QueueEntry>,
+        std::greater<QueueEntry> > queue;
+    std::unordered_map<uint16_t, double> cost;
+    out->corrections[out->referenceServer] = ClockCorrection();
+    cost[out->referenceServer] = 0;
+    queue.push(QueueEntry(0, out->referenceServer));
+    while (!queue.empty()){
+        QueueEntry top = queue.top();
+        queue.pop();
+        uint16_t from = top.second;
+        if (top.first > cost[from]){
+            continue;
+        }
+        const ClockCorrection fromCorrection = out->corrections[from];
+        auto fits = links.find(from);
+        if (fits == links.end()){
+            continue;
+        }
+        for(auto fit = fits->second.begin(); fit != fits->second.end(); ++fit){
+            //Express the link as to = (1 + beta) * from + alpha
+            uint16_t to;
+            double alpha, beta;
+            if (fit->low == from){
+                to = fit->high;
+                alpha = fit->alpha;
+                beta = fit->beta;
+            } else {
+                to = fit->low;
+                alpha = -fit->alpha / (1 + fit->beta);
+                beta = 1 / (1 + fit->beta) - 1;
+            }
+            double linkCost = fit->bounded ? fit->errorNs : UNBOUNDED_COST;
+            double newCost = top.first + linkCost;
+            auto known = cost.find(to);
+            if (known != cost.end() && known->second <= newCost){
+                continue;
+            }
+            cost[to] = newCost;
+            ClockCorrection correction;
+            correction.skew = (1 + beta) * (1 + fromCorrection.skew) - 1;
+            correction.offsetNs = (1 + beta) * fromCorrection.offsetNs + alpha;
+            correction.errorNs = fromCorrection.errorNs + fit->errorNs;
+            correction.bounded = fromCorrection.bounded && fit->bounded;
+            out->corrections[to] = correction;
+            queue.push(QueueEntry(newCost, to));
+        }
+    }
+}
+
+void ClockOffsets::print(FILE* out) const {
+    fprintf(out, "Clock offsets relative to server %hu:\n", referenceServer);
+    for(auto itr = corrections.begin(); itr != corrections.end(); ++itr){
+        const ClockCorrection& c = itr->second;
+        if (c.bounded){
+            fprintf(out, "  server %hu: offset %.0f ns +/- %.0f ns, skew %.3f ppm\n",
+                    itr->first, c.offsetNs, c.errorNs, c.skew * 1e6);
+        } else {
+            fprintf(out, "  server %hu: offset %.0f ns (unbounded), skew %.3f ppm\n",
+                    itr->first, c.offsetNs, c.skew * 1e6);
+        }
+    }
+}
+
+} //namespace DDTrace
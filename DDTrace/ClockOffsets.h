@@ -0,0 +1,210 @@
+#ifndef PERFGRAPH_CLOCKOFFSETS_H
+#define PERFGRAPH_CLOCKOFFSETS_H
+
+#include <stdint.h>
+#include <cstdio>
+
+#include <vector>
+#include <unordered_map>
+
+#include "DDTrace.h"
+
+namespace DDTrace {
+
+/**
+  * Largest clock skew (as a fraction, so 500 parts per million) that we will
+  * consider when fitting a line to the samples of two servers. TSCs on
+  * anything we run on are far better than this.
+  */
+const double MAX_CLOCK_SKEW = 500e-6;
+
+/**
+  * Skew is only estimated between two servers if both directions of
+  * causality were observed over at least this many nanoseconds. Over shorter
+  * spans the skew term is swamped by network delay and we fit offset only.
+  */
+const double SKEW_MIN_SPAN_NS = 1e9;
+
+/**
+  * The relation between one server's clock and the clock of the reference
+  * server, as estimated by ClockOffsetEstimator:
+  *
+  *     local = (1 + skew) * reference + offsetNs
+  *
+  * where both clocks are measured in nanoseconds
+  * (IntervalRecord::getStartNanoseconds and friends).
+  */
+struct ClockCorrection {
+    /**
+      * Offset of the local clock relative to the reference clock
+      */
+    double offsetNs;
+    /**
+      * Rate at which the local clock drifts away from the reference clock
+      */
+    double skew;
+    /**
+      * Half the width of the window of offsets consistent with every
+      * happens-before edge we observed. The true offset is within
+      * offsetNs +/- errorNs (only meaningful if bounded is true).
+      */
+    double errorNs;
+    /**
+      * False if we only saw causality in one direction on some link between
+      * this server and the reference, in which case offsetNs assumes that
+      * the fastest observed message took no time at all.
+      */
+    bool bounded;
+
+    /**
+      * Converts a timestamp taken on the local clock to the reference clock
+      */
+    int64_t toReferenceNanoseconds(uint64_t localNs) const {
+        return static_cast<int64_t>(
+                (static_cast<double>(localNs) - offsetNs) / (1.0 + skew) + 0.5);
+    }
+
+    ClockCorrection() :
+    offsetNs(0),
+    skew(0),
+    errorNs(0),
+    bounded(true) {}
+};
+
+/**
+  * Per-server clock corrections onto a common reference server's clock.
+  * Produced by ClockOffsetEstimator::solve.
+  */
+class ClockOffsets {
+  friend class ClockOffsetEstimator;
+  public:
+    /**
+      * Returns the correction for serverId, or NULL if we have no estimate
+      * for the server (it never exchanged a request with anyone we know)
+      */
+    const ClockCorrection* getCorrection(uint16_t serverId) const {
+        auto itr = corrections.find(serverId);
+        if (itr == corrections.end()){
+            return NULL;
+        }
+        return &itr->second;
+    }
+
+    /**
+      * Converts a timestamp taken on serverId's clock to the reference
+      * clock. Servers without an estimate are passed through unchanged.
+      */
+    int64_t toReferenceNanoseconds(uint16_t serverId, uint64_t localNs) const {
+        const ClockCorrection* correction = getCorrection(serverId);
+        if (!correction){
+            return static_cast<int64_t>(localNs);
+        }
+        return correction->toReferenceNanoseconds(localNs);
+    }
+
+    uint16_t getReferenceServer() const {
+        return referenceServer;
+    }
+
+    /**
+      * Prints a human readable table of the corrections
+      */
+    void print(FILE* out) const;
+
+    ClockOffsets() :
+    referenceServer(INVALID_SERVER_ID),
+    corrections() {}
+  private:
+    uint16_t referenceServer;
+    std::unordered_map<uint16_t, ClockCorrection> corrections;
+};
+
+/**
+  * Estimates the offset and skew between the clocks of the servers that
+  * produced a set of traces, using only the happens-before edges implied by
+  * the vector clocks of each request.
+  *
+  * If interval b's clock has seen the end of interval a (on another server),
+  * then a ended before b ended in real time. Each such edge between servers L
+  * and H gives a point that must lie on one side of the line relating their
+  * clocks; edges in the other direction give points on the other side. We
+  * take the line that sits in the middle of the widest gap between the lower
+  * convex hull of the former and the upper convex hull of the latter, which
+  * is the usual min-delay estimator. The width of that gap bounds the error.
+  *
+  * Feed it requests with addRequest, then call solve.
+  */
+class ClockOffsetEstimator {
+  public:
+    /**
+      * Records the cross-server happens-before edges of one request.
+      * All records must share the same VectorClock id.
+      */
+    void addRequest(const IntervalRecord* records, size_t count);
+
+    void addRequest(const std::vector<IntervalRecord>& records){
+        if (!records.empty()){
+            addRequest(&records[0], records.size());
+        }
+    }
+
+    /**
+      * Solves for the clock of every server relative to the server with the
+      * most records, propagating corrections along the most accurate chain
+      * of pairwise estimates.
+      */
+    void solve(ClockOffsets* out) const;
+
+    ClockOffsetEstimator() :
+    pairs(),
+    recordsPerServer() {}
+
+  private:
+    /**
+      * One happens-before edge between the pair's low and high server,
+      * x in the low server's nanoseconds and y the high server's reading
+      * minus the low server's reading
+      */
+    struct Sample {
+        double x;
+        double y;
+        bool operator< (const Sample& other) const {
+            return x < other.x || (x == other.x && y < other.y);
+        }
+    };
+
+    /**
+      * Samples for a pair of servers, low serverId first.
+      * Forward edges (low to high) lie above the line relating the two
+      * clocks, reverse edges (high to low) lie below it.
+      */
+    struct PairSamples {
+        std::vector<Sample> forward;
+        std::vector<Sample> reverse;
+    };
+
+    /**
+      * Line relating the clocks of a pair of servers:
+      *     high = (1 + beta) * low + alpha
+      */
+    struct PairFit {
+        uint16_t low;
+        uint16_t high;
+        double alpha;
+        double beta;
+        double errorNs;
+        bool bounded;
+    };
+
+    static bool fitPair(const PairSamples& samples, PairFit* fit);
+
+    static uint32_t pairKey(uint16_t low, uint16_t high){
+        return (static_cast<uint32_t>(low) << 16) | high;
+    }
+
+    std::unordered_map<uint32_t, PairSamples> pairs;
+    std::unordered_map<uint16_t, uint64_t> recordsPerServer;
+};
+
+} // End DDTrace
+#endif
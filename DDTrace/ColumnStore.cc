@@ -0,0 +1,311 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
+#include "ColumnStore.h"
+#include "TraceFile.h"
+
+namespace DDTrace {
+
+static const char COLUMN_STORE_MAGIC[8] = {'D', 'D', 'T', 'C', 'O', 'L', 'S', 0};
+static const char* COLUMN_NAMES[] = {"request_id", "server_id", "start_cycles",
+    "duration_cycles", "cycles_per_sec", "counter_type", "annotation_id"};
+
+std::string ColumnStoreUtils::getColumnFileName(const std::string& directory,
+                                                size_t column){
+    if (column < COLUMN_COUNTERS){
+        return directory + "/" + COLUMN_NAMES[column] + ".col";
+    }
+    return directory + "/counter_" + std::to_string(column - COLUMN_COUNTERS)
+        + ".col";
+}
+
+static std::string getMetaFileName(const std::string& directory){
+    return directory + "/meta";
+}
+
+template<typename T>
+static inline void stage(std::vector<char>* column, size_t i, T value){
+    memcpy(&(*column)[i * sizeof(T)], &value, sizeof(T));
+}
+
+ColumnStoreWriter::ColumnStoreWriter() :
+directory(),
+files(),
+staging(NUM_STORE_COLUMNS),
+numRecords(0),
+annotationIds(),
+annotations() {}
+
+ColumnStoreWriter::~ColumnStoreWriter(){
+    //A destructor must not throw, so errors can only be reported here
+    try {
+        close();
+    } catch (const std::exception& e) {
+        fprintf(stderr, "Could not finish column store %s: %s\n",
+                directory.c_str(), e.what());
+    }
+}
+
+void ColumnStoreWriter::open(const std::string& _directory){
+    assert(!isOpen());
+    directory = _directory;
+    if (mkdir(directory.c_str(), 0755) && errno != EEXIST){
+        fprintf(stderr, "Could not create %s\n", directory.c_str());
+        throw std::runtime_error("Could not create column store");
+    }
+    //Whatever store was here is incomplete from now on
+    unlink(getMetaFileName(directory).c_str());
+
+    for(size_t c = 0; c < NUM_STORE_COLUMNS; c++){
+        std::string fileName = ColumnStoreUtils::getColumnFileName(directory, c);
+        FILE* file = fopen(fileName.c_str(), "wb");
+        if (!file){
+            fprintf(stderr, "Could not open %s for writing\n", fileName.c_str());
+            for(size_t i = 0; i < files.size(); i++){
+                fclose(files[i]);
+            }
+            files.clear();
+            throw std::runtime_error("Could not open column store");
+        }
+        files.push_back(file);
+    }
+    numRecords = 0;
+    annotationIds.clear();
+    annotations.clear();
+}
+
+uint32_t ColumnStoreWriter::getAnnotationId(const char* annotation){
+    std::string key(annotation, strnlen(annotation, MAX_ANNOTATION_LENGTH));
+    auto itr = annotationIds.find(key);
+    if (itr != annotationIds.end()){
+        return itr->second;
+    }
+    uint32_t id = annotations.size();
+    annotationIds[key] = id;
+    annotations.push_back(key);
+    return id;
+}
+
+void ColumnStoreWriter::append(const IntervalRecord* records, size_t count){
+    assert(isOpen());
+    staging[COLUMN_REQUEST_ID].resize(count * sizeof(uint64_t));
+    staging[COLUMN_SERVER_ID].resize(count * sizeof(uint16_t));
+    staging[COLUMN_START_CYCLES].resize(count * sizeof(uint64_t));
+    staging[COLUMN_DURATION_CYCLES].resize(count * sizeof(uint64_t));
+    staging[COLUMN_CYCLES_PER_SEC].resize(count * sizeof(double));
+    staging[COLUMN_COUNTER_TYPE].resize(count * sizeof(uint16_t));
+    staging[COLUMN_ANNOTATION_ID].resize(count * sizeof(uint32_t));
+    for(size_t c = 0; c < MAX_COUNTERS_PER_COUNTERTYPE; c++){
+        staging[COLUMN_COUNTERS + c].resize(count * sizeof(uint64_t));
+    }
+
+    for(size_t i = 0; i < count; i++){
+        const IntervalRecord& r = records[i];
+        stage<uint64_t>(&staging[COLUMN_REQUEST_ID], i, r.getClock().id);
+        stage<uint16_t>(&staging[COLUMN_SERVER_ID], i, r.getServerID());
+        stage<uint64_t>(&staging[COLUMN_START_CYCLES], i, r.getStartCycles());
+        stage<uint64_t>(&staging[COLUMN_DURATION_CYCLES], i,
+                        r.getEndCycles() - r.getStartCycles());
+        stage<double>(&staging[COLUMN_CYCLES_PER_SEC], i, r.getCyclesPerSec());
+        const PerfRecord& counters = r.getCountersDiff();
+        stage<uint16_t>(&staging[COLUMN_COUNTER_TYPE], i,
+                        counters.recordCounterType);
+        stage<uint32_t>(&staging[COLUMN_ANNOTATION_ID], i,
+                        getAnnotationId(r.getAnnotation()));
+        for(size_t c = 0; c < MAX_COUNTERS_PER_COUNTERTYPE; c++){
+            stage<uint64_t>(&staging[COLUMN_COUNTERS + c], i,
+                            counters.counters[c]);
+        }
+    }
+
+    for(size_t c = 0; c < NUM_STORE_COLUMNS; c++){
+        if (count && fwrite(&staging[c][0], staging[c].size(), 1, files[c]) != 1){
+            throw std::runtime_error("Could not write column store");
+        }
+    }
+    numRecords += count;
+}
+
+void ColumnStoreWriter::close(){
+    if (!isOpen()){
+        return;
+    }
+    bool failed = false;
+    for(size_t c = 0; c < files.size(); c++){
+        failed |= fclose(files[c]) != 0;
+    }
+    files.clear();
+    if (failed){
+        throw std::runtime_error("Could not write column store");
+    }
+
+    ColumnStoreHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, COLUMN_STORE_MAGIC, sizeof(header.magic));
+    header.version = COLUMN_STORE_VERSION;
+    header.numCounters = MAX_COUNTERS_PER_COUNTERTYPE;
+    header.numRecords = numRecords;
+    header.numAnnotations = annotations.size();
+
+    std::string fileName = getMetaFileName(directory);
+    FILE* meta = fopen(fileName.c_str(), "wb");
+    if (!meta){
+        fprintf(stderr, "Could not open %s for writing\n", fileName.c_str());
+        throw std::runtime_error("Could not write column store");
+    }
+    failed = fwrite(&header, sizeof(header), 1, meta) != 1;
+    for(size_t i = 0; i < annotations.size(); i++){
+        uint32_t length = annotations[i].size();
+        failed |= fwrite(&length, sizeof(length), 1, meta) != 1;
+        failed |= fwrite(annotations[i].data(), 1, length, meta) != length;
+    }
+    failed |= fclose(meta) != 0;
+    if (failed){
+        throw std::runtime_error("Could not write column store");
+    }
+}
+
+ColumnStoreReader::ColumnStoreReader() :
+directory(),
+header(),
+annotations(),
+mappings(),
+mappingSizes() {}
+
+ColumnStoreReader::~ColumnStoreReader(){
+    close();
+}
+
+void ColumnStoreReader::open(const std::string& _directory){
+    close();
+    directory = _directory;
+    std::string fileName = getMetaFileName(directory);
+    FILE* meta = fopen(fileName.c_str(), "rb");
+    if (!meta){
+        fprintf(stderr, "Could not open %s, is the store complete?\n",
+                fileName.c_str());
+        throw std::runtime_error("Could not open column store");
+    }
+    bool failed = fread(&header, sizeof(header), 1, meta) != 1 ||
+        memcmp(header.magic, COLUMN_STORE_MAGIC, sizeof(header.magic)) ||
+        header.version != COLUMN_STORE_VERSION ||
+        header.numCounters > MAX_COUNTERS_PER_COUNTERTYPE;
+    for(uint32_t i = 0; !failed && i < header.numAnnotations; i++){
+        uint32_t length;
+        char annotation[MAX_ANNOTATION_LENGTH];
+        failed = fread(&length, sizeof(length), 1, meta) != 1 ||
+            length > MAX_ANNOTATION_LENGTH ||
+            fread(annotation, 1, length, meta) != length;
+        annotations.push_back(std::string(annotation, failed ? 0 : length));
+    }
+    fclose(meta);
+    if (failed){
+        fprintf(stderr, "%s is not a column store this build can read\n",
+                directory.c_str());
+        annotations.clear();
+        throw std::runtime_error("Malformed column store");
+    }
+    mappings.assign(COLUMN_COUNTERS + header.numCounters, NULL);
+    mappingSizes.assign(mappings.size(), 0);
+}
+
+void ColumnStoreReader::close(){
+    for(size_t c = 0; c < mappings.size(); c++){
+        if (mappings[c] && mappingSizes[c]){
+            munmap(mappings[c], mappingSizes[c]);
+        }
+    }
+    mappings.clear();
+    mappingSizes.clear();
+    annotations.clear();
+}
+
+bool ColumnStoreReader::findAnnotation(const std::string& annotation,
+                                       uint32_t* id) const {
+    for(uint32_t i = 0; i < annotations.size(); i++){
+        if (annotations[i] == annotation){
+            *id = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const void* ColumnStoreReader::mapColumn(size_t column, size_t elementSize){
+    if (column >= mappings.size()){
+        throw std::runtime_error("No such column in this column store");
+    }
+    if (mappings[column]){
+        return mappings[column];
+    }
+
+    if (header.numRecords > SIZE_MAX / elementSize){
+        fprintf(stderr, "%s claims %lu records\n", directory.c_str(),
+                header.numRecords);
+        throw std::runtime_error("Malformed column store");
+    }
+    //mmap refuses empty mappings, and an empty column has nothing to read
+    static const uint64_t EMPTY_COLUMN[1] = {0};
+    size_t size = header.numRecords * elementSize;
+    if (size == 0){
+        mappings[column] = const_cast<uint64_t*>(EMPTY_COLUMN);
+        return mappings[column];
+    }
+
+    std::string fileName = ColumnStoreUtils::getColumnFileName(directory, column);
+    int fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd < 0){
+        fprintf(stderr, "Could not open %s\n", fileName.c_str());
+        throw std::runtime_error("Could not open column");
+    }
+    struct stat st;
+    if (fstat(fd, &st) || static_cast<size_t>(st.st_size) != size){
+        ::close(fd);
+        fprintf(stderr, "%s is not %lu records long\n", fileName.c_str(),
+                header.numRecords);
+        throw std::runtime_error("Malformed column store");
+    }
+    void* mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED){
+        throw std::runtime_error("Could not map column");
+    }
+    //Scans read columns front to back
+    madvise(mapping, size, MADV_SEQUENTIAL);
+    mappings[column] = mapping;
+    mappingSizes[column] = size;
+    //Checked once here, so that callers can index the dictionary with them
+    if (column == COLUMN_ANNOTATION_ID){
+        const uint32_t* ids = static_cast<const uint32_t*>(mapping);
+        for(uint64_t i = 0; i < header.numRecords; i++){
+            if (ids[i] >= header.numAnnotations){
+                fprintf(stderr, "Record %lu of %s has annotation id %u, past "
+                        "the dictionary\n", i, directory.c_str(), ids[i]);
+                throw std::runtime_error("Malformed column store");
+            }
+        }
+    }
+    return mapping;
+}
+
+uint64_t ColumnStoreUtils::convert(const std::vector<std::string>& traceFiles,
+                                   const std::string& directory){
+    ColumnStoreWriter writer;
+    writer.open(directory);
+    for(size_t i = 0; i < traceFiles.size(); i++){
+        TraceFileUtils::readRecords(traceFiles[i],
+            [&writer](const IntervalRecord* records, size_t count){
+                writer.append(records, count);
+            });
+    }
+    writer.close();
+    return writer.getNumRecords();
+}
+
+} //namespace DDTrace
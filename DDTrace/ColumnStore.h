@@ -0,0 +1,244 @@
+#ifndef PERFGRAPH_COLUMNSTORE_H
+#define PERFGRAPH_COLUMNSTORE_H
+
+#include <cstdio>
+#include <unordered_map>
+
+#include "DDTrace.h"
+
+namespace DDTrace {
+
+/**
+  * Version of the column store written by ColumnStoreWriter. Bump whenever
+  * a change to the layout below makes old stores unreadable.
+  */
+const uint32_t COLUMN_STORE_VERSION = 1;
+
+/**
+  * A column store is a directory holding one file per field of
+  * IntervalRecord, each a flat little endian array with one element per
+  * record, all in the same order:
+  *
+  *     request_id.col        uint64_t   VectorClock::id
+  *     server_id.col         uint16_t
+  *     start_cycles.col      uint64_t
+  *     duration_cycles.col   uint64_t   end - start
+  *     cycles_per_sec.col    double
+  *     counter_type.col      uint16_t   CounterType
+  *     annotation_id.col     uint32_t   index into the annotation dictionary
+  *     counter_<i>.col       uint64_t   one per counter
+  *
+  * plus a file "meta" holding a ColumnStoreHeader followed by the annotation
+  * dictionary, each annotation as a uint32_t length and its bytes. meta is
+  * written last, so a store without one is incomplete.
+  *
+  * Vector clocks are not stored: a store is for scans over many records
+  * (latency reports and the like), not for rebuilding the graph of a
+  * request, which still needs the .ddt files.
+  */
+enum ColumnId {
+    COLUMN_REQUEST_ID = 0,
+    COLUMN_SERVER_ID,
+    COLUMN_START_CYCLES,
+    COLUMN_DURATION_CYCLES,
+    COLUMN_CYCLES_PER_SEC,
+    COLUMN_COUNTER_TYPE,
+    COLUMN_ANNOTATION_ID,
+    /**
+      * Counter i is column COLUMN_COUNTERS + i
+      */
+    COLUMN_COUNTERS,
+    NUM_STORE_COLUMNS = COLUMN_COUNTERS + MAX_COUNTERS_PER_COUNTERTYPE
+};
+
+struct ColumnStoreHeader {
+    /**
+      * COLUMN_STORE_MAGIC
+      */
+    char magic[8];
+    uint32_t version;
+    /**
+      * Number of counter_<i>.col files
+      */
+    uint32_t numCounters;
+    uint64_t numRecords;
+    uint32_t numAnnotations;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(ColumnStoreHeader) == 32,
+              "ColumnStoreHeader layout changed");
+
+/**
+ * Writes IntervalRecords to a column store.
+ * Throws a std::runtime_error if the store cannot be written.
+ */
+class ColumnStoreWriter {
+  public:
+    ColumnStoreWriter();
+    /**
+      * Closes the store if it is still open, printing any error instead of
+      * throwing it. Call close first to handle errors.
+      */
+    ~ColumnStoreWriter();
+
+    /**
+      * Starts a new store in directory, creating it if needed and replacing
+      * any store already there
+      */
+    void open(const std::string& directory);
+
+    void append(const IntervalRecord* records, size_t count);
+
+    /**
+      * Writes meta, after which the store can be read.
+      * Throws a std::runtime_error if the store cannot be written.
+      */
+    void close();
+
+    bool isOpen() const {
+        return !files.empty();
+    }
+
+    uint64_t getNumRecords() const {
+        return numRecords;
+    }
+
+  private:
+    uint32_t getAnnotationId(const char* annotation);
+
+    std::string directory;
+    /**
+      * One per ColumnId
+      */
+    std::vector<FILE*> files;
+    /**
+      * Elements of each column for the batch being appended, so that every
+      * column file gets one fwrite per batch
+      */
+    std::vector<std::vector<char> > staging;
+    uint64_t numRecords;
+    std::unordered_map<std::string, uint32_t> annotationIds;
+    std::vector<std::string> annotations;
+};
+
+/**
+ * Reads a column store written by ColumnStoreWriter. Columns are mmapped
+ * the first time they are asked for, so a scan only reads the columns it
+ * touches.
+ * Throws a std::runtime_error if the store is incomplete or corrupt.
+ */
+class ColumnStoreReader {
+  public:
+    ColumnStoreReader();
+    ~ColumnStoreReader();
+
+    void open(const std::string& directory);
+    /**
+      * Unmaps every column. Pointers returned by the getters are invalid
+      * afterwards.
+      */
+    void close();
+
+    uint64_t getNumRecords() const {
+        return header.numRecords;
+    }
+
+    uint32_t getNumCounters() const {
+        return header.numCounters;
+    }
+
+    uint32_t getNumAnnotations() const {
+        return header.numAnnotations;
+    }
+
+    const std::string& getAnnotation(uint32_t id) const {
+        return annotations[id];
+    }
+
+    /**
+      * Sets *id to the id of annotation and returns true, or returns false
+      * if no record in the store has it
+      */
+    bool findAnnotation(const std::string& annotation, uint32_t* id) const;
+
+    /**
+      * Each getter returns an array of getNumRecords() elements
+      */
+    const uint64_t* getRequestIds(){
+        return static_cast<const uint64_t*>(
+                mapColumn(COLUMN_REQUEST_ID, sizeof(uint64_t)));
+    }
+
+    const uint16_t* getServerIds(){
+        return static_cast<const uint16_t*>(
+                mapColumn(COLUMN_SERVER_ID, sizeof(uint16_t)));
+    }
+
+    const uint64_t* getStartCycles(){
+        return static_cast<const uint64_t*>(
+                mapColumn(COLUMN_START_CYCLES, sizeof(uint64_t)));
+    }
+
+    const uint64_t* getDurationCycles(){
+        return static_cast<const uint64_t*>(
+                mapColumn(COLUMN_DURATION_CYCLES, sizeof(uint64_t)));
+    }
+
+    const double* getCyclesPerSec(){
+        return static_cast<const double*>(
+                mapColumn(COLUMN_CYCLES_PER_SEC, sizeof(double)));
+    }
+
+    const uint16_t* getCounterTypes(){
+        return static_cast<const uint16_t*>(
+                mapColumn(COLUMN_COUNTER_TYPE, sizeof(uint16_t)));
+    }
+
+    /**
+      * Every id is below getNumAnnotations()
+      */
+    const uint32_t* getAnnotationIds(){
+        return static_cast<const uint32_t*>(
+                mapColumn(COLUMN_ANNOTATION_ID, sizeof(uint32_t)));
+    }
+
+    /**
+      * Counter i < getNumCounters() of every record
+      */
+    const uint64_t* getCounters(size_t i){
+        return static_cast<const uint64_t*>(
+                mapColumn(COLUMN_COUNTERS + i, sizeof(uint64_t)));
+    }
+
+  private:
+    const void* mapColumn(size_t column, size_t elementSize);
+
+    std::string directory;
+    ColumnStoreHeader header;
+    std::vector<std::string> annotations;
+    /**
+      * Mapping of each column, NULL until first asked for
+      */
+    std::vector<void*> mappings;
+    std::vector<size_t> mappingSizes;
+};
+
+class ColumnStoreUtils {
+  public:
+    /**
+      * Returns the name of the file holding column in a store
+      */
+    static std::string getColumnFileName(const std::string& directory,
+                                         size_t column);
+
+    /**
+      * Writes every record of traceFiles (.ddt containers or raw dumps) to a
+      * new column store in directory. Returns the number of records written.
+      */
+    static uint64_t convert(const std::vector<std::string>& traceFiles,
+                            const std::string& directory);
+};
+
+} // End DDTrace
+#endif
@@ -0,0 +1,150 @@
+#include <algorithm>
+#include <string>
+
+#include "CriticalPath.h"
+#include "TraceFile.h"
+
+namespace DDTrace {
+
+CriticalPath::CriticalPath() :
+weights(),
+longestTo(),
+longestFrom(),
+path(),
+onPath(),
+lengthNanoseconds(0) {}
+
+void CriticalPath::compute(const RequestGraph& graph,
+                           const IntervalRecord* records){
+    size_t count = graph.getNumNodes();
+    const std::vector<uint32_t>& order = graph.getTopologicalOrder();
+    weights.resize(count);
+    longestTo.assign(count, 0);
+    longestFrom.assign(count, 0);
+    onPath.assign(count, 0);
+    path.clear();
+    lengthNanoseconds = 0;
+    if (!count){
+        return;
+    }
+
+    for(size_t i = 0; i < count; i++){
+        weights[i] = records[i].getElapsedNanoseconds();
+    }
+    for(uint32_t node : order){
+        uint64_t before = 0;
+        const uint32_t* predecessors = graph.getPredecessors(node);
+        for(size_t p = 0; p < graph.getNumPredecessors(node); p++){
+            before = std::max(before, longestTo[predecessors[p]]);
+        }
+        longestTo[node] = before + weights[node];
+    }
+    for(size_t i = count; i-- > 0; ){
+        uint32_t node = order[i];
+        uint64_t after = 0;
+        const uint32_t* successors = graph.getSuccessors(node);
+        for(size_t s = 0; s < graph.getNumSuccessors(node); s++){
+            after = std::max(after, longestFrom[successors[s]]);
+        }
+        longestFrom[node] = after + weights[node];
+    }
+
+    //Start at the first node that begins a longest chain, then follow the
+    //first successor that continues it
+    uint32_t node = 0;
+    for(uint32_t i = 1; i < count; i++){
+        if (longestFrom[i] > longestFrom[node]){
+            node = i;
+        }
+    }
+    lengthNanoseconds = longestFrom[node];
+    path.push_back(node);
+    onPath[node] = 1;
+    for(uint64_t rest = longestFrom[node] - weights[node]; rest > 0;
+        rest -= weights[node]){
+        const uint32_t* successors = graph.getSuccessors(node);
+        while (longestFrom[*successors] != rest){
+            successors++;
+        }
+        node = *successors;
+        path.push_back(node);
+        onPath[node] = 1;
+    }
+}
+
+size_t CriticalPathStats::KeyHash::operator()(const Key& key) const {
+    return TraceFileUtils::checksum(&key, sizeof(key));
+}
+
+CriticalPathStats::CriticalPathStats() :
+entries(),
+numRequests(0),
+pathNanoseconds(0) {}
+
+void CriticalPathStats::add(const IntervalRecord* records, size_t count,
+                            const CriticalPath& path){
+    Key key;
+    for(size_t i = 0; i < count; i++){
+        memset(&key, 0, sizeof(key));
+        memcpy(key.annotation, records[i].getAnnotation(),
+               strnlen(records[i].getAnnotation(), MAX_ANNOTATION_LENGTH));
+        Entry& entry = entries[key];
+        uint64_t elapsed = records[i].getElapsedNanoseconds();
+        entry.intervals++;
+        entry.nanoseconds += elapsed;
+        if (path.isOnPath(i)){
+            entry.pathIntervals++;
+            entry.pathNanoseconds += elapsed;
+        } else {
+            entry.slackNanoseconds += path.getSlackNanoseconds(i);
+        }
+    }
+    numRequests++;
+    pathNanoseconds += path.getLengthNanoseconds();
+}
+
+void CriticalPathStats::merge(const CriticalPathStats& other){
+    for(auto& kv : other.entries){
+        Entry& entry = entries[kv.first];
+        entry.intervals += kv.second.intervals;
+        entry.nanoseconds += kv.second.nanoseconds;
+        entry.pathIntervals += kv.second.pathIntervals;
+        entry.pathNanoseconds += kv.second.pathNanoseconds;
+        entry.slackNanoseconds += kv.second.slackNanoseconds;
+    }
+    numRequests += other.numRequests;
+    pathNanoseconds += other.pathNanoseconds;
+}
+
+void CriticalPathStats::print(FILE* out) const {
+    std::vector<std::pair<std::string, const Entry*> > sorted;
+    for(auto& kv : entries){
+        sorted.push_back(std::make_pair(
+            std::string(kv.first.annotation,
+                        strnlen(kv.first.annotation, MAX_ANNOTATION_LENGTH)),
+            &kv.second));
+    }
+    std::sort(sorted.begin(), sorted.end(),
+        [](const std::pair<std::string, const Entry*>& a,
+           const std::pair<std::string, const Entry*>& b){
+            if (a.second->pathNanoseconds != b.second->pathNanoseconds){
+                return a.second->pathNanoseconds > b.second->pathNanoseconds;
+            }
+            return a.first < b.first;
+        });
+    fprintf(out, "annotation,intervals,total_ns,criticalPathIntervals,"
+            "criticalPath_ns,criticalPathShare,meanSlack_ns\n");
+    for(auto& kv : sorted){
+        const Entry& entry = *kv.second;
+        uint64_t offPath = entry.intervals - entry.pathIntervals;
+        fprintf(out, "%s,%lu,%lu,%lu,%lu,%.4f,%.1f\n", kv.first.c_str(),
+                entry.intervals, entry.nanoseconds, entry.pathIntervals,
+                entry.pathNanoseconds,
+                pathNanoseconds ? static_cast<double>(entry.pathNanoseconds) /
+                    pathNanoseconds : 0.0,
+                offPath ? static_cast<double>(entry.slackNanoseconds) / offPath
+                    : 0.0);
+    }
+}
+
+} // End DDTrace
@@ -0,0 +1,130 @@
+#ifndef PERFGRAPH_CRITICALPATH_H
+#define PERFGRAPH_CRITICALPATH_H
+
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include "DDTrace.h"
+#include "DDTrace/RequestGraph.h"
+
+namespace DDTrace {
+
+/**
+ * The critical path of a request: the chain of intervals, each right before
+ * the next in its RequestGraph, with the largest total elapsed time. It is
+ * what the request's latency was made of; speeding up anything off it does
+ * not help until it becomes critical.
+ *
+ * Every other interval has slack: how much longer it could have taken
+ * without making any chain through it longer than the critical path.
+ *
+ * Computing takes one pass over the graph in topological order for the
+ * longest chain ending at each interval and one in reverse for the longest
+ * starting at it, so O(V + E).
+ */
+class CriticalPath {
+  public:
+    CriticalPath();
+
+    /**
+      * Finds the critical path of graph, built from records
+      */
+    void compute(const RequestGraph& graph, const IntervalRecord* records);
+
+    uint64_t getLengthNanoseconds() const {
+        return lengthNanoseconds;
+    }
+
+    /**
+      * Nodes of the critical path, first to last. Ties between chains are
+      * broken towards lower nodes.
+      */
+    const std::vector<uint32_t>& getPath() const {
+        return path;
+    }
+
+    bool isOnPath(size_t node) const {
+        return onPath[node];
+    }
+
+    uint64_t getSlackNanoseconds(size_t node) const {
+        return lengthNanoseconds - (longestTo[node] + longestFrom[node] -
+                                    weights[node]);
+    }
+
+  private:
+    std::vector<uint64_t> weights;
+    /**
+      * Longest chain ending at, and starting at, each node, including it
+      */
+    std::vector<uint64_t> longestTo;
+    std::vector<uint64_t> longestFrom;
+    std::vector<uint32_t> path;
+    std::vector<uint8_t> onPath;
+    uint64_t lengthNanoseconds;
+};
+
+/**
+ * Where the critical paths of many requests went, by annotation: how many
+ * intervals and how much time of each annotation there were, how much of
+ * that was on a critical path, and how much slack the rest had. Stats kept
+ * on different threads merge.
+ */
+class CriticalPathStats {
+  public:
+    CriticalPathStats();
+
+    /**
+      * Adds a request, whose critical path is path
+      */
+    void add(const IntervalRecord* records, size_t count,
+             const CriticalPath& path);
+
+    void merge(const CriticalPathStats& other);
+
+    /**
+      * Prints a header line, then a line of comma separated values per
+      * annotation, most critical path time first: intervals, total time,
+      * intervals and time on a critical path, the share of all critical path
+      * time that is, and the mean slack of the intervals off it
+      */
+    void print(FILE* out) const;
+
+    uint64_t getNumRequests() const {
+        return numRequests;
+    }
+
+    uint64_t getPathNanoseconds() const {
+        return pathNanoseconds;
+    }
+
+  private:
+    struct Key {
+        char annotation[MAX_ANNOTATION_LENGTH];
+
+        bool operator==(const Key& other) const {
+            return memcmp(this, &other, sizeof(Key)) == 0;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const;
+    };
+
+    struct Entry {
+        uint64_t intervals;
+        uint64_t nanoseconds;
+        uint64_t pathIntervals;
+        uint64_t pathNanoseconds;
+        uint64_t slackNanoseconds;
+    };
+
+    std::unordered_map<Key, Entry, KeyHash> entries;
+    uint64_t numRequests;
+    uint64_t pathNanoseconds;
+};
+
+} // End DDTrace
+#endif
@@ -127,8 +127,12 @@ class SPSCQueue {
     /**
       * Pushes an element to the queue. Returns false if there is no 
       * space left in the queue.
+      *
+      * If queued is not NULL, it is set to the number of elements waiting
+      * in the queue after the push, as far as the producer can tell (the
+      * consumer may have popped some since). 1 means the queue was empty.
       */ 
-    bool push(const T& elt){
+    bool push(const T& elt, size_t* queued = NULL){
         size_t _writeIndex = writeIndex.load(std::memory_order_relaxed);
         size_t _readIndex = readIndex.load(std::memory_order_acquire);
         size_t nextWriteIndex =  (_writeIndex + 1) % N;
@@ -137,6 +141,9 @@ class SPSCQueue {
         }
         data[_writeIndex] = elt;
         writeIndex.store(nextWriteIndex, std::memory_order_release);
+        if (queued){
+            *queued = (nextWriteIndex + N - _readIndex) % N;
+        }
         return true;
     }
     /**
@@ -154,6 +161,23 @@ class SPSCQueue {
         readIndex.store(nextReadIndex, std::memory_order_release);
         return true;
     }
+    /**
+      * Returns true iff there is nothing to pop.
+      * Only meaningful to the consumer; the producer may push at any time.
+      */
+    bool empty() const {
+        return readIndex.load(std::memory_order_relaxed) ==
+            writeIndex.load(std::memory_order_acquire);
+    }
+    /**
+      * Returns the number of elements waiting to be popped.
+      * Only meaningful to the consumer; the producer may push at any time.
+      */
+    size_t size() const {
+        size_t _readIndex = readIndex.load(std::memory_order_relaxed);
+        size_t _writeIndex = writeIndex.load(std::memory_order_acquire);
+        return (_writeIndex + N - _readIndex) % N;
+    }
     SPSCQueue() :
     writeIndex(0),
     readIndex(0) {}
@@ -0,0 +1,374 @@
+#include <ctype.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+#include "Histogram.h"
+
+namespace DDTrace {
+
+static const char* HISTOGRAM_FIELD_NAMES[NUM_HISTOGRAM_FIELDS] = {
+    "elapsed_ns", "cycles", "l3misses", "l3refs"
+};
+
+HdrHistogram::HdrHistogram(bool keepExemplars) :
+counts(HISTOGRAM_NUM_BUCKETS, 0),
+exemplars(keepExemplars ? HISTOGRAM_NUM_BUCKETS : 0, 0),
+count(0),
+sum(0),
+min(std::numeric_limits<uint64_t>::max()),
+max(0) {}
+
+void HdrHistogram::merge(const HdrHistogram& other){
+    for(size_t i = 0; i < HISTOGRAM_NUM_BUCKETS; i++){
+        counts[i] += other.counts[i];
+    }
+    if (!other.exemplars.empty()){
+        exemplars.resize(HISTOGRAM_NUM_BUCKETS, 0);
+        for(size_t i = 0; i < HISTOGRAM_NUM_BUCKETS; i++){
+            if (other.exemplars[i]){
+                exemplars[i] = other.exemplars[i];
+            }
+        }
+    }
+    count += other.count;
+    sum += other.sum;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+}
+
+void HdrHistogram::clear(){
+    if (count){
+        std::fill(counts.begin(), counts.end(), 0);
+        std::fill(exemplars.begin(), exemplars.end(), 0);
+    }
+    count = 0;
+    sum = 0;
+    min = std::numeric_limits<uint64_t>::max();
+    max = 0;
+}
+
+uint64_t HdrHistogram::getBucketMax(size_t bucket){
+    if (bucket < (1UL << HISTOGRAM_SUB_BUCKET_BITS)){
+        return bucket;
+    }
+    uint32_t shift = (bucket >> HISTOGRAM_SUB_BUCKET_BITS) - 1;
+    uint64_t mantissa = (bucket & ((1UL << HISTOGRAM_SUB_BUCKET_BITS) - 1)) +
+        (1UL << HISTOGRAM_SUB_BUCKET_BITS);
+    return (mantissa << shift) + ((1UL << shift) - 1);
+}
+
+size_t HdrHistogram::getQuantileBucket(double quantile) const {
+    uint64_t rank = std::min(count - 1,
+                             static_cast<uint64_t>(quantile * count));
+    uint64_t seen = 0;
+    for(size_t i = 0; i < HISTOGRAM_NUM_BUCKETS; i++){
+        seen += counts[i];
+        if (seen > rank){
+            return i;
+        }
+    }
+    return HISTOGRAM_NUM_BUCKETS - 1;
+}
+
+uint64_t HdrHistogram::getValueAtQuantile(double quantile) const {
+    if (count == 0){
+        return 0;
+    }
+    return std::min(max, getBucketMax(getQuantileBucket(quantile)));
+}
+
+uint64_t HdrHistogram::getExemplarAtQuantile(double quantile) const {
+    if (count == 0 || exemplars.empty()){
+        return 0;
+    }
+    for(size_t i = getQuantileBucket(quantile); i < HISTOGRAM_NUM_BUCKETS; i++){
+        if (exemplars[i]){
+            return exemplars[i];
+        }
+    }
+    return 0;
+}
+
+void HdrHistogram::write(FILE* out) const {
+    size_t numBuckets = 0;
+    for(size_t i = 0; i < HISTOGRAM_NUM_BUCKETS; i++){
+        numBuckets += counts[i] != 0;
+    }
+    fprintf(out, "%lu %lu %lu %lu %zu", count, getMin(), max, sum, numBuckets);
+    for(size_t i = 0; i < HISTOGRAM_NUM_BUCKETS; i++){
+        if (counts[i]){
+            fprintf(out, " %zu:%lu", i, counts[i]);
+            if (!exemplars.empty() && exemplars[i]){
+                fprintf(out, "@%lx", exemplars[i]);
+            }
+        }
+    }
+}
+
+bool HdrHistogram::read(const char* text){
+    HdrHistogram added;
+    size_t numBuckets;
+    int used;
+    if (sscanf(text, "%" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %zu%n",
+               &added.count, &added.min, &added.max, &added.sum, &numBuckets,
+               &used) != 5){
+        return false;
+    }
+    text += used;
+    uint64_t bucketTotal = 0;
+    for(size_t b = 0; b < numBuckets; b++){
+        size_t bucket;
+        uint64_t bucketCount;
+        if (sscanf(text, " %zu:%" SCNu64 "%n", &bucket, &bucketCount,
+                   &used) != 2 || bucket >= HISTOGRAM_NUM_BUCKETS){
+            return false;
+        }
+        added.counts[bucket] += bucketCount;
+        bucketTotal += bucketCount;
+        text += used;
+        if (*text == '@'){
+            uint64_t exemplar;
+            if (sscanf(text, "@%" SCNx64 "%n", &exemplar, &used) != 1){
+                return false;
+            }
+            added.exemplars.resize(HISTOGRAM_NUM_BUCKETS, 0);
+            added.exemplars[bucket] = exemplar;
+            text += used;
+        }
+    }
+    if (bucketTotal != added.count){
+        return false;
+    }
+    if (added.count == 0){
+        added.min = std::numeric_limits<uint64_t>::max();
+    }
+    merge(added);
+    return true;
+}
+
+SlowestIntervals::SlowestIntervals(size_t capacity) :
+capacity(capacity),
+heap() {
+    heap.reserve(capacity);
+}
+
+/**
+  * Orders the heap so that the fastest interval is on top
+  */
+static bool slowerThan(const SlowestIntervals::Interval& a,
+                       const SlowestIntervals::Interval& b){
+    if (a.elapsedNanoseconds != b.elapsedNanoseconds){
+        return a.elapsedNanoseconds > b.elapsedNanoseconds;
+    }
+    return a.requestId > b.requestId;
+}
+
+void SlowestIntervals::insert(uint64_t elapsedNanoseconds, uint64_t requestId){
+    if (heap.size() == capacity){
+        std::pop_heap(heap.begin(), heap.end(), slowerThan);
+        heap.pop_back();
+    }
+    Interval interval;
+    interval.elapsedNanoseconds = elapsedNanoseconds;
+    interval.requestId = requestId;
+    heap.push_back(interval);
+    std::push_heap(heap.begin(), heap.end(), slowerThan);
+}
+
+void SlowestIntervals::merge(const SlowestIntervals& other){
+    for(size_t i = 0; i < other.heap.size(); i++){
+        offer(other.heap[i].elapsedNanoseconds, other.heap[i].requestId);
+    }
+}
+
+std::vector<SlowestIntervals::Interval> SlowestIntervals::getSorted() const {
+    std::vector<Interval> sorted(heap);
+    std::sort(sorted.begin(), sorted.end(), slowerThan);
+    return sorted;
+}
+
+void SlowestIntervals::write(FILE* out) const {
+    std::vector<Interval> sorted = getSorted();
+    fprintf(out, "%zu", sorted.size());
+    for(size_t i = 0; i < sorted.size(); i++){
+        fprintf(out, " %lu:%lx", sorted[i].elapsedNanoseconds,
+                sorted[i].requestId);
+    }
+}
+
+bool SlowestIntervals::read(const char* text){
+    size_t numIntervals;
+    int used;
+    if (sscanf(text, "%zu%n", &numIntervals, &used) != 1){
+        return false;
+    }
+    text += used;
+    for(size_t i = 0; i < numIntervals; i++){
+        uint64_t elapsed, requestId;
+        if (sscanf(text, " %" SCNu64 ":%" SCNx64 "%n", &elapsed, &requestId,
+                   &used) != 2){
+            return false;
+        }
+        offer(elapsed, requestId);
+        text += used;
+    }
+    return true;
+}
+
+void HistogramUtils::writeSnapshotHeader(FILE* out,
+                                         uint64_t startUnixNanoseconds,
+                                         uint64_t endUnixNanoseconds,
+                                         size_t numLines){
+    fprintf(out, "snapshot %lu %lu %zu\n", startUnixNanoseconds,
+            endUnixNanoseconds, numLines);
+}
+
+/**
+  * Writes an annotation with spaces, '%' and control characters escaped
+  */
+static void writeAnnotation(FILE* out, const char* annotation){
+    if (!*annotation){
+        putc('%', out);
+    }
+    for(const char* c = annotation;
+        *c && c < annotation + MAX_ANNOTATION_LENGTH; c++){
+        if (*c == '%' || !isgraph(static_cast<unsigned char>(*c))){
+            fprintf(out, "%%%02x", static_cast<unsigned char>(*c));
+        } else {
+            putc(*c, out);
+        }
+    }
+}
+
+void HistogramUtils::writeHistogram(FILE* out, uint16_t serverId,
+                                    const char* annotation,
+                                    HistogramField field,
+                                    const HdrHistogram& histogram){
+    fprintf(out, "%u ", serverId);
+    writeAnnotation(out, annotation);
+    fprintf(out, " %s ", getFieldName(field));
+    histogram.write(out);
+    putc('\n', out);
+}
+
+void HistogramUtils::writeSlowest(FILE* out, uint16_t serverId,
+                                  const char* annotation,
+                                  const SlowestIntervals& slowest){
+    fprintf(out, "slowest %u ", serverId);
+    writeAnnotation(out, annotation);
+    putc(' ', out);
+    slowest.write(out);
+    putc('\n', out);
+}
+
+/**
+  * Undoes the escaping of writeAnnotation
+  */
+static bool unescape(const char* text, std::string* annotation){
+    annotation->clear();
+    if (strcmp(text, "%") == 0){
+        return true;
+    }
+    for(const char* c = text; *c; c++){
+        if (*c != '%'){
+            annotation->push_back(*c);
+            continue;
+        }
+        unsigned int escaped;
+        if (sscanf(c + 1, "%2x", &escaped) != 1){
+            return false;
+        }
+        annotation->push_back(static_cast<char>(escaped));
+        c += 2;
+    }
+    return true;
+}
+
+static void malformedSnapshot(const std::string& fileName, uint64_t line){
+    fprintf(stderr, "Malformed histogram snapshot at line %lu of %s\n", line,
+            fileName.c_str());
+    throw std::runtime_error("Malformed histogram snapshot");
+}
+
+void HistogramUtils::readSnapshots(const std::string& fileName,
+                                   const SnapshotCallback& onHistogram,
+                                   const SlowestCallback& onSlowest){
+    FILE* file = fopen(fileName.c_str(), "r");
+    if (!file){
+        fprintf(stderr, "Could not open %s\n", fileName.c_str());
+        throw std::runtime_error("Could not open histogram snapshots");
+    }
+    char* line = NULL;
+    size_t capacity = 0;
+    uint64_t lineNumber = 0;
+    uint64_t start = 0, end = 0;
+    size_t remaining = 0;
+    HdrHistogram histogram;
+    std::string annotation;
+    try {
+        while (getline(&line, &capacity, file) > 0){
+            lineNumber++;
+            if (remaining == 0){
+                if (sscanf(line, "snapshot %" SCNu64 " %" SCNu64 " %zu",
+                           &start, &end, &remaining) != 3){
+                    malformedSnapshot(fileName, lineNumber);
+                }
+                continue;
+            }
+            unsigned int serverId;
+            char escaped[4 * MAX_ANNOTATION_LENGTH + 2];
+            char fieldName[16];
+            int used;
+            remaining--;
+            if (strncmp(line, "slowest ", 8) == 0){
+                size_t numIntervals;
+                if (sscanf(line, "slowest %u %65s%n %zu", &serverId, escaped,
+                           &used, &numIntervals) != 3 ||
+                    !unescape(escaped, &annotation) ||
+                    numIntervals > strlen(line)){
+                    malformedSnapshot(fileName, lineNumber);
+                }
+                SlowestIntervals slowest(numIntervals);
+                if (!slowest.read(line + used)){
+                    malformedSnapshot(fileName, lineNumber);
+                }
+                if (onSlowest){
+                    onSlowest(start, end, serverId, annotation, slowest);
+                }
+                continue;
+            }
+            if (sscanf(line, "%u %65s %15s%n", &serverId, escaped, fieldName,
+                       &used) != 3 || !unescape(escaped, &annotation)){
+                malformedSnapshot(fileName, lineNumber);
+            }
+            size_t field = 0;
+            while (field < NUM_HISTOGRAM_FIELDS &&
+                   strcmp(fieldName, HISTOGRAM_FIELD_NAMES[field])){
+                field++;
+            }
+            histogram.clear();
+            if (field == NUM_HISTOGRAM_FIELDS || !histogram.read(line + used)){
+                malformedSnapshot(fileName, lineNumber);
+            }
+            onHistogram(start, end, serverId, annotation,
+                        static_cast<HistogramField>(field), histogram);
+        }
+    } catch (...) {
+        free(line);
+        fclose(file);
+        throw;
+    }
+    free(line);
+    fclose(file);
+    //A writer that died mid-snapshot leaves a short one, which we keep
+}
+
+const char* HistogramUtils::getFieldName(HistogramField field){
+    return HISTOGRAM_FIELD_NAMES[field];
+}
+
+} //namespace DDTrace
@@ -0,0 +1,263 @@
+#ifndef PERFGRAPH_HISTOGRAM_H
+#define PERFGRAPH_HISTOGRAM_H
+
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "DDTrace.h"
+
+namespace DDTrace {
+
+/**
+  * Values below 2^HISTOGRAM_SUB_BUCKET_BITS get a bucket each. Above that,
+  * every power of two is split into 2^HISTOGRAM_SUB_BUCKET_BITS buckets, so
+  * a value is known to within 1 part in 128 (2 significant digits) however
+  * large it is.
+  */
+const uint32_t HISTOGRAM_SUB_BUCKET_BITS = 7;
+const size_t HISTOGRAM_NUM_BUCKETS =
+    (64 - HISTOGRAM_SUB_BUCKET_BITS + 1) << HISTOGRAM_SUB_BUCKET_BITS;
+
+/**
+  * Slowest intervals HdrHistogramSink keeps per (server, annotation) and
+  * snapshot, unless told otherwise
+  */
+const size_t HISTOGRAM_DEFAULT_TOP_K = 10;
+
+/**
+ * A log-linear (HDR) histogram of uint64_t values.
+ *
+ * The buckets are allocated once, by the constructor, so recording a value
+ * is a few instructions and never allocates. Histograms add bucket by bucket,
+ * so histograms of different intervals or machines merge into exactly the
+ * histogram of all their values.
+ *
+ * If keepExemplars is true, each bucket also remembers the exemplar (a
+ * request id, VectorClock::id) of the last value recorded in it, so a
+ * percentile can be traced back to a request that had it. 0 means none.
+ */
+class HdrHistogram {
+  public:
+    explicit HdrHistogram(bool keepExemplars = false);
+
+    void record(uint64_t value) {
+        counts[getBucket(value)]++;
+        count++;
+        sum += value;
+        min = value < min ? value : min;
+        max = value > max ? value : max;
+    }
+
+    void record(uint64_t value, uint64_t exemplar) {
+        if (!exemplars.empty()){
+            exemplars[getBucket(value)] = exemplar;
+        }
+        record(value);
+    }
+
+    void merge(const HdrHistogram& other);
+
+    /**
+      * Forgets every value, keeping the buckets
+      */
+    void clear();
+
+    uint64_t getCount() const {
+        return count;
+    }
+    uint64_t getSum() const {
+        return sum;
+    }
+    uint64_t getMin() const {
+        return count ? min : 0;
+    }
+    uint64_t getMax() const {
+        return max;
+    }
+
+    /**
+      * Returns the largest value of the bucket holding the given quantile,
+      * in [0, 1], but no more than the largest value recorded
+      */
+    uint64_t getValueAtQuantile(double quantile) const;
+
+    /**
+      * Returns the exemplar of the bucket holding the given quantile, or of
+      * the first bucket above it that has one. 0 if there is none.
+      */
+    uint64_t getExemplarAtQuantile(double quantile) const;
+
+    /**
+      * Writes the histogram as count, min, max, sum, the number of non-empty
+      * buckets and then <bucket>:<count> for each, separated by spaces. The
+      * exemplar of a bucket follows its count as @<hex id>.
+      */
+    void write(FILE* out) const;
+
+    /**
+      * Reads what write wrote, adding it to this histogram. Returns false if
+      * text is malformed, leaving the histogram as it was.
+      */
+    bool read(const char* text);
+
+    static size_t getBucket(uint64_t value) {
+        if (value < (1UL << HISTOGRAM_SUB_BUCKET_BITS)){
+            return value;
+        }
+        uint32_t exponent = 63 - __builtin_clzll(value);
+        uint32_t shift = exponent - HISTOGRAM_SUB_BUCKET_BITS;
+        return ((shift + 1) << HISTOGRAM_SUB_BUCKET_BITS) +
+            (value >> shift) - (1UL << HISTOGRAM_SUB_BUCKET_BITS);
+    }
+
+    /**
+      * Returns the largest value that falls in bucket
+      */
+    static uint64_t getBucketMax(size_t bucket);
+
+  private:
+    /**
+      * Returns the bucket holding the given quantile
+      */
+    size_t getQuantileBucket(double quantile) const;
+
+    std::vector<uint64_t> counts;
+    /**
+      * Empty unless keeping exemplars
+      */
+    std::vector<uint64_t> exemplars;
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+};
+
+/**
+ * The K intervals with the longest elapsed time seen, kept in a min-heap of
+ * fixed capacity, so that offering one is O(log K) and never allocates.
+ * Merging two keeps the K slowest of both.
+ */
+class SlowestIntervals {
+  public:
+    struct Interval {
+        uint64_t elapsedNanoseconds;
+        /**
+          * VectorClock::id
+          */
+        uint64_t requestId;
+    };
+
+    explicit SlowestIntervals(size_t capacity);
+
+    void offer(uint64_t elapsedNanoseconds, uint64_t requestId) {
+        if (heap.size() == capacity && (capacity == 0 ||
+            elapsedNanoseconds <= heap.front().elapsedNanoseconds)){
+            return;
+        }
+        insert(elapsedNanoseconds, requestId);
+    }
+
+    void merge(const SlowestIntervals& other);
+
+    void clear() {
+        heap.clear();
+    }
+
+    size_t size() const {
+        return heap.size();
+    }
+
+    /**
+      * Returns the intervals, slowest first
+      */
+    std::vector<Interval> getSorted() const;
+
+    /**
+      * Writes the number of intervals, then <elapsed>:<hex id> for each,
+      * slowest first, separated by spaces
+      */
+    void write(FILE* out) const;
+
+    /**
+      * Reads what write wrote, offering every interval. Returns false if
+      * text is malformed.
+      */
+    bool read(const char* text);
+
+  private:
+    void insert(uint64_t elapsedNanoseconds, uint64_t requestId);
+
+    size_t capacity;
+    std::vector<Interval> heap;
+};
+
+/**
+ * What HdrHistogramSink keeps a histogram of, for each (server, annotation).
+ * Elapsed time is in nanoseconds; the counters are the deltas in PerfRecord,
+ * recorded only for records taken with the matching CounterType.
+ */
+enum HistogramField {
+    HISTOGRAM_ELAPSED = 0,
+    HISTOGRAM_USERSPACE_CYCLES,
+    HISTOGRAM_L3_MISSES,
+    HISTOGRAM_L3_REFERENCES,
+    NUM_HISTOGRAM_FIELDS
+};
+
+/**
+ * Snapshot files are a series of snapshots, each
+ *
+ *     snapshot <start unix ns> <end unix ns> <number of lines that follow>
+ *     <serverId> <annotation> <field> <HdrHistogram::write>     (per histogram)
+ *     slowest <serverId> <annotation> <SlowestIntervals::write> (per list)
+ *
+ * where annotations escape spaces, '%' and control characters as %xx, and an
+ * empty annotation is written as %. A snapshot covers the records consumed
+ * in [start, end). Merging snapshots, of any intervals and servers, is adding
+ * up their histograms and keeping the slowest of their slowest intervals.
+ */
+class HistogramUtils {
+  public:
+    typedef std::function<void(uint64_t startUnixNanoseconds,
+                               uint64_t endUnixNanoseconds, uint16_t serverId,
+                               const std::string& annotation,
+                               HistogramField field,
+                               const HdrHistogram& histogram)> SnapshotCallback;
+    typedef std::function<void(uint64_t startUnixNanoseconds,
+                               uint64_t endUnixNanoseconds, uint16_t serverId,
+                               const std::string& annotation,
+                               const SlowestIntervals& slowest)> SlowestCallback;
+
+    /**
+      * Writes the header line of a snapshot of numLines histograms and lists
+      * of slowest intervals
+      */
+    static void writeSnapshotHeader(FILE* out, uint64_t startUnixNanoseconds,
+                                    uint64_t endUnixNanoseconds,
+                                    size_t numLines);
+
+    static void writeHistogram(FILE* out, uint16_t serverId,
+                               const char* annotation, HistogramField field,
+                               const HdrHistogram& histogram);
+
+    static void writeSlowest(FILE* out, uint16_t serverId,
+                             const char* annotation,
+                             const SlowestIntervals& slowest);
+
+    /**
+      * Calls onHistogram with each histogram and onSlowest (if set) with
+      * each list of slowest intervals of every snapshot in fileName. Throws a
+      * std::runtime_error if the file cannot be read or is malformed.
+      */
+    static void readSnapshots(const std::string& fileName,
+                              const SnapshotCallback& onHistogram,
+                              const SlowestCallback& onSlowest =
+                                  SlowestCallback());
+
+    static const char* getFieldName(HistogramField field);
+};
+
+} // End DDTrace
+#endif
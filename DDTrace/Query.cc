@@ -0,0 +1,738 @@
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "Query.h"
+
+namespace DDTrace {
+
+static const char* QUERY_FIELD_NAMES[NUM_QUERY_FIELDS] = {
+    "duration", "start", "server", "cycles", "l3misses", "l3refs"
+};
+
+static bool isCounterField(QueryField field){
+    return field == QUERY_USERSPACE_CYCLES || field == QUERY_L3_MISSES ||
+        field == QUERY_L3_REFERENCES;
+}
+
+/**
+  * mask[i] &= compare(column[i], value), written so that it vectorizes
+  */
+template<typename Compare>
+static void narrow(uint8_t* mask, const uint64_t* column, size_t count,
+                   uint64_t value, Compare compare){
+    for(size_t i = 0; i < count; i++){
+        mask[i] &= compare(column[i], value);
+    }
+}
+
+static void narrow(uint8_t* mask, const uint64_t* column, size_t count,
+                   QueryOp op, uint64_t value){
+    switch (op){
+        case QUERY_LESS:
+            narrow(mask, column, count, value,
+                   [](uint64_t a, uint64_t b){ return a < b; });
+            break;
+        case QUERY_LESS_EQUAL:
+            narrow(mask, column, count, value,
+                   [](uint64_t a, uint64_t b){ return a <= b; });
+            break;
+        case QUERY_GREATER:
+            narrow(mask, column, count, value,
+                   [](uint64_t a, uint64_t b){ return a > b; });
+            break;
+        case QUERY_GREATER_EQUAL:
+            narrow(mask, column, count, value,
+                   [](uint64_t a, uint64_t b){ return a >= b; });
+            break;
+        case QUERY_EQUAL:
+            narrow(mask, column, count, value,
+                   [](uint64_t a, uint64_t b){ return a == b; });
+            break;
+        case QUERY_NOT_EQUAL:
+            narrow(mask, column, count, value,
+                   [](uint64_t a, uint64_t b){ return a != b; });
+            break;
+    }
+}
+
+QueryEngine::QueryEngine(const Query& query) :
+query(query),
+usesField(),
+keepsValues(),
+annotations(),
+annotationIds(),
+annotationMatches(query.where.size()),
+groups(),
+groupIds(),
+columns(),
+present(),
+annotationColumn(QUERY_BATCH_RECORDS),
+mask(QUERY_BATCH_RECORDS),
+rows(QUERY_BATCH_RECORDS),
+rowGroups(QUERY_BATCH_RECORDS),
+numRecords(0),
+numMatched(0) {
+    for(size_t i = 0; i < query.where.size(); i++){
+        if (!query.where[i].onAnnotation){
+            usesField[query.where[i].field] = true;
+        }
+    }
+    for(size_t i = 0; i < query.select.size(); i++){
+        if (query.select[i].type != QUERY_COUNT){
+            usesField[query.select[i].field] = true;
+        }
+        if (query.select[i].type == QUERY_PERCENTILE){
+            keepsValues[query.select[i].field] = true;
+        }
+    }
+    if (query.byServer){
+        usesField[QUERY_SERVER] = true;
+    }
+    if (query.timeBucketNanoseconds){
+        usesField[QUERY_START] = true;
+    }
+    for(size_t f = 0; f < NUM_QUERY_FIELDS; f++){
+        if (usesField[f]){
+            columns[f].resize(QUERY_BATCH_RECORDS);
+            present[f].resize(QUERY_BATCH_RECORDS, 1);
+        }
+    }
+}
+
+uint32_t QueryEngine::getAnnotationId(const char* annotation){
+    std::string name(annotation, strnlen(annotation, MAX_ANNOTATION_LENGTH));
+    auto it = annotationIds.find(name);
+    if (it != annotationIds.end()){
+        return it->second;
+    }
+    uint32_t id = annotations.size();
+    annotations.push_back(name);
+    annotationIds[name] = id;
+    for(size_t p = 0; p < query.where.size(); p++){
+        const QueryPredicate& predicate = query.where[p];
+        if (predicate.onAnnotation){
+            bool equal = name == predicate.annotation;
+            annotationMatches[p].push_back(
+                    predicate.op == QUERY_EQUAL ? equal : !equal);
+        }
+    }
+    return id;
+}
+
+size_t QueryEngine::getGroup(const GroupKey& key){
+    auto it = groupIds.find(key);
+    if (it != groupIds.end()){
+        return it->second;
+    }
+    Group group;
+    group.key = key;
+    group.count = 0;
+    AggregateState empty;
+    empty.count = 0;
+    empty.sum = 0;
+    empty.min = std::numeric_limits<uint64_t>::max();
+    empty.max = 0;
+    group.aggregates.resize(query.select.size(), empty);
+    group.values.resize(NUM_QUERY_FIELDS);
+    group.histograms.resize(NUM_QUERY_FIELDS);
+    groups.push_back(std::move(group));
+    groupIds[key] = groups.size() - 1;
+    return groups.size() - 1;
+}
+
+void QueryEngine::makeHistogram(Group* group, size_t field){
+    std::vector<uint64_t>& values = group->values[field];
+    group->histograms[field].reset(new HdrHistogram());
+    for(size_t i = 0; i < values.size(); i++){
+        group->histograms[field]->record(values[i]);
+    }
+    std::vector<uint64_t>().swap(values);
+}
+
+void QueryEngine::addValue(Group* group, size_t field, uint64_t value){
+    if (group->histograms[field]){
+        group->histograms[field]->record(value);
+        return;
+    }
+    group->values[field].push_back(value);
+    if (group->values[field].size() == QUERY_EXACT_PERCENTILE_VALUES){
+        makeHistogram(group, field);
+    }
+}
+
+void QueryEngine::add(const IntervalRecord* records, size_t count,
+                      const TraceFileHeader& header){
+    while (count > 0){
+        size_t batch = std::min(count, QUERY_BATCH_RECORDS);
+        addBatch(records, batch, header);
+        records += batch;
+        count -= batch;
+    }
+}
+
+void QueryEngine::addBatch(const IntervalRecord* records, size_t count,
+                           const TraceFileHeader& header){
+    numRecords += count;
+
+    //Transpose the fields we read
+    if (usesField[QUERY_DURATION]){
+        uint64_t* durations = &columns[QUERY_DURATION][0];
+        for(size_t i = 0; i < count; i++){
+            durations[i] = records[i].getElapsedNanoseconds();
+        }
+    }
+    if (usesField[QUERY_START]){
+        uint64_t* starts = &columns[QUERY_START][0];
+        if (header.anchorUnixNanoseconds){
+            for(size_t i = 0; i < count; i++){
+                int64_t sinceAnchor = records[i].getStartCycles() -
+                    header.anchorCycles;
+                starts[i] = header.anchorUnixNanoseconds + static_cast<int64_t>(
+                        1e9 * static_cast<double>(sinceAnchor) /
+                        records[i].getCyclesPerSec());
+            }
+        } else {
+            for(size_t i = 0; i < count; i++){
+                starts[i] = records[i].getStartNanoseconds();
+            }
+        }
+    }
+    if (usesField[QUERY_SERVER]){
+        uint64_t* servers = &columns[QUERY_SERVER][0];
+        for(size_t i = 0; i < count; i++){
+            servers[i] = records[i].getServerID();
+        }
+    }
+    for(size_t f = QUERY_USERSPACE_CYCLES; f < NUM_QUERY_FIELDS; f++){
+        if (!usesField[f]){
+            continue;
+        }
+        uint64_t* values = &columns[f][0];
+        uint8_t* has = &present[f][0];
+        for(size_t i = 0; i < count; i++){
+            const PerfRecord& counters = records[i].getCountersDiff();
+            bool found;
+            switch (f){
+                case QUERY_USERSPACE_CYCLES:
+                    found = counters.getUserspaceCycles(&values[i]);
+                    break;
+                case QUERY_L3_MISSES:
+                    found = counters.getL3Misses(&values[i]);
+                    break;
+                default:
+                    found = counters.getL3References(&values[i]);
+                    break;
+            }
+            if (!found){
+                values[i] = 0;
+            }
+            has[i] = found;
+        }
+    }
+    bool needsAnnotations = query.byAnnotation;
+    for(size_t p = 0; p < query.where.size(); p++){
+        needsAnnotations |= query.where[p].onAnnotation;
+    }
+    if (needsAnnotations){
+        //Runs of records share an annotation, only look up changes
+        const char* last = NULL;
+        uint32_t lastId = 0;
+        for(size_t i = 0; i < count; i++){
+            const char* annotation = records[i].getAnnotation();
+            if (!last || strncmp(annotation, last, MAX_ANNOTATION_LENGTH)){
+                lastId = getAnnotationId(annotation);
+                last = annotation;
+            }
+            annotationColumn[i] = lastId;
+        }
+    }
+
+    //Filter
+    uint8_t* matches = &mask[0];
+    memset(matches, 1, count);
+    for(size_t p = 0; p < query.where.size(); p++){
+        const QueryPredicate& predicate = query.where[p];
+        if (predicate.onAnnotation){
+            const uint8_t* annotationMatch = &annotationMatches[p][0];
+            const uint32_t* ids = &annotationColumn[0];
+            for(size_t i = 0; i < count; i++){
+                matches[i] &= annotationMatch[ids[i]];
+            }
+            continue;
+        }
+        if (isCounterField(predicate.field)){
+            const uint8_t* has = &present[predicate.field][0];
+            for(size_t i = 0; i < count; i++){
+                matches[i] &= has[i];
+            }
+        }
+        narrow(matches, &columns[predicate.field][0], count, predicate.op,
+               predicate.value);
+    }
+    size_t numRows = 0;
+    for(size_t i = 0; i < count; i++){
+        rows[numRows] = i;
+        numRows += matches[i];
+    }
+    numMatched += numRows;
+    if (numRows == 0){
+        return;
+    }
+
+    //Group
+    GroupKey lastKey;
+    size_t lastGroup = std::numeric_limits<size_t>::max();
+    for(size_t r = 0; r < numRows; r++){
+        size_t i = rows[r];
+        GroupKey key;
+        key.annotation = query.byAnnotation ? annotationColumn[i] : 0;
+        key.server = query.byServer ? columns[QUERY_SERVER][i] : 0;
+        key.timeBucket = query.timeBucketNanoseconds ?
+            columns[QUERY_START][i] / query.timeBucketNanoseconds : 0;
+        if (lastGroup == std::numeric_limits<size_t>::max() ||
+            !(key == lastKey)){
+            lastGroup = getGroup(key);
+            lastKey = key;
+        }
+        rowGroups[r] = lastGroup;
+        groups[lastGroup].count++;
+    }
+
+    //Aggregate
+    for(size_t a = 0; a < query.select.size(); a++){
+        const QueryAggregate& aggregate = query.select[a];
+        if (aggregate.type == QUERY_COUNT){
+            continue;
+        }
+        const uint64_t* values = &columns[aggregate.field][0];
+        const uint8_t* has = &present[aggregate.field][0];
+        for(size_t r = 0; r < numRows; r++){
+            size_t i = rows[r];
+            if (!has[i]){
+                continue;
+            }
+            AggregateState& state = groups[rowGroups[r]].aggregates[a];
+            state.count++;
+            state.sum += values[i];
+            state.min = std::min(state.min, values[i]);
+            state.max = std::max(state.max, values[i]);
+        }
+    }
+    for(size_t f = 0; f < NUM_QUERY_FIELDS; f++){
+        if (!keepsValues[f]){
+            continue;
+        }
+        const uint64_t* values = &columns[f][0];
+        const uint8_t* has = &present[f][0];
+        for(size_t r = 0; r < numRows; r++){
+            size_t i = rows[r];
+            if (has[i]){
+                addValue(&groups[rowGroups[r]], f, values[i]);
+            }
+        }
+    }
+}
+
+void QueryEngine::read(const std::vector<std::string>& traceFiles,
+                       size_t numThreads){
+    numThreads = std::max<size_t>(1, std::min(numThreads, traceFiles.size()));
+    //Engines hold histograms, so they are not copied
+    std::vector<std::unique_ptr<QueryEngine> > engines;
+    for(size_t t = 0; t < numThreads; t++){
+        engines.push_back(std::unique_ptr<QueryEngine>(new QueryEngine(query)));
+    }
+    std::atomic<size_t> nextFile(0);
+    std::mutex errorMutex;
+    std::exception_ptr error;
+    auto work = [&](size_t t){
+        try {
+            TraceFileReader reader;
+            size_t f;
+            while ((f = nextFile++) < traceFiles.size()){
+                reader.open(traceFiles[f]);
+                for(size_t b = 0; b < reader.getNumBlocks(); b++){
+                    RecordSpan records = reader.getBlock(b);
+                    engines[t]->add(records.records, records.count,
+                                   reader.getHeader());
+                }
+                reader.close();
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if (!error){
+                error = std::current_exception();
+            }
+            nextFile = traceFiles.size();
+        }
+    };
+    std::vector<std::thread> threads;
+    for(size_t t = 1; t < numThreads; t++){
+        threads.push_back(std::thread(work, t));
+    }
+    work(0);
+    for(size_t t = 0; t < threads.size(); t++){
+        threads[t].join();
+    }
+    if (error){
+        std::rethrow_exception(error);
+    }
+    for(size_t t = 0; t < numThreads; t++){
+        merge(*engines[t]);
+    }
+}
+
+void QueryEngine::merge(const QueryEngine& other){
+    numRecords += other.numRecords;
+    numMatched += other.numMatched;
+    for(size_t g = 0; g < other.groups.size(); g++){
+        const Group& theirs = other.groups[g];
+        GroupKey key = theirs.key;
+        if (query.byAnnotation){
+            std::string name = other.annotations[key.annotation];
+            key.annotation = getAnnotationId(name.c_str());
+        }
+        Group& ours = groups[getGroup(key)];
+        ours.count += theirs.count;
+        for(size_t a = 0; a < ours.aggregates.size(); a++){
+            AggregateState& state = ours.aggregates[a];
+            const AggregateState& added = theirs.aggregates[a];
+            state.count += added.count;
+            state.sum += added.sum;
+            state.min = std::min(state.min, added.min);
+            state.max = std::max(state.max, added.max);
+        }
+        for(size_t f = 0; f < NUM_QUERY_FIELDS; f++){
+            if (theirs.histograms[f]){
+                if (!ours.histograms[f]){
+                    makeHistogram(&ours, f);
+                }
+                ours.histograms[f]->merge(*theirs.histograms[f]);
+            }
+            for(size_t i = 0; i < theirs.values[f].size(); i++){
+                addValue(&ours, f, theirs.values[f][i]);
+            }
+        }
+    }
+}
+
+void QueryEngine::print(FILE* out) const {
+    std::vector<size_t> order(groups.size());
+    for(size_t g = 0; g < order.size(); g++){
+        order[g] = g;
+    }
+    std::sort(order.begin(), order.end(), [this](size_t a, size_t b){
+        const GroupKey& x = groups[a].key;
+        const GroupKey& y = groups[b].key;
+        if (query.byAnnotation && x.annotation != y.annotation){
+            return annotations[x.annotation] < annotations[y.annotation];
+        }
+        if (x.server != y.server){
+            return x.server < y.server;
+        }
+        return x.timeBucket < y.timeBucket;
+    });
+
+    const char* separator = "";
+    if (query.byAnnotation){
+        fprintf(out, "annotation");
+        separator = ",";
+    }
+    if (query.byServer){
+        fprintf(out, "%sserver", separator);
+        separator = ",";
+    }
+    if (query.timeBucketNanoseconds){
+        fprintf(out, "%stime", separator);
+        separator = ",";
+    }
+    for(size_t a = 0; a < query.select.size(); a++){
+        const QueryAggregate& aggregate = query.select[a];
+        const char* field = QueryUtils::getFieldName(aggregate.field);
+        fprintf(out, "%s", separator);
+        separator = ",";
+        switch (aggregate.type){
+            case QUERY_COUNT: fprintf(out, "count"); break;
+            case QUERY_SUM: fprintf(out, "sum(%s)", field); break;
+            case QUERY_MIN: fprintf(out, "min(%s)", field); break;
+            case QUERY_MAX: fprintf(out, "max(%s)", field); break;
+            case QUERY_MEAN: fprintf(out, "mean(%s)", field); break;
+            case QUERY_PERCENTILE:
+                fprintf(out, "p%g(%s)", aggregate.percentile, field);
+                break;
+        }
+    }
+    putc('\n', out);
+
+    std::vector<uint64_t> values;
+    for(size_t g = 0; g < order.size(); g++){
+        const Group& group = groups[order[g]];
+        separator = "";
+        if (query.byAnnotation){
+            fprintf(out, "%s", annotations[group.key.annotation].c_str());
+            separator = ",";
+        }
+        if (query.byServer){
+            fprintf(out, "%s%u", separator, group.key.server);
+            separator = ",";
+        }
+        if (query.timeBucketNanoseconds){
+            fprintf(out, "%s%lu", separator,
+                    group.key.timeBucket * query.timeBucketNanoseconds);
+            separator = ",";
+        }
+        for(size_t a = 0; a < query.select.size(); a++){
+            const QueryAggregate& aggregate = query.select[a];
+            const AggregateState& state = group.aggregates[a];
+            fprintf(out, "%s", separator);
+            separator = ",";
+            if (aggregate.type == QUERY_COUNT){
+                fprintf(out, "%lu", group.count);
+                continue;
+            }
+            if (state.count == 0){
+                fprintf(out, "NA");
+                continue;
+            }
+            switch (aggregate.type){
+                case QUERY_SUM: fprintf(out, "%lu", state.sum); break;
+                case QUERY_MIN: fprintf(out, "%lu", state.min); break;
+                case QUERY_MAX: fprintf(out, "%lu", state.max); break;
+                case QUERY_MEAN:
+                    fprintf(out, "%.2f",
+                            static_cast<double>(state.sum) / state.count);
+                    break;
+                default: {
+                    if (group.histograms[aggregate.field]){
+                        fprintf(out, "%lu",
+                                group.histograms[aggregate.field]->
+                                    getValueAtQuantile(
+                                        aggregate.percentile / 100));
+                        break;
+                    }
+                    values = group.values[aggregate.field];
+                    size_t rank = std::min(values.size() - 1,
+                            static_cast<size_t>(aggregate.percentile / 100 *
+                                                values.size()));
+                    std::nth_element(values.begin(), values.begin() + rank,
+                                     values.end());
+                    fprintf(out, "%lu", values[rank]);
+                    break;
+                }
+            }
+        }
+        putc('\n', out);
+    }
+}
+
+const char* QueryUtils::getFieldName(QueryField field){
+    return QUERY_FIELD_NAMES[field];
+}
+
+static std::string trim(const std::string& text){
+    size_t first = text.find_first_not_of(" \t");
+    if (first == std::string::npos){
+        return "";
+    }
+    size_t last = text.find_last_not_of(" \t");
+    return text.substr(first, last - first + 1);
+}
+
+/**
+  * Splits text at every occurrence of separator, trimming the pieces
+  */
+static std::vector<std::string> split(const std::string& text,
+                                      const std::string& separator){
+    std::vector<std::string> pieces;
+    size_t start = 0;
+    while (true){
+        size_t end = text.find(separator, start);
+        pieces.push_back(trim(text.substr(start, end - start)));
+        if (end == std::string::npos){
+            return pieces;
+        }
+        start = end + separator.size();
+    }
+}
+
+static void parseError(const std::string& message, const std::string& text){
+    fprintf(stderr, "Bad query: %s in \"%s\"\n", message.c_str(),
+            text.c_str());
+    throw std::runtime_error("Bad query");
+}
+
+static QueryField parseField(const std::string& text){
+    for(size_t f = 0; f < NUM_QUERY_FIELDS; f++){
+        if (text == QUERY_FIELD_NAMES[f]){
+            return static_cast<QueryField>(f);
+        }
+    }
+    parseError("unknown field", text);
+    return NUM_QUERY_FIELDS;
+}
+
+/**
+  * Parses an integer with an optional ns, us, ms or s suffix into
+  * nanoseconds
+  */
+static uint64_t parseValue(const std::string& text){
+    char* end;
+    double value = strtod(text.c_str(), &end);
+    std::string unit = trim(end);
+    if (end == text.c_str() || value < 0){
+        parseError("expected a number", text);
+    }
+    if (unit == "s"){
+        value *= 1e9;
+    } else if (unit == "ms"){
+        value *= 1e6;
+    } else if (unit == "us"){
+        value *= 1e3;
+    } else if (!unit.empty() && unit != "ns"){
+        parseError("unknown unit", text);
+    }
+    return static_cast<uint64_t>(value + 0.5);
+}
+
+/**
+  * Parses name(argument) into name and argument, or name into name
+  */
+static void parseCall(const std::string& text, std::string* name,
+                      std::string* argument){
+    size_t open = text.find('(');
+    if (open == std::string::npos){
+        *name = text;
+        argument->clear();
+        return;
+    }
+    if (text[text.size() - 1] != ')'){
+        parseError("expected )", text);
+    }
+    *name = trim(text.substr(0, open));
+    *argument = trim(text.substr(open + 1, text.size() - open - 2));
+}
+
+static QueryAggregate parseAggregate(const std::string& text){
+    std::string name, argument;
+    parseCall(text, &name, &argument);
+    QueryAggregate aggregate;
+    aggregate.type = QUERY_COUNT;
+    aggregate.field = QUERY_DURATION;
+    aggregate.percentile = 0;
+    if (name == "count"){
+        return aggregate;
+    }
+    if (name == "sum"){
+        aggregate.type = QUERY_SUM;
+    } else if (name == "min"){
+        aggregate.type = QUERY_MIN;
+    } else if (name == "max"){
+        aggregate.type = QUERY_MAX;
+    } else if (name == "mean"){
+        aggregate.type = QUERY_MEAN;
+    } else if (name.size() > 1 && name[0] == 'p'){
+        char* end;
+        aggregate.type = QUERY_PERCENTILE;
+        aggregate.percentile = strtod(name.c_str() + 1, &end);
+        if (*end || aggregate.percentile < 0 || aggregate.percentile > 100){
+            parseError("bad percentile", text);
+        }
+    } else {
+        parseError("unknown aggregate", text);
+    }
+    if (argument.empty()){
+        parseError("expected (<field>)", text);
+    }
+    aggregate.field = parseField(argument);
+    return aggregate;
+}
+
+static QueryPredicate parsePredicate(const std::string& text){
+    //Longest operators first, so <= is not read as <
+    static const char* OPS[] = {"<=", ">=", "!=", "<", ">", "="};
+    static const QueryOp OP_VALUES[] = {QUERY_LESS_EQUAL, QUERY_GREATER_EQUAL,
+        QUERY_NOT_EQUAL, QUERY_LESS, QUERY_GREATER, QUERY_EQUAL};
+    for(size_t o = 0; o < sizeof(OPS) / sizeof(OPS[0]); o++){
+        size_t at = text.find(OPS[o]);
+        if (at == std::string::npos){
+            continue;
+        }
+        QueryPredicate predicate;
+        predicate.op = OP_VALUES[o];
+        std::string field = trim(text.substr(0, at));
+        std::string value = trim(text.substr(at + strlen(OPS[o])));
+        predicate.onAnnotation = field == "annotation";
+        predicate.field = QUERY_DURATION;
+        predicate.value = 0;
+        if (predicate.onAnnotation){
+            if (predicate.op != QUERY_EQUAL && predicate.op != QUERY_NOT_EQUAL){
+                parseError("annotations only compare with = and !=", text);
+            }
+            predicate.annotation = value.substr(0, MAX_ANNOTATION_LENGTH);
+        } else {
+            predicate.field = parseField(field);
+            predicate.value = parseValue(value);
+        }
+        return predicate;
+    }
+    parseError("expected <field> <op> <value>", text);
+    return QueryPredicate();
+}
+
+Query QueryUtils::parse(const std::string& _text){
+    std::string text = " " + trim(_text) + " ";
+    if (text.compare(0, 8, " select ") == 0){
+        text = text.substr(7);
+    }
+    size_t where = text.find(" where ");
+    size_t by = text.find(" by ");
+    if (where != std::string::npos && by != std::string::npos && by < where){
+        parseError("where must come before by", _text);
+    }
+
+    Query query;
+    std::string select = text.substr(0, std::min(where, by));
+    std::vector<std::string> aggregates = split(select, ",");
+    for(size_t i = 0; i < aggregates.size(); i++){
+        if (aggregates[i].empty()){
+            parseError("expected an aggregate", _text);
+        }
+        query.select.push_back(parseAggregate(aggregates[i]));
+    }
+    if (where != std::string::npos){
+        std::vector<std::string> predicates =
+            split(text.substr(where + 7, by == std::string::npos ?
+                              std::string::npos : by - where - 7), " and ");
+        for(size_t i = 0; i < predicates.size(); i++){
+            query.where.push_back(parsePredicate(predicates[i]));
+        }
+    }
+    if (by != std::string::npos){
+        std::vector<std::string> keys = split(text.substr(by + 4), ",");
+        for(size_t i = 0; i < keys.size(); i++){
+            std::string name, argument;
+            parseCall(keys[i], &name, &argument);
+            if (name == "annotation"){
+                query.byAnnotation = true;
+            } else if (name == "server"){
+                query.byServer = true;
+            } else if (name == "time" && !argument.empty()){
+                query.timeBucketNanoseconds = parseValue(argument);
+                if (query.timeBucketNanoseconds == 0){
+                    parseError("time buckets must be wider than 0", keys[i]);
+                }
+            } else {
+                parseError("unknown group key", keys[i]);
+            }
+        }
+    }
+    return query;
+}
+
+} //namespace DDTrace
@@ -0,0 +1,293 @@
+#ifndef PERFGRAPH_QUERY_H
+#define PERFGRAPH_QUERY_H
+
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "DDTrace.h"
+#include "DDTrace/Histogram.h"
+#include "DDTrace/TraceFile.h"
+
+namespace DDTrace {
+
+/**
+  * Records are evaluated this many at a time, as columns
+  */
+const size_t QUERY_BATCH_RECORDS = 1024;
+
+/**
+  * Values a group keeps of a field it takes percentiles of before it moves
+  * them into an HdrHistogram. Up to this many, percentiles are exact; past
+  * it, they are known to within 1 part in 128 and the group holds a
+  * histogram (about 60KB) instead of a value per record.
+  */
+const size_t QUERY_EXACT_PERCENTILE_VALUES = 1024;
+
+/**
+  * The numeric fields of a record a query can filter and aggregate on.
+  * Durations and start times are in nanoseconds, start times as unix time if
+  * the file has a wallclock anchor. The counters only have a value in
+  * records taken with the matching CounterType; other records never match a
+  * predicate on them and are left out of their aggregates.
+  */
+enum QueryField {
+    QUERY_DURATION = 0,
+    QUERY_START,
+    QUERY_SERVER,
+    QUERY_USERSPACE_CYCLES,
+    QUERY_L3_MISSES,
+    QUERY_L3_REFERENCES,
+    NUM_QUERY_FIELDS
+};
+
+enum QueryOp {
+    QUERY_LESS = 0,
+    QUERY_LESS_EQUAL,
+    QUERY_GREATER,
+    QUERY_GREATER_EQUAL,
+    QUERY_EQUAL,
+    QUERY_NOT_EQUAL
+};
+
+struct QueryPredicate {
+    /**
+      * If true, compares the annotation to annotation with QUERY_EQUAL or
+      * QUERY_NOT_EQUAL, and field and value are unused
+      */
+    bool onAnnotation;
+    std::string annotation;
+    QueryField field;
+    QueryOp op;
+    uint64_t value;
+};
+
+enum QueryAggregateType {
+    QUERY_COUNT = 0,
+    QUERY_SUM,
+    QUERY_MIN,
+    QUERY_MAX,
+    QUERY_MEAN,
+    QUERY_PERCENTILE
+};
+
+struct QueryAggregate {
+    QueryAggregateType type;
+    /**
+      * Unused by QUERY_COUNT
+      */
+    QueryField field;
+    /**
+      * In [0, 100], for QUERY_PERCENTILE
+      */
+    double percentile;
+};
+
+/**
+  * Keeps the records matching every predicate in where, groups them by
+  * annotation, server and start time bucket (any combination, or none for a
+  * single group), and computes the aggregates in select for each group.
+  */
+struct Query {
+    std::vector<QueryAggregate> select;
+    std::vector<QueryPredicate> where;
+    bool byAnnotation;
+    bool byServer;
+    /**
+      * Width of the start time buckets, 0 to not group by time
+      */
+    uint64_t timeBucketNanoseconds;
+
+    Query() :
+    select(),
+    where(),
+    byAnnotation(false),
+    byServer(false),
+    timeBucketNanoseconds(0) {}
+};
+
+/**
+ * Evaluates a Query over records.
+ *
+ * Records are transposed a batch at a time into one array per field the
+ * query uses. Each predicate is then a tight loop over one array that
+ * narrows a byte mask of the batch, which the compiler vectorizes, and the
+ * aggregates are loops over the matching rows of the arrays. Nothing is
+ * allocated per record: percentiles are exact in groups of up to
+ * QUERY_EXACT_PERCENTILE_VALUES values and come from an HdrHistogram in
+ * larger ones, so memory grows with the number of groups, not records.
+ *
+ * Engines of the same query can be filled on different threads and merged.
+ */
+class QueryEngine {
+  public:
+    explicit QueryEngine(const Query& query);
+
+    /**
+      * Adds records read from a file with the given header, whose wallclock
+      * anchor converts start times to unix time
+      */
+    void add(const IntervalRecord* records, size_t count,
+             const TraceFileHeader& header);
+
+    /**
+      * Adds every record of traceFiles, read on up to numThreads threads.
+      * Rethrows the std::runtime_error of any file that could not be read.
+      */
+    void read(const std::vector<std::string>& traceFiles, size_t numThreads);
+
+    /**
+      * Adds the groups of other, which ran the same query, to ours
+      */
+    void merge(const QueryEngine& other);
+
+    /**
+      * Prints a header line, then one line of comma separated values per
+      * group, sorted by annotation, server and time bucket
+      */
+    void print(FILE* out) const;
+
+    uint64_t getNumRecords() const {
+        return numRecords;
+    }
+
+    uint64_t getNumMatched() const {
+        return numMatched;
+    }
+
+    size_t getNumGroups() const {
+        return groups.size();
+    }
+
+  private:
+    struct GroupKey {
+        uint32_t annotation;
+        uint32_t server;
+        uint64_t timeBucket;
+
+        bool operator==(const GroupKey& other) const {
+            return annotation == other.annotation && server == other.server &&
+                timeBucket == other.timeBucket;
+        }
+    };
+
+    struct GroupKeyHash {
+        size_t operator()(const GroupKey& key) const {
+            return (key.timeBucket * 11400714819323198485UL) ^
+                (static_cast<uint64_t>(key.annotation) << 16) ^ key.server;
+        }
+    };
+
+    /**
+      * Running value of one aggregate in one group
+      */
+    struct AggregateState {
+        uint64_t count;
+        uint64_t sum;
+        uint64_t min;
+        uint64_t max;
+    };
+
+    struct Group {
+        GroupKey key;
+        uint64_t count;
+        std::vector<AggregateState> aggregates;
+        /**
+          * Values of each field some percentile is taken of, by field, until
+          * there are QUERY_EXACT_PERCENTILE_VALUES of them. Then they move
+          * to the field's histogram, which is null until then.
+          */
+        std::vector<std::vector<uint64_t> > values;
+        std::vector<std::unique_ptr<HdrHistogram> > histograms;
+    };
+
+    /**
+      * Adds a value of field to what group keeps for percentiles
+      */
+    static void addValue(Group* group, size_t field, uint64_t value);
+
+    /**
+      * Moves the values group kept of field into a new histogram
+      */
+    static void makeHistogram(Group* group, size_t field);
+
+    /**
+      * Returns the id of an annotation, adding it to the dictionary
+      */
+    uint32_t getAnnotationId(const char* annotation);
+
+    size_t getGroup(const GroupKey& key);
+
+    /**
+      * Transposes records[0, count) into the columns, then filters and
+      * aggregates them
+      */
+    void addBatch(const IntervalRecord* records, size_t count,
+                  const TraceFileHeader& header);
+
+    Query query;
+    /**
+      * Fields the query reads, and whether a percentile is taken of each
+      */
+    bool usesField[NUM_QUERY_FIELDS];
+    bool keepsValues[NUM_QUERY_FIELDS];
+
+    std::vector<std::string> annotations;
+    std::unordered_map<std::string, uint32_t> annotationIds;
+    /**
+      * Whether each annotation passes each annotation predicate, by
+      * predicate then annotation id
+      */
+    std::vector<std::vector<uint8_t> > annotationMatches;
+
+    std::vector<Group> groups;
+    std::unordered_map<GroupKey, size_t, GroupKeyHash> groupIds;
+
+    /**
+      * The current batch, a column per field
+      */
+    std::vector<uint64_t> columns[NUM_QUERY_FIELDS];
+    /**
+      * Whether each record of the batch has a value for each counter field
+      */
+    std::vector<uint8_t> present[NUM_QUERY_FIELDS];
+    std::vector<uint32_t> annotationColumn;
+    /**
+      * Whether each record of the batch matches so far, then the matching
+      * rows and their groups
+      */
+    std::vector<uint8_t> mask;
+    std::vector<uint32_t> rows;
+    std::vector<uint32_t> rowGroups;
+
+    uint64_t numRecords;
+    uint64_t numMatched;
+};
+
+class QueryUtils {
+  public:
+    /**
+      * Parses a query of the form
+      *
+      *     select <aggregate>,... [where <predicate> and ...] [by <key>,...]
+      *
+      * where an aggregate is count, sum(<field>), min(<field>),
+      * max(<field>), mean(<field>) or p<percentile>(<field>), eg p99.9;
+      * a predicate is <field> <op> <value> with op one of < <= > >= = !=,
+      * or annotation = <name> / annotation != <name>; and a key is
+      * annotation, server or time(<width>). Fields are duration, start,
+      * server, cycles (userspace cycles), l3misses and l3refs. Durations and
+      * widths take an ns, us, ms or s suffix (ns by default).
+      *
+      * Throws a std::runtime_error, after printing why, if text does not
+      * parse.
+      */
+    static Query parse(const std::string& text);
+
+    static const char* getFieldName(QueryField field);
+};
+
+} // End DDTrace
+#endif
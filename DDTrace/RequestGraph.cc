@@ -0,0 +1,381 @@
+#include <string.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "RequestGraph.h"
+#include "TraceFile.h"
+
+namespace DDTrace {
+
+RequestGraph::RequestGraph() :
+clocks(),
+clockSums(),
+classIds(),
+classOffsets(),
+classNodes(),
+sortedClasses(),
+classPositions(),
+classPredecessors(),
+hasClassSuccessor(),
+hasClassPredecessor(),
+edges(),
+predecessorOffsets(1, 0),
+predecessors(),
+successorOffsets(1, 0),
+successors(),
+topologicalOrder(),
+numFallbacks(0),
+nodeClasses(),
+cursor(),
+walk(),
+found(),
+covered(),
+stack() {}
+
+size_t RequestGraph::ClockHash::operator()(const Clock& clock) const {
+    return TraceFileUtils::checksum(&clock, sizeof(clock));
+}
+
+void RequestGraph::makeClock(const VectorClock& clock, Clock* out){
+    memset(out, 0, sizeof(*out));
+    out->length = std::min<uint64_t>(clock.length, MAX_VECTORCLOCK_ENTRIES);
+    memcpy(out->entries, clock.entries,
+           out->length * sizeof(VectorClock::Entry));
+    //Insertion sort, clocks are short
+    for(uint8_t i = 1; i < out->length; i++){
+        VectorClock::Entry entry = out->entries[i];
+        uint8_t j = i;
+        for(; j > 0 && out->entries[j - 1].serverId > entry.serverId; j--){
+            out->entries[j] = out->entries[j - 1];
+        }
+        out->entries[j] = entry;
+    }
+}
+
+bool RequestGraph::lessOrEqual(const Clock& a, const Clock& b){
+    return VectorClock::compare(a.entries, a.length, b.entries, b.length) &
+           VectorClock::BEFORE;
+}
+
+bool RequestGraph::happenedBefore(const IntervalRecord& a,
+                                  const IntervalRecord& b){
+    switch (a.getClock().compare(b.getClock())){
+        case VectorClock::BEFORE:
+            return true;
+        case VectorClock::EQUAL:
+            //Intervals between two increments share a clock, but on one
+            //server the cycle counter orders them
+            return a.getServerID() == b.getServerID() &&
+                   a.getEndCycles() <= b.getStartCycles() &&
+                   a.getStartCycles() < b.getStartCycles();
+        default:
+            return false;
+    }
+}
+
+void RequestGraph::findClassPredecessors(uint32_t k){
+    //Breadth first down the lattice of clocks from k, one count at a time,
+    //stopping at the clocks that are classes
+    walk.clear();
+    found.clear();
+    walk.push_back(clocks[k]);
+    for(size_t next = 0; next < walk.size(); next++){
+        Clock point = walk[next];
+        for(uint8_t i = 0; i < point.length; i++){
+            Clock lower = point;
+            if (--lower.entries[i].count == 0){
+                memmove(&lower.entries[i], &lower.entries[i + 1],
+                        (lower.length - i - 1) * sizeof(VectorClock::Entry));
+                lower.length--;
+                memset(&lower.entries[lower.length], 0,
+                       sizeof(VectorClock::Entry));
+            }
+            auto itr = classIds.find(lower);
+            if (itr != classIds.end()){
+                if (std::find(found.begin(), found.end(), itr->second) ==
+                    found.end()){
+                    found.push_back(itr->second);
+                }
+                continue;
+            }
+            if (std::find(walk.begin(), walk.end(), lower) != walk.end()){
+                continue;
+            }
+            if (walk.size() == REQUEST_GRAPH_MAX_WALK){
+                scanClassPredecessors(k);
+                return;
+            }
+            walk.push_back(lower);
+        }
+    }
+
+    //Branches of the walk can end at classes before other classes found
+    std::vector<uint32_t>& closest = classPredecessors[k];
+    for(size_t i = 0; i < found.size(); i++){
+        bool dominated = false;
+        for(size_t j = 0; j < found.size() && !dominated; j++){
+            dominated = j != i && lessOrEqual(clocks[found[i]],
+                                              clocks[found[j]]);
+        }
+        if (!dominated){
+            closest.push_back(found[i]);
+        }
+    }
+    std::sort(closest.begin(), closest.end());
+}
+
+void RequestGraph::scanClassPredecessors(uint32_t k){
+    numFallbacks++;
+    std::vector<uint32_t>& closest = classPredecessors[k];
+    covered.assign((clocks.size() + 63) / 64, 0);
+    //Classes with larger sums first, so that a class is reached after every
+    //class between it and k, and is covered if one of those is a predecessor
+    for(size_t position = classPositions[k]; position-- > 0; ){
+        uint32_t j = sortedClasses[position];
+        if ((covered[j / 64] >> (j % 64)) & 1 ||
+            clockSums[j] == clockSums[k] || !lessOrEqual(clocks[j], clocks[k])){
+            continue;
+        }
+        closest.push_back(j);
+        //Cover every ancestor of j, whose predecessors are already known
+        stack.assign(1, j);
+        while (!stack.empty()){
+            uint32_t c = stack.back();
+            stack.pop_back();
+            for(uint32_t p : classPredecessors[c]){
+                if (!((covered[p / 64] >> (p % 64)) & 1)){
+                    covered[p / 64] |= 1UL << (p % 64);
+                    stack.push_back(p);
+                }
+            }
+        }
+    }
+    std::sort(closest.begin(), closest.end());
+}
+
+void RequestGraph::addClassEdges(const IntervalRecord* records, uint32_t k){
+    uint32_t begin = classOffsets[k];
+    uint32_t end = classOffsets[k + 1];
+    if (end - begin < 2){
+        return;
+    }
+    struct Span {
+        uint16_t serverId;
+        uint64_t end;
+        uint64_t start;
+        uint32_t node;
+
+        bool operator<(const Span& other) const {
+            if (serverId != other.serverId) return serverId < other.serverId;
+            if (end != other.end) return end < other.end;
+            if (start != other.start) return start < other.start;
+            return node < other.node;
+        }
+    };
+    std::vector<Span> spans(end - begin);
+    for(uint32_t i = begin; i < end; i++){
+        const IntervalRecord& record = records[classNodes[i]];
+        Span span = {record.getServerID(), record.getEndCycles(),
+                     record.getStartCycles(), classNodes[i]};
+        spans[i - begin] = span;
+    }
+    std::sort(spans.begin(), spans.end());
+
+    std::vector<uint64_t> prefixMaxStart(spans.size() + 1);
+    for(size_t group = 0; group < spans.size(); ){
+        size_t groupEnd = group;
+        while (groupEnd < spans.size() &&
+               spans[groupEnd].serverId == spans[group].serverId){
+            groupEnd++;
+        }
+        //prefixMaxStart[i] is the latest start in spans[group, i)
+        prefixMaxStart[group] = 0;
+        for(size_t i = group; i < groupEnd; i++){
+            prefixMaxStart[i + 1] = std::max(prefixMaxStart[i], spans[i].start);
+        }
+
+        for(size_t b = group; b < groupEnd; b++){
+            uint64_t startB = spans[b].start;
+            //Spans that ended by the time b started, less those that
+            //started with it (zero length, at startB)
+            size_t last = group;
+            for(size_t step = groupEnd - group; step > 0; ){
+                size_t half = step / 2;
+                if (spans[last + half].end <= startB){
+                    last += half + 1;
+                    step -= half + 1;
+                } else {
+                    step = half;
+                }
+            }
+            while (last > group && spans[last - 1].start == startB){
+                last--;
+            }
+            if (last == group){
+                continue;
+            }
+            //a is before b iff it ended by startB; it is right before b
+            //unless another span started after a ended and ended by startB,
+            //ie unless a ended before maxStart (or at it, having started
+            //before it)
+            uint64_t maxStart = prefixMaxStart[last];
+            size_t first = last;
+            while (first > group && spans[first - 1].end >= maxStart){
+                first--;
+            }
+            for(size_t a = first; a < last; a++){
+                if (spans[a].end > maxStart || spans[a].start == maxStart){
+                    edges.push_back(std::make_pair(spans[a].node,
+                                                   spans[b].node));
+                    hasClassSuccessor[spans[a].node] = 1;
+                    hasClassPredecessor[spans[b].node] = 1;
+                }
+            }
+        }
+        group = groupEnd;
+    }
+}
+
+/**
+  * Sorts edges by (key, value) into offsets and values, counting sort style,
+  * using cursor as scratch
+  */
+static void makeAdjacency(size_t numNodes,
+        const std::vector<std::pair<uint32_t, uint32_t> >& edges,
+        bool byTarget, std::vector<uint32_t>* offsets,
+        std::vector<uint32_t>* values, std::vector<uint32_t>* cursor){
+    offsets->assign(numNodes + 1, 0);
+    values->resize(edges.size());
+    for(auto& edge : edges){
+        (*offsets)[(byTarget ? edge.second : edge.first) + 1]++;
+    }
+    for(size_t i = 0; i < numNodes; i++){
+        (*offsets)[i + 1] += (*offsets)[i];
+    }
+    cursor->assign(offsets->begin(), offsets->end() - 1);
+    for(auto& edge : edges){
+        uint32_t key = byTarget ? edge.second : edge.first;
+        (*values)[(*cursor)[key]++] = byTarget ? edge.first : edge.second;
+    }
+    for(size_t i = 0; i < numNodes; i++){
+        std::sort(values->begin() + (*offsets)[i],
+                  values->begin() + (*offsets)[i + 1]);
+    }
+}
+
+void RequestGraph::build(const IntervalRecord* records, size_t count){
+    if (count >= UINT32_MAX){
+        throw std::runtime_error("Too many intervals in one request");
+    }
+    clocks.clear();
+    clockSums.clear();
+    classIds.clear();
+    edges.clear();
+    numFallbacks = 0;
+
+    nodeClasses.resize(count);
+    Clock clock;
+    for(size_t i = 0; i < count; i++){
+        makeClock(records[i].getClock(), &clock);
+        auto inserted = classIds.insert(std::make_pair(clock,
+                                        static_cast<uint32_t>(clocks.size())));
+        if (inserted.second){
+            uint64_t sum = 0;
+            for(uint8_t e = 0; e < clock.length; e++){
+                sum += clock.entries[e].count;
+            }
+            clocks.push_back(clock);
+            clockSums.push_back(sum);
+        }
+        nodeClasses[i] = inserted.first->second;
+    }
+    size_t numClasses = clocks.size();
+
+    //Nodes by class, each class by start time
+    classOffsets.assign(numClasses + 1, 0);
+    for(size_t i = 0; i < count; i++){
+        classOffsets[nodeClasses[i] + 1]++;
+    }
+    for(size_t k = 0; k < numClasses; k++){
+        classOffsets[k + 1] += classOffsets[k];
+    }
+    classNodes.resize(count);
+    cursor.assign(classOffsets.begin(), classOffsets.end() - 1);
+    for(size_t i = 0; i < count; i++){
+        classNodes[cursor[nodeClasses[i]]++] = i;
+    }
+    for(size_t k = 0; k < numClasses; k++){
+        std::sort(classNodes.begin() + classOffsets[k],
+                  classNodes.begin() + classOffsets[k + 1],
+            [records](uint32_t a, uint32_t b){
+                if (records[a].getStartCycles() != records[b].getStartCycles()){
+                    return records[a].getStartCycles() <
+                        records[b].getStartCycles();
+                }
+                return a < b;
+            });
+    }
+
+    sortedClasses.resize(numClasses);
+    for(size_t k = 0; k < numClasses; k++){
+        sortedClasses[k] = k;
+    }
+    std::sort(sortedClasses.begin(), sortedClasses.end(),
+        [this](uint32_t a, uint32_t b){
+            if (clockSums[a] != clockSums[b]){
+                return clockSums[a] < clockSums[b];
+            }
+            return a < b;
+        });
+    classPositions.resize(numClasses);
+    for(size_t position = 0; position < numClasses; position++){
+        classPositions[sortedClasses[position]] = position;
+    }
+
+    //Cleared rather than reassigned, so that building graph after graph
+    //keeps the memory of the lists
+    classPredecessors.resize(numClasses);
+    for(size_t k = 0; k < numClasses; k++){
+        classPredecessors[k].clear();
+    }
+    for(uint32_t k : sortedClasses){
+        findClassPredecessors(k);
+    }
+
+    hasClassSuccessor.assign(count, 0);
+    hasClassPredecessor.assign(count, 0);
+    for(size_t k = 0; k < numClasses; k++){
+        addClassEdges(records, k);
+    }
+    //Every interval of a class with no earlier interval in it comes right
+    //after every interval of a preceding class with no later one in it
+    for(size_t k = 0; k < numClasses; k++){
+        for(uint32_t j : classPredecessors[k]){
+            for(uint32_t a = classOffsets[j]; a < classOffsets[j + 1]; a++){
+                if (hasClassSuccessor[classNodes[a]]) continue;
+                for(uint32_t b = classOffsets[k]; b < classOffsets[k + 1];
+                    b++){
+                    if (hasClassPredecessor[classNodes[b]]) continue;
+                    edges.push_back(std::make_pair(classNodes[a],
+                                                   classNodes[b]));
+                }
+            }
+        }
+    }
+
+    makeAdjacency(count, edges, true, &predecessorOffsets, &predecessors,
+                  &cursor);
+    makeAdjacency(count, edges, false, &successorOffsets, &successors,
+                  &cursor);
+    edges.clear();
+
+    topologicalOrder.clear();
+    for(uint32_t k : sortedClasses){
+        topologicalOrder.insert(topologicalOrder.end(),
+                                classNodes.begin() + classOffsets[k],
+                                classNodes.begin() + classOffsets[k + 1]);
+    }
+}
+
+} // End DDTrace
@@ -0,0 +1,195 @@
+#ifndef PERFGRAPH_REQUESTGRAPH_H
+#define PERFGRAPH_REQUESTGRAPH_H
+
+#include <unordered_map>
+#include <vector>
+
+#include "DDTrace.h"
+
+namespace DDTrace {
+
+/**
+  * Clocks the search for the predecessors of a vector clock may look at
+  * before falling back to scanning every earlier clock of the request
+  */
+const size_t REQUEST_GRAPH_MAX_WALK = 256;
+
+/**
+ * The happened-before DAG of the intervals of one request, transitively
+ * reduced: there is an edge from a to b iff a happened before b (see
+ * happenedBefore) and no interval happened in between.
+ *
+ * Intervals with the same vector clock (as a set of server counts) are put
+ * in a class, and the DAG of the classes is built first. Since a clock only
+ * ever grows by one count at a time, the classes right before a clock K are
+ * usually found by taking one count off K for each of its servers and
+ * looking the result up, walking further down only past counts that no
+ * interval was recorded at. If that walk gets longer than
+ * REQUEST_GRAPH_MAX_WALK, every earlier class is compared to K instead,
+ * marking the ancestors of each predecessor found in a bitset so that only
+ * the closest are kept. Within a class, intervals on the same server are
+ * ordered by time, which a sort by end time turns into ranges of
+ * predecessors. Building is O(V log V + E) in the common case, where a
+ * V x V matrix and a cubic reduction took minutes at a few thousand
+ * intervals.
+ *
+ * Nodes are indexes into the records the graph was built from, and the
+ * graph holds no pointer to them.
+ */
+class RequestGraph {
+  public:
+    RequestGraph();
+
+    /**
+      * Builds the graph of the count records of one request, in any order,
+      * replacing what was there
+      */
+    void build(const IntervalRecord* records, size_t count);
+
+    size_t getNumNodes() const {
+        return topologicalOrder.size();
+    }
+
+    size_t getNumEdges() const {
+        return predecessors.size();
+    }
+
+    size_t getNumPredecessors(size_t node) const {
+        return predecessorOffsets[node + 1] - predecessorOffsets[node];
+    }
+
+    /**
+      * Returns the getNumPredecessors(node) nodes right before node, in
+      * increasing order
+      */
+    const uint32_t* getPredecessors(size_t node) const {
+        return &predecessors[0] + predecessorOffsets[node];
+    }
+
+    size_t getNumSuccessors(size_t node) const {
+        return successorOffsets[node + 1] - successorOffsets[node];
+    }
+
+    /**
+      * Returns the getNumSuccessors(node) nodes right after node, in
+      * increasing order
+      */
+    const uint32_t* getSuccessors(size_t node) const {
+        return &successors[0] + successorOffsets[node];
+    }
+
+    /**
+      * Every node, each after all of its predecessors
+      */
+    const std::vector<uint32_t>& getTopologicalOrder() const {
+        return topologicalOrder;
+    }
+
+    /**
+      * Classes whose predecessors were found by a scan, see above
+      */
+    size_t getNumFallbacks() const {
+        return numFallbacks;
+    }
+
+    /**
+      * Returns true iff interval a happened before interval b: a's vector
+      * clock happened before b's or, with the same counts, both are on the
+      * same server and a ended before b started (and started before it)
+      */
+    static bool happenedBefore(const IntervalRecord& a,
+                               const IntervalRecord& b);
+
+  private:
+    /**
+      * A vector clock without its id, entries sorted by server and the
+      * unused ones zeroed, so that equal counts compare equal
+      */
+    struct Clock {
+        VectorClock::Entry entries[MAX_VECTORCLOCK_ENTRIES];
+        uint8_t length;
+
+        bool operator==(const Clock& other) const {
+            return memcmp(this, &other, sizeof(Clock)) == 0;
+        }
+    } __attribute__((packed));
+
+    struct ClockHash {
+        size_t operator()(const Clock& clock) const;
+    };
+
+    static void makeClock(const VectorClock& clock, Clock* out);
+
+    /**
+      * Returns true iff every count of a is at most b's
+      */
+    static bool lessOrEqual(const Clock& a, const Clock& b);
+
+    /**
+      * Fills classPredecessors[k] with the closest classes before class k
+      */
+    void findClassPredecessors(uint32_t k);
+
+    /**
+      * The fallback of findClassPredecessors
+      */
+    void scanClassPredecessors(uint32_t k);
+
+    /**
+      * Adds the edges between the nodes of a class
+      */
+    void addClassEdges(const IntervalRecord* records, uint32_t k);
+
+    std::vector<Clock> clocks;
+    std::vector<uint64_t> clockSums;
+    std::unordered_map<Clock, uint32_t, ClockHash> classIds;
+    /**
+      * Nodes of each class, sorted by start time: classNodes[classOffsets[k],
+      * classOffsets[k + 1])
+      */
+    std::vector<uint32_t> classOffsets;
+    std::vector<uint32_t> classNodes;
+    /**
+      * Classes by increasing clock sum, which is a topological order, and
+      * the position of each class in it
+      */
+    std::vector<uint32_t> sortedClasses;
+    std::vector<uint32_t> classPositions;
+    std::vector<std::vector<uint32_t> > classPredecessors;
+    /**
+      * Whether each node has a successor in its own class, and whether it
+      * has a predecessor in it
+      */
+    std::vector<uint8_t> hasClassSuccessor;
+    std::vector<uint8_t> hasClassPredecessor;
+
+    /**
+      * Edges as (from, to), before they are sorted into the arrays below
+      */
+    std::vector<std::pair<uint32_t, uint32_t> > edges;
+
+    std::vector<uint32_t> predecessorOffsets;
+    std::vector<uint32_t> predecessors;
+    std::vector<uint32_t> successorOffsets;
+    std::vector<uint32_t> successors;
+    std::vector<uint32_t> topologicalOrder;
+    size_t numFallbacks;
+
+    /**
+      * Scratch of build: the class of each node, and where the next node
+      * of each class (or edge of each node) goes
+      */
+    std::vector<uint32_t> nodeClasses;
+    std::vector<uint32_t> cursor;
+
+    /**
+      * Scratch of findClassPredecessors and scanClassPredecessors
+      */
+    std::vector<Clock> walk;
+    std::vector<uint32_t> found;
+    std::vector<uint64_t> covered;
+    std::vector<uint32_t> stack;
+};
+
+} // End DDTrace
+#endif
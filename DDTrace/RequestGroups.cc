@@ -0,0 +1,517 @@
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <queue>
+#include <thread>
+
+#include "RequestGroups.h"
+#include "TraceFile.h"
+
+namespace DDTrace {
+
+/**
+  * Total order on the records of one request, so that the order they are
+  * read in does not show
+  */
+static bool recordLessThan(const IntervalRecord& a, const IntervalRecord& b){
+    if (a.getStartCycles() != b.getStartCycles()){
+        return a.getStartCycles() < b.getStartCycles();
+    }
+    if (a.getEndCycles() != b.getEndCycles()){
+        return a.getEndCycles() < b.getEndCycles();
+    }
+    if (a.getServerID() != b.getServerID()){
+        return a.getServerID() < b.getServerID();
+    }
+    return memcmp(&a, &b, sizeof(IntervalRecord)) < 0;
+}
+
+/**
+  * What a partition is sorted on, and where the record is
+  */
+struct GroupKey {
+    uint64_t id;
+    uint64_t startCycles;
+    const IntervalRecord* record;
+};
+
+/**
+  * LSD radix sort of keys[0, count) on (id, startCycles), a byte at a time,
+  * using scratch (of at least count keys) as the other buffer. Passes on
+  * bytes that are the same in every key (the high bytes of ids and start
+  * times, mostly) are skipped. Stable.
+  */
+static void radixSort(GroupKey* keys, size_t count, GroupKey* scratch){
+    const size_t DIGITS = 2 * sizeof(uint64_t);
+    const size_t RADIX = 256;
+    std::vector<size_t> counts(DIGITS * RADIX, 0);
+    for(GroupKey* key = keys; key != keys + count; ++key){
+        for(size_t d = 0; d < sizeof(uint64_t); d++){
+            counts[d * RADIX + ((key->startCycles >> (8 * d)) & 0xff)]++;
+            counts[(d + sizeof(uint64_t)) * RADIX + ((key->id >> (8 * d)) & 0xff)]++;
+        }
+    }
+
+    GroupKey* from = keys;
+    GroupKey* to = scratch;
+    for(size_t d = 0; d < DIGITS; d++){
+        size_t* digitCounts = &counts[d * RADIX];
+        if (std::find(digitCounts, digitCounts + RADIX, count) !=
+            digitCounts + RADIX){
+            continue;
+        }
+        size_t offset = 0;
+        for(size_t b = 0; b < RADIX; b++){
+            size_t n = digitCounts[b];
+            digitCounts[b] = offset;
+            offset += n;
+        }
+        size_t shift = 8 * (d % sizeof(uint64_t));
+        bool isId = d >= sizeof(uint64_t);
+        for(GroupKey* key = from; key != from + count; ++key){
+            uint64_t value = isId ? key->id : key->startCycles;
+            to[digitCounts[(value >> shift) & 0xff]++] = *key;
+        }
+        std::swap(from, to);
+    }
+    if (from != keys){
+        std::copy(from, from + count, keys);
+    }
+}
+
+/**
+  * Sorts keys[0, count) on (id, startCycles), then on the whole record
+  */
+static void sortKeys(GroupKey* keys, size_t count, GroupKey* scratch){
+    radixSort(keys, count, scratch);
+
+    //The radix sort is stable, so records with the same id and start are
+    //still in the order the threads happened to read them in
+    for(size_t i = 0; i < count; ){
+        size_t end = i + 1;
+        while (end < count && keys[end].id == keys[i].id &&
+               keys[end].startCycles == keys[i].startCycles){
+            end++;
+        }
+        if (end - i > 1){
+            std::sort(keys + i, keys + end,
+                      [](const GroupKey& a, const GroupKey& b){
+                          return recordLessThan(*a.record, *b.record);
+                      });
+        }
+        i = end;
+    }
+}
+
+static uint64_t getFileSize(const std::string& fileName){
+    struct stat st;
+    return stat(fileName.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+/**
+  * Calls work(t) for every t < numThreads, on numThreads threads, and waits
+  * for all of them
+  */
+static void runOnThreads(size_t numThreads,
+                         const std::function<void(size_t)>& work){
+    std::vector<std::thread> threads;
+    for(size_t t = 1; t < numThreads; t++){
+        threads.push_back(std::thread(work, t));
+    }
+    work(0);
+    for(size_t t = 0; t < threads.size(); t++){
+        threads[t].join();
+    }
+}
+
+/**
+  * A block of one of the files being read
+  */
+struct BlockToRead {
+    size_t file;
+    size_t block;
+};
+
+/**
+  * Returns the blocks of traceFiles, largest files first so that one big
+  * file read last does not leave the other threads idle, in order within
+  * each file
+  */
+static std::vector<BlockToRead> listBlocks(
+        const std::vector<std::string>& traceFiles){
+    std::vector<std::pair<uint64_t, size_t> > bySize;
+    for(size_t i = 0; i < traceFiles.size(); i++){
+        bySize.push_back(std::make_pair(getFileSize(traceFiles[i]), i));
+    }
+    std::sort(bySize.begin(), bySize.end(),
+              std::greater<std::pair<uint64_t, size_t> >());
+
+    std::vector<BlockToRead> blocks;
+    TraceFileReader reader;
+    for(size_t f = 0; f < bySize.size(); f++){
+        reader.open(traceFiles[bySize[f].second]);
+        for(size_t b = 0; b < reader.getNumBlocks(); b++){
+            BlockToRead block = {bySize[f].second, b};
+            blocks.push_back(block);
+        }
+        reader.close();
+    }
+    return blocks;
+}
+
+/**
+  * Returns how many threads to read blocks on, at most numThreads
+  */
+static size_t getReadThreads(const std::vector<BlockToRead>& blocks,
+                             size_t numThreads){
+    return std::max<size_t>(1, std::min(numThreads, blocks.size()));
+}
+
+/**
+  * Reads blocks on numThreads threads, calling onRecords(t, records) on
+  * thread t with every block that thread reads. Threads take the next
+  * block as they finish one, so a few large files still spread over every
+  * thread. Each thread maps the file of the block it is on, and as blocks
+  * are handed out in order it moves through the files in order. Rethrows the
+  * first exception thrown on any thread, once all of them stopped.
+  */
+static void readInParallel(const std::vector<std::string>& traceFiles,
+        const std::vector<BlockToRead>& blocks, size_t numThreads,
+        const std::function<void(size_t, const RecordSpan&)>& onRecords){
+    std::atomic<size_t> nextBlock(0);
+    std::mutex errorMutex;
+    std::exception_ptr error;
+    runOnThreads(numThreads, [&](size_t t){
+        try {
+            TraceFileReader reader;
+            size_t openFile = traceFiles.size();
+            size_t i;
+            while ((i = nextBlock++) < blocks.size()){
+                if (blocks[i].file != openFile){
+                    reader.close();
+                    openFile = blocks[i].file;
+                    reader.open(traceFiles[openFile]);
+                }
+                onRecords(t, reader.getBlock(blocks[i].block));
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if (!error){
+                error = std::current_exception();
+            }
+            //Let the other threads run out of blocks
+            nextBlock = blocks.size();
+        }
+    });
+    if (error){
+        std::rethrow_exception(error);
+    }
+}
+
+RequestGroups::RequestGroups() :
+partitions(REQUEST_PARTITIONS),
+requestStarts(REQUEST_PARTITIONS, std::vector<size_t>(1, 0)),
+numRecords(0) {}
+
+size_t RequestGroups::getPartition(uint64_t id){
+    //Ids are often handed out sequentially, mix them before taking the top
+    //bits (Fibonacci hashing)
+    return ((id * 11400714819323198485UL) >> 32) % REQUEST_PARTITIONS;
+}
+
+size_t RequestGroups::getNumRequests() const {
+    size_t numRequests = 0;
+    for(size_t p = 0; p < partitions.size(); p++){
+        numRequests += requestStarts[p].size() - 1;
+    }
+    return numRequests;
+}
+
+void RequestGroups::read(const std::vector<std::string>& traceFiles,
+                         size_t numThreads){
+    std::vector<BlockToRead> blocks = listBlocks(traceFiles);
+    numThreads = getReadThreads(blocks, numThreads);
+    std::vector<std::vector<Partition> > local(numThreads,
+            std::vector<Partition>(REQUEST_PARTITIONS));
+    std::vector<uint64_t> localRecords(numThreads, 0);
+
+    readInParallel(traceFiles, blocks, numThreads,
+        [&local, &localRecords](size_t t, const RecordSpan& records){
+            for(auto& record : records){
+                local[t][getPartition(record.getClock().id)].push_back(record);
+            }
+            localRecords[t] += records.size();
+        });
+
+    runOnThreads(numThreads, [this, &local, numThreads](size_t t){
+        for(size_t p = t; p < REQUEST_PARTITIONS; p += numThreads){
+            mergePartition(p, local);
+        }
+    });
+    for(size_t t = 0; t < numThreads; t++){
+        numRecords += localRecords[t];
+    }
+}
+
+void RequestGroups::mergePartition(size_t p,
+        std::vector<std::vector<Partition> >& local){
+    //Records from an earlier read are merged in again with the new ones
+    Partition previous;
+    previous.swap(partitions[p]);
+
+    std::vector<GroupKey> keys, scratch;
+    size_t total = previous.size();
+    for(size_t t = 0; t < local.size(); t++){
+        total += local[t][p].size();
+    }
+    keys.reserve(total);
+    for(size_t t = 0; t <= local.size(); t++){
+        const Partition& records = t < local.size() ? local[t][p] : previous;
+        for(auto r = records.begin(); r != records.end(); ++r){
+            GroupKey key = {r->getClock().id, r->getStartCycles(), &*r};
+            keys.push_back(key);
+        }
+    }
+    scratch.resize(keys.size());
+    sortKeys(keys.data(), keys.size(), scratch.data());
+    std::vector<GroupKey>().swap(scratch);
+
+    Partition& merged = partitions[p];
+    std::vector<size_t>& starts = requestStarts[p];
+    merged.reserve(keys.size());
+    starts.clear();
+    for(size_t i = 0; i < keys.size(); i++){
+        if (i == 0 || keys[i].id != keys[i - 1].id){
+            starts.push_back(i);
+        }
+        merged.push_back(*keys[i].record);
+    }
+    starts.push_back(merged.size());
+
+    for(size_t t = 0; t < local.size(); t++){
+        Partition().swap(local[t][p]);
+    }
+}
+
+void RequestGroups::forEach(const RequestCallback& onRequest) const {
+    for(size_t p = 0; p < partitions.size(); p++){
+        const std::vector<size_t>& starts = requestStarts[p];
+        for(size_t r = 0; r + 1 < starts.size(); r++){
+            const IntervalRecord* records = &partitions[p][starts[r]];
+            onRequest(records->getClock().id, records,
+                      starts[r + 1] - starts[r]);
+        }
+    }
+}
+
+void RequestGroups::forEachInParallel(size_t numThreads,
+        const ParallelRequestCallback& onRequest) const {
+    std::atomic<size_t> nextPartition(0);
+    runOnThreads(std::max<size_t>(1, std::min(numThreads, partitions.size())),
+        [&](size_t t){
+            size_t p;
+            while ((p = nextPartition++) < partitions.size()){
+                const std::vector<size_t>& starts = requestStarts[p];
+                for(size_t r = 0; r + 1 < starts.size(); r++){
+                    const IntervalRecord* records = &partitions[p][starts[r]];
+                    onRequest(t, records->getClock().id, records,
+                              starts[r + 1] - starts[r]);
+                }
+            }
+        });
+}
+
+ExternalRequestGroups::ExternalRequestGroups(const std::string& tempDirectory,
+                                             uint64_t memoryBudget) :
+tempDirectory(tempDirectory),
+memoryBudget(memoryBudget),
+runs(),
+runsMutex(),
+numRecords(0) {}
+
+ExternalRequestGroups::~ExternalRequestGroups(){
+    for(size_t i = 0; i < runs.size(); i++){
+        unlink(runs[i].c_str());
+    }
+}
+
+void ExternalRequestGroups::read(const std::vector<std::string>& traceFiles,
+                                 size_t numThreads){
+    std::vector<BlockToRead> blocks = listBlocks(traceFiles);
+    numThreads = getReadThreads(blocks, numThreads);
+    //Spilling needs a key and a scratch key per buffered record
+    size_t bufferRecords = std::max<uint64_t>(TRACE_FILE_BLOCK_RECORDS,
+            memoryBudget / numThreads /
+            (sizeof(IntervalRecord) + 2 * sizeof(GroupKey)));
+    std::vector<std::vector<IntervalRecord> > buffers(numThreads);
+    std::vector<uint64_t> localRecords(numThreads, 0);
+
+    readInParallel(traceFiles, blocks, numThreads,
+        [&](size_t t, const RecordSpan& records){
+            std::vector<IntervalRecord>& buffer = buffers[t];
+            if (buffer.capacity() < bufferRecords){
+                buffer.reserve(bufferRecords);
+            }
+            for(size_t i = 0; i < records.size(); ){
+                size_t batch = std::min(records.size() - i,
+                                        bufferRecords - buffer.size());
+                buffer.insert(buffer.end(), records.begin() + i,
+                              records.begin() + i + batch);
+                i += batch;
+                if (buffer.size() == bufferRecords){
+                    spill(&buffer);
+                }
+            }
+            localRecords[t] += records.size();
+        });
+
+    runOnThreads(numThreads, [this, &buffers](size_t t){
+        spill(&buffers[t]);
+        std::vector<IntervalRecord>().swap(buffers[t]);
+    });
+    for(size_t t = 0; t < numThreads; t++){
+        numRecords += localRecords[t];
+    }
+}
+
+void ExternalRequestGroups::spill(std::vector<IntervalRecord>* buffer){
+    if (buffer->empty()){
+        return;
+    }
+
+    //Bucket the keys by partition, then sort each bucket
+    size_t count = buffer->size();
+    std::vector<GroupKey> keys(count), scratch(count);
+    std::vector<size_t> partitionStarts(REQUEST_PARTITIONS + 1, 0);
+    for(size_t i = 0; i < count; i++){
+        uint64_t id = (*buffer)[i].getClock().id;
+        partitionStarts[RequestGroups::getPartition(id) + 1]++;
+    }
+    for(size_t p = 0; p < REQUEST_PARTITIONS; p++){
+        partitionStarts[p + 1] += partitionStarts[p];
+    }
+    std::vector<size_t> next(partitionStarts.begin(), partitionStarts.end() - 1);
+    for(size_t i = 0; i < count; i++){
+        const IntervalRecord& r = (*buffer)[i];
+        GroupKey key = {r.getClock().id, r.getStartCycles(), &r};
+        keys[next[RequestGroups::getPartition(key.id)]++] = key;
+    }
+    for(size_t p = 0; p < REQUEST_PARTITIONS; p++){
+        sortKeys(&keys[partitionStarts[p]],
+                 partitionStarts[p + 1] - partitionStarts[p], &scratch[0]);
+    }
+
+    std::string fileName;
+    {
+        std::lock_guard<std::mutex> lock(runsMutex);
+        fileName = tempDirectory + "/ddtrace-run-" +
+            std::to_string(getpid()) + "-" + std::to_string(runs.size()) +
+            ".ddt";
+        runs.push_back(fileName);
+    }
+    TraceFileWriter writer;
+    writer.open(fileName);
+    for(size_t i = 0; i < count; i++){
+        writer.append(keys[i].record, 1);
+    }
+    writer.close();
+    buffer->clear();
+}
+
+/**
+  * Where the merge is in one run
+  */
+struct RunCursor {
+    TraceFileReader reader;
+    size_t block;
+    RecordSpan records;
+    size_t next;
+
+    const IntervalRecord& get() const {
+        return records[next];
+    }
+
+    /**
+      * Moves to the next record, returns false at the end of the run
+      */
+    bool advance(){
+        if (++next < records.size()){
+            return true;
+        }
+        while (++block < reader.getNumBlocks()){
+            records = reader.getBlock(block);
+            next = 0;
+            if (!records.empty()){
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+/**
+  * The order runs are written in: partition, id, then recordLessThan
+  */
+static bool runOrderLessThan(const IntervalRecord& a, const IntervalRecord& b){
+    uint64_t aId = a.getClock().id, bId = b.getClock().id;
+    size_t aPartition = RequestGroups::getPartition(aId);
+    size_t bPartition = RequestGroups::getPartition(bId);
+    if (aPartition != bPartition){
+        return aPartition < bPartition;
+    }
+    if (aId != bId){
+        return aId < bId;
+    }
+    return recordLessThan(a, b);
+}
+
+void ExternalRequestGroups::forEach(const RequestCallback& onRequest) const {
+    std::vector<RunCursor> cursors(runs.size());
+    auto greater = [&cursors](size_t a, size_t b){
+        return runOrderLessThan(cursors[b].get(), cursors[a].get());
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(greater)>
+        heap(greater);
+    for(size_t i = 0; i < runs.size(); i++){
+        RunCursor& cursor = cursors[i];
+        cursor.reader.open(runs[i]);
+        cursor.block = 0;
+        cursor.next = 0;
+        cursor.records = RecordSpan();
+        if (cursor.reader.getNumBlocks() == 0){
+            continue;
+        }
+        cursor.records = cursor.reader.getBlock(0);
+        if (!cursor.records.empty() || cursor.advance()){
+            heap.push(i);
+        }
+    }
+
+    std::vector<IntervalRecord> request;
+    while (!heap.empty()){
+        size_t i = heap.top();
+        heap.pop();
+        const IntervalRecord& record = cursors[i].get();
+        if (!request.empty() &&
+            request.back().getClock().id != record.getClock().id){
+            onRequest(request.back().getClock().id, request.data(),
+                      request.size());
+            request.clear();
+        }
+        request.push_back(record);
+        if (cursors[i].advance()){
+            heap.push(i);
+        }
+    }
+    if (!request.empty()){
+        onRequest(request.back().getClock().id, request.data(),
+                  request.size());
+    }
+}
+
+} //namespace DDTrace
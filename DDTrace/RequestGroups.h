@@ -0,0 +1,161 @@
+#ifndef PERFGRAPH_REQUESTGROUPS_H
+#define PERFGRAPH_REQUESTGROUPS_H
+
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "DDTrace.h"
+
+namespace DDTrace {
+
+/**
+  * Number of partitions requests are hashed into by id. Each reader thread
+  * keeps its own set, and the merge hands whole partitions to threads, so
+  * this bounds the parallelism of the merge.
+  */
+const size_t REQUEST_PARTITIONS = 64;
+
+/**
+ * The records of a set of trace files, grouped by request (VectorClock::id).
+ *
+ * Files are read on several threads, each appending the records it reads
+ * to flat per-partition arrays of its own. The partitions are then merged in
+ * parallel: each is radix sorted on (request id, start cycles) into one flat
+ * array, in which every request is a contiguous run. There is no allocation
+ * per request, and the records of a request sit next to each other for
+ * whatever reads them next.
+ *
+ * The result does not depend on the number of threads or on which thread
+ * read what: requests are visited partition by partition in increasing id
+ * order, and the records of a request are sorted by start cycles (ties
+ * broken by the rest of the record).
+ */
+class RequestGroups {
+  public:
+    typedef std::function<void(uint64_t id, const IntervalRecord* records,
+                               size_t count)> RequestCallback;
+    typedef std::function<void(size_t thread, uint64_t id,
+                               const IntervalRecord* records,
+                               size_t count)> ParallelRequestCallback;
+
+    RequestGroups();
+
+    /**
+      * Reads every record of traceFiles (.ddt containers or raw dumps) on up
+      * to numThreads threads, a block at a time so that even one file is
+      * read in parallel, and adds it to its request. Rethrows the
+      * std::runtime_error of any file that could not be read.
+      */
+    void read(const std::vector<std::string>& traceFiles, size_t numThreads);
+
+    size_t getNumRequests() const;
+
+    uint64_t getNumRecords() const {
+        return numRecords;
+    }
+
+    /**
+      * Calls onRequest once per request, in the order described above
+      */
+    void forEach(const RequestCallback& onRequest) const;
+
+    /**
+      * Calls onRequest once per request on up to numThreads threads, each
+      * taking whole partitions, with the index of the calling thread in
+      * [0, numThreads) so that it can keep state of its own. Requests are
+      * visited in no particular order.
+      */
+    void forEachInParallel(size_t numThreads,
+                           const ParallelRequestCallback& onRequest) const;
+
+    /**
+      * Returns the partition of requests with this id
+      */
+    static size_t getPartition(uint64_t id);
+
+  private:
+    typedef std::vector<IntervalRecord> Partition;
+
+    /**
+      * Sorts partition p of every thread's partitions into partitions[p],
+      * freeing them, and finds where each request starts
+      */
+    void mergePartition(size_t p, std::vector<std::vector<Partition> >& local);
+
+    /**
+      * Records of each partition, sorted by request id then start cycles
+      */
+    std::vector<Partition> partitions;
+    /**
+      * Offset of the first record of each request in partitions[p], plus
+      * partitions[p].size() at the end
+      */
+    std::vector<std::vector<size_t> > requestStarts;
+    uint64_t numRecords;
+};
+
+/**
+ * RequestGroups for traces that do not fit in memory.
+ *
+ * Each reader thread buffers records up to its share of memoryBudget, then
+ * sorts them the way RequestGroups would (by partition, request id, start
+ * cycles) and spills them to a compressed run file in tempDirectory. forEach
+ * k-way merges the runs, handing out each request as soon as its last
+ * record comes out of the merge, so only one request at a time is held in
+ * memory on top of a decoded block per run.
+ *
+ * Requests are visited in the same order, with their records in the same
+ * order, as RequestGroups would visit them.
+ */
+class ExternalRequestGroups {
+  public:
+    typedef RequestGroups::RequestCallback RequestCallback;
+
+    ExternalRequestGroups(const std::string& tempDirectory,
+                          uint64_t memoryBudget);
+    /**
+      * Removes the run files
+      */
+    ~ExternalRequestGroups();
+
+    /**
+      * Reads every record of traceFiles on up to numThreads threads,
+      * a block at a time, spilling them to runs. Rethrows the
+      * std::runtime_error of any file that could not be read or run that
+      * could not be written.
+      */
+    void read(const std::vector<std::string>& traceFiles, size_t numThreads);
+
+    uint64_t getNumRecords() const {
+        return numRecords;
+    }
+
+    size_t getNumRuns() const {
+        return runs.size();
+    }
+
+    /**
+      * Merges the runs, calling onRequest once per request. Can be called
+      * more than once, each call merges again.
+      */
+    void forEach(const RequestCallback& onRequest) const;
+
+  private:
+    /**
+      * Sorts buffer into a new run and empties it
+      */
+    void spill(std::vector<IntervalRecord>* buffer);
+
+    std::string tempDirectory;
+    uint64_t memoryBudget;
+    /**
+      * Names of the run files
+      */
+    std::vector<std::string> runs;
+    std::mutex runsMutex;
+    uint64_t numRecords;
+};
+
+} // End DDTrace
+#endif
@@ -0,0 +1,332 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "RequestIndex.h"
+
+namespace DDTrace {
+
+static const char REQUEST_INDEX_MAGIC[8] = {'D', 'D', 'T', 'R', 'I', 'D', 'X', 0};
+
+/**
+  * Scrambles a request id, which are often sequential, into a hash (the
+  * splitmix64 finalizer)
+  */
+static inline uint64_t mixId(uint64_t id){
+    id = (id ^ (id >> 30)) * 0xbf58476d1ce4e5b9UL;
+    id = (id ^ (id >> 27)) * 0x94d049bb133111ebUL;
+    return id ^ (id >> 31);
+}
+
+/**
+  * Calls probe(bit) for each of the REQUEST_INDEX_BLOOM_HASHES bits of id in
+  * a filter of numBits bits (double hashing), stopping when it returns false.
+  * Returns false iff a probe did.
+  */
+template<typename Probe>
+static inline bool forEachBloomBit(uint64_t id, uint64_t numBits,
+                                   const Probe& probe){
+    uint64_t hash = mixId(id);
+    uint64_t step = ((hash >> 32) | (hash << 32)) | 1;
+    for(uint32_t i = 0; i < REQUEST_INDEX_BLOOM_HASHES; i++){
+        if (!probe((hash + i * step) & (numBits - 1))){
+            return false;
+        }
+    }
+    return true;
+}
+
+RequestIndexBuilder::RequestIndexBuilder() :
+entries(),
+bloomWords(),
+ids() {}
+
+void RequestIndexBuilder::clear(){
+    entries.clear();
+    bloomWords.clear();
+}
+
+void RequestIndexBuilder::addBlock(size_t block, const TraceBlockInfo& info,
+                                   const IntervalRecord* records, size_t count){
+    ids.clear();
+    for(size_t i = 0; i < count; i++){
+        ids.push_back(records[i].getClock().id);
+    }
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+    RequestIndexEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.minRequestId = ids.empty() ? 0 : ids.front();
+    entry.maxRequestId = ids.empty() ? 0 : ids.back();
+    entry.blockOffset = info.offset;
+    entry.block = block;
+    uint64_t numBits = 64;
+    while (numBits < ids.size() * REQUEST_INDEX_BLOOM_BITS_PER_ID){
+        numBits *= 2;
+    }
+    entry.bloomWords = numBits / 64;
+    entry.bloomWord = bloomWords.size();
+    bloomWords.resize(bloomWords.size() + entry.bloomWords, 0);
+    uint64_t* filter = &bloomWords[entry.bloomWord];
+    for(size_t i = 0; i < ids.size(); i++){
+        forEachBloomBit(ids[i], numBits, [filter](uint64_t bit){
+            filter[bit / 64] |= 1UL << (bit % 64);
+            return true;
+        });
+    }
+    entries.push_back(entry);
+}
+
+void RequestIndexBuilder::write(const std::string& fileName,
+                                uint64_t traceFileSize){
+    std::vector<RequestIndexEntry> sorted(entries);
+    std::stable_sort(sorted.begin(), sorted.end(),
+            [](const RequestIndexEntry& a, const RequestIndexEntry& b){
+                return a.minRequestId < b.minRequestId;
+            });
+    uint64_t prefixMax = 0;
+    for(size_t i = 0; i < sorted.size(); i++){
+        prefixMax = std::max(prefixMax, sorted[i].maxRequestId);
+        sorted[i].prefixMaxRequestId = prefixMax;
+    }
+
+    RequestIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, REQUEST_INDEX_MAGIC, sizeof(header.magic));
+    header.version = REQUEST_INDEX_VERSION;
+    header.numHashes = REQUEST_INDEX_BLOOM_HASHES;
+    header.numBlocks = sorted.size();
+    header.traceFileSize = traceFileSize;
+
+    std::string tempName = fileName + ".tmp";
+    FILE* file = fopen(tempName.c_str(), "wb");
+    if (!file){
+        fprintf(stderr, "Could not open %s for writing\n", tempName.c_str());
+        throw std::runtime_error("Could not write request index");
+    }
+    bool failed = fwrite(&header, sizeof(header), 1, file) != 1;
+    if (!sorted.empty()){
+        failed |= fwrite(&sorted[0], sizeof(RequestIndexEntry), sorted.size(),
+                         file) != sorted.size();
+    }
+    if (!bloomWords.empty()){
+        failed |= fwrite(&bloomWords[0], sizeof(uint64_t), bloomWords.size(),
+                         file) != bloomWords.size();
+    }
+    failed |= fclose(file) != 0;
+    if (failed || rename(tempName.c_str(), fileName.c_str()) != 0){
+        unlink(tempName.c_str());
+        throw std::runtime_error("Could not write request index");
+    }
+}
+
+RequestIndexReader::RequestIndexReader() :
+mapping(NULL),
+fileSize(0),
+header(NULL),
+entries(NULL),
+bloomWords(NULL),
+numBloomWords(0) {}
+
+RequestIndexReader::~RequestIndexReader(){
+    close();
+}
+
+void RequestIndexReader::close(){
+    if (mapping){
+        munmap(const_cast<char*>(mapping), fileSize);
+        mapping = NULL;
+    }
+    header = NULL;
+}
+
+void RequestIndexReader::open(const std::string& fileName){
+    assert(!mapping);
+    int fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd < 0){
+        throw std::runtime_error("Could not open request index");
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(RequestIndexHeader)){
+        ::close(fd);
+        fprintf(stderr, "%s is too short to be a request index\n",
+                fileName.c_str());
+        throw std::runtime_error("Malformed request index");
+    }
+    fileSize = st.st_size;
+    void* map = mmap(NULL, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED){
+        throw std::runtime_error("Could not map request index");
+    }
+    //Lookups binary search, don't read ahead
+    madvise(map, fileSize, MADV_RANDOM);
+    mapping = static_cast<const char*>(map);
+
+    header = reinterpret_cast<const RequestIndexHeader*>(mapping);
+    //Compared by count, as numBlocks * sizeof(RequestIndexEntry) can wrap
+    uint64_t bodyBytes = fileSize - sizeof(RequestIndexHeader);
+    if (memcmp(header->magic, REQUEST_INDEX_MAGIC, sizeof(header->magic)) ||
+        header->version != REQUEST_INDEX_VERSION ||
+        header->numHashes != REQUEST_INDEX_BLOOM_HASHES ||
+        header->numBlocks > bodyBytes / sizeof(RequestIndexEntry) ||
+        (bodyBytes - header->numBlocks * sizeof(RequestIndexEntry)) %
+            sizeof(uint64_t)){
+        fprintf(stderr, "%s is not a request index this build can read\n",
+                fileName.c_str());
+        close();
+        throw std::runtime_error("Malformed request index");
+    }
+    uint64_t entriesBytes = header->numBlocks * sizeof(RequestIndexEntry);
+    entries = reinterpret_cast<const RequestIndexEntry*>(
+            mapping + sizeof(RequestIndexHeader));
+    bloomWords = reinterpret_cast<const uint64_t*>(
+            mapping + sizeof(RequestIndexHeader) + entriesBytes);
+    numBloomWords = (fileSize - sizeof(RequestIndexHeader) - entriesBytes) /
+        sizeof(uint64_t);
+}
+
+bool RequestIndexReader::mayContain(const RequestIndexEntry& entry,
+                                    uint64_t id) const {
+    if (entry.bloomWord + entry.bloomWords > numBloomWords ||
+        entry.bloomWords == 0){
+        throw std::runtime_error("Malformed request index");
+    }
+    const uint64_t* filter = bloomWords + entry.bloomWord;
+    return forEachBloomBit(id, entry.bloomWords * 64UL,
+        [filter](uint64_t bit){
+            return (filter[bit / 64] >> (bit % 64)) & 1;
+        });
+}
+
+void RequestIndexReader::findBlocks(uint64_t id,
+                                    std::vector<uint32_t>* blocks) const {
+    const RequestIndexEntry* end = entries + header->numBlocks;
+    //First entry whose range starts after id
+    const RequestIndexEntry* upper = std::upper_bound(entries, end, id,
+            [](uint64_t id, const RequestIndexEntry& entry){
+                return id < entry.minRequestId;
+            });
+    for(const RequestIndexEntry* entry = upper; entry != entries; ){
+        --entry;
+        if (entry->prefixMaxRequestId < id){
+            break;
+        }
+        if (entry->maxRequestId >= id && mayContain(*entry, id)){
+            //One entry per block, so no block number reaches numBlocks
+            if (entry->block >= header->numBlocks){
+                throw std::runtime_error("Malformed request index");
+            }
+            blocks->push_back(entry->block);
+        }
+    }
+}
+
+std::string RequestIndexUtils::getIndexFileName(const std::string& traceFile){
+    return traceFile + ".ridx";
+}
+
+void RequestIndexUtils::build(const std::string& traceFile){
+    TraceFileReader reader;
+    reader.open(traceFile);
+    if (reader.isRawDump()){
+        fprintf(stderr, "%s is a raw dump, convert it to .ddt to index it\n",
+                traceFile.c_str());
+        throw std::runtime_error("Cannot index raw dumps");
+    }
+    RequestIndexBuilder builder;
+    for(size_t b = 0; b < reader.getNumBlocks(); b++){
+        RecordSpan records = reader.getBlock(b);
+        builder.addBlock(b, reader.getBlockInfo(b), records.records,
+                         records.count);
+    }
+    struct stat st;
+    if (stat(traceFile.c_str(), &st) != 0){
+        throw std::runtime_error("Could not stat trace file");
+    }
+    builder.write(getIndexFileName(traceFile), st.st_size);
+}
+
+uint64_t RequestIndexUtils::lookup(const std::vector<std::string>& traceFiles,
+                                   const std::vector<uint64_t>& _ids,
+                                   const LookupCallback& onRecords){
+    std::vector<uint64_t> ids(_ids);
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+    uint64_t blocksRead = 0;
+    std::vector<uint32_t> blocks;
+    std::vector<IntervalRecord> matches;
+    for(size_t f = 0; f < traceFiles.size(); f++){
+        const std::string& traceFile = traceFiles[f];
+        blocks.clear();
+
+        TraceFileReader reader;
+        reader.open(traceFile);
+
+        bool indexed = false;
+        struct stat st;
+        std::string indexName = getIndexFileName(traceFile);
+        if (stat(traceFile.c_str(), &st) == 0 &&
+            access(indexName.c_str(), R_OK) == 0){
+            RequestIndexReader index;
+            try {
+                index.open(indexName);
+                //Every block number it gives is then one the file has
+                if (index.getHeader().traceFileSize ==
+                    static_cast<uint64_t>(st.st_size) &&
+                    index.getHeader().numBlocks == reader.getNumBlocks()){
+                    for(size_t i = 0; i < ids.size(); i++){
+                        index.findBlocks(ids[i], &blocks);
+                    }
+                    indexed = true;
+                } else {
+                    fprintf(stderr, "%s is stale, ignoring it\n",
+                            indexName.c_str());
+                }
+            } catch (const std::runtime_error&) {
+                //Corrupt, or from another version (open says which): no
+                //better than a stale one
+                fprintf(stderr, "Ignoring %s\n", indexName.c_str());
+                blocks.clear();
+            }
+        }
+
+        if (!indexed){
+            //Only the id ranges of the blocks to go on
+            for(uint32_t b = 0; b < reader.getNumBlocks(); b++){
+                const TraceBlockInfo& info = reader.getBlockInfo(b);
+                auto first = std::lower_bound(ids.begin(), ids.end(),
+                                              info.minRequestId);
+                if (first != ids.end() && *first <= info.maxRequestId){
+                    blocks.push_back(b);
+                }
+            }
+        }
+        std::sort(blocks.begin(), blocks.end());
+        blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+
+        for(size_t i = 0; i < blocks.size(); i++){
+            RecordSpan records = reader.getBlock(blocks[i]);
+            matches.clear();
+            for(auto& record : records){
+                if (std::binary_search(ids.begin(), ids.end(),
+                                       record.getClock().id)){
+                    matches.push_back(record);
+                }
+            }
+            if (!matches.empty()){
+                onRecords(traceFile, matches.data(), matches.size());
+            }
+        }
+        blocksRead += blocks.size();
+    }
+    return blocksRead;
+}
+
+} //namespace DDTrace
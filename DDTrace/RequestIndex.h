@@ -0,0 +1,174 @@
+#ifndef PERFGRAPH_REQUESTINDEX_H
+#define PERFGRAPH_REQUESTINDEX_H
+
+#include <functional>
+#include <vector>
+
+#include "DDTrace.h"
+#include "DDTrace/TraceFile.h"
+
+namespace DDTrace {
+
+/**
+  * Version of the request index written by RequestIndexBuilder. Bump
+  * whenever a change to the layout below makes old indexes unreadable.
+  */
+const uint32_t REQUEST_INDEX_VERSION = 1;
+
+/**
+  * Bits of Bloom filter per distinct request id in a block, and probes per
+  * lookup. 10 and 7 give about 1% false positives.
+  */
+const uint32_t REQUEST_INDEX_BLOOM_BITS_PER_ID = 10;
+const uint32_t REQUEST_INDEX_BLOOM_HASHES = 7;
+
+/**
+  * A request index sits next to a .ddt file, as <file>.ridx, and says which
+  * blocks of it can hold a given request id:
+  *
+  *     RequestIndexHeader
+  *     RequestIndexEntry       (one per block, sorted by minRequestId)
+  *     Bloom filter words      (uint64_t, per block, where its entry says)
+  *
+  * The entries narrow a lookup down to the blocks whose id range contains
+  * the id, found by binary search. The Bloom filter of each of those then
+  * rules out most of the blocks that do not actually hold it, so a lookup
+  * reads few blocks besides the ones it needs.
+  */
+struct RequestIndexHeader {
+    /**
+      * REQUEST_INDEX_MAGIC
+      */
+    char magic[8];
+    uint32_t version;
+    uint32_t numHashes;
+    uint64_t numBlocks;
+    /**
+      * Size of the .ddt file the index was built for. An index whose file
+      * has since changed size or number of blocks is stale and ignored.
+      */
+    uint64_t traceFileSize;
+};
+
+struct RequestIndexEntry {
+    uint64_t minRequestId;
+    uint64_t maxRequestId;
+    /**
+      * Largest maxRequestId of this entry and every entry before it, so a
+      * lookup knows when to stop walking back
+      */
+    uint64_t prefixMaxRequestId;
+    /**
+      * Offset of the block's TraceBlockHeader in the .ddt file
+      */
+    uint64_t blockOffset;
+    uint32_t block;
+    /**
+      * Length of the block's Bloom filter, a power of two
+      */
+    uint32_t bloomWords;
+    /**
+      * Index of the first word of the block's Bloom filter, counting from
+      * the first word after the entries
+      */
+    uint64_t bloomWord;
+};
+
+static_assert(sizeof(RequestIndexHeader) == 32,
+              "RequestIndexHeader layout changed");
+static_assert(sizeof(RequestIndexEntry) == 48,
+              "RequestIndexEntry layout changed");
+
+/**
+ * Builds the request index of a .ddt file block by block, as the file is
+ * written (see TraceFileWriter::setBlockCallback) or read back.
+ */
+class RequestIndexBuilder {
+  public:
+    RequestIndexBuilder();
+
+    void addBlock(size_t block, const TraceBlockInfo& info,
+                  const IntervalRecord* records, size_t count);
+
+    /**
+      * Writes the index of a .ddt file of traceFileSize bytes to fileName,
+      * through a temporary file so a reader never sees half an index.
+      * Throws a std::runtime_error if it cannot be written.
+      */
+    void write(const std::string& fileName, uint64_t traceFileSize);
+
+    void clear();
+
+  private:
+    std::vector<RequestIndexEntry> entries;
+    std::vector<uint64_t> bloomWords;
+    /**
+      * Request ids of the block being added, reused from block to block
+      */
+    std::vector<uint64_t> ids;
+};
+
+/**
+ * Reads a request index written by RequestIndexBuilder.
+ * Throws a std::runtime_error if the index is corrupt.
+ */
+class RequestIndexReader {
+  public:
+    RequestIndexReader();
+    ~RequestIndexReader();
+
+    void open(const std::string& fileName);
+    void close();
+
+    const RequestIndexHeader& getHeader() const {
+        return *header;
+    }
+
+    /**
+      * Appends to blocks the numbers of the blocks that may hold records of
+      * request id: those whose id range contains it and whose Bloom filter
+      * does not rule it out. Each is below getHeader().numBlocks.
+      */
+    void findBlocks(uint64_t id, std::vector<uint32_t>* blocks) const;
+
+  private:
+    bool mayContain(const RequestIndexEntry& entry, uint64_t id) const;
+
+    const char* mapping;
+    uint64_t fileSize;
+    const RequestIndexHeader* header;
+    const RequestIndexEntry* entries;
+    const uint64_t* bloomWords;
+    uint64_t numBloomWords;
+};
+
+class RequestIndexUtils {
+  public:
+    typedef std::function<void(const std::string& traceFile,
+                               const IntervalRecord* records,
+                               size_t count)> LookupCallback;
+
+    /**
+      * Returns the name of the request index of traceFile
+      */
+    static std::string getIndexFileName(const std::string& traceFile);
+
+    /**
+      * Builds the request index of an existing .ddt file by reading it
+      */
+    static void build(const std::string& traceFile);
+
+    /**
+      * Calls onRecords with every record of traceFiles whose request id is
+      * in ids, reading only the blocks the files' request indexes point at.
+      * Files without an up to date index, or whose index cannot be read,
+      * fall back to the id ranges in their own block index. Returns the
+      * number of blocks read.
+      */
+    static uint64_t lookup(const std::vector<std::string>& traceFiles,
+                           const std::vector<uint64_t>& ids,
+                           const LookupCallback& onRecords);
+};
+
+} // End DDTrace
+#endif
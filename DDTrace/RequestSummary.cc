@@ -0,0 +1,96 @@
+#include <algorithm>
+
+#include "RequestSummary.h"
+
+namespace DDTrace {
+
+void RequestSummaryUtils::summarize(const IntervalRecord* records,
+                                    size_t count, RequestSummary* summary,
+                                    RequestGraph* graph, CriticalPath* path){
+    summary->id = count ? records[0].getClock().id : 0;
+    summary->numIntervals = count;
+    summary->servers.clear();
+    summary->rootServer = INVALID_SERVER_ID;
+    summary->startNanoseconds = 0;
+    summary->endToEndNanoseconds = 0;
+    summary->totalNanoseconds = 0;
+    summary->criticalPathNanoseconds = 0;
+    summary->userspaceCycles = summary->l3Misses = summary->l3References = 0;
+    summary->numUserspaceCycles = summary->numL3Misses =
+        summary->numL3References = 0;
+    summary->complete = true;
+    if (!count){
+        return;
+    }
+
+    graph->build(records, count);
+    path->compute(*graph, records);
+    summary->criticalPathNanoseconds = path->getLengthNanoseconds();
+
+    //The first interval in topological order has the earliest clock
+    const IntervalRecord& root = records[graph->getTopologicalOrder()[0]];
+    summary->rootServer = root.getServerID();
+    uint64_t rootStart = root.getStartCycles();
+    uint64_t rootEnd = root.getEndCycles();
+    for(size_t i = 0; i < count; i++){
+        const IntervalRecord& record = records[i];
+        summary->servers.push_back(record.getServerID());
+        summary->totalNanoseconds += record.getElapsedNanoseconds();
+        if (record.getServerID() == summary->rootServer){
+            rootStart = std::min(rootStart, record.getStartCycles());
+            rootEnd = std::max(rootEnd, record.getEndCycles());
+        }
+        uint64_t value;
+        const PerfRecord& counters = record.getCountersDiff();
+        if (counters.getUserspaceCycles(&value)){
+            summary->userspaceCycles += value;
+            summary->numUserspaceCycles++;
+        }
+        if (counters.getL3Misses(&value)){
+            summary->l3Misses += value;
+            summary->numL3Misses++;
+        }
+        if (counters.getL3References(&value)){
+            summary->l3References += value;
+            summary->numL3References++;
+        }
+    }
+    std::sort(summary->servers.begin(), summary->servers.end());
+    summary->servers.erase(std::unique(summary->servers.begin(),
+                                       summary->servers.end()),
+                           summary->servers.end());
+    summary->startNanoseconds = static_cast<uint64_t>(
+        1e09 * static_cast<double>(rootStart) / root.getCyclesPerSec() + 0.5);
+    summary->endToEndNanoseconds = static_cast<uint64_t>(
+        1e09 * static_cast<double>(rootEnd - rootStart) /
+        root.getCyclesPerSec() + 0.5);
+}
+
+void RequestSummaryUtils::writeHeader(FILE* out){
+    fprintf(out, "RequestID,intervals,servers,rootServer,start_ns,"
+            "endToEnd_ns,total_ns,criticalPath_ns,cycles,l3misses,l3refs,"
+            "complete\n");
+}
+
+void RequestSummaryUtils::write(FILE* out, const RequestSummary& summary){
+    fprintf(out, "%lu,%zu,(", summary.id, summary.numIntervals);
+    for(size_t i = 0; i < summary.servers.size(); i++){
+        fprintf(out, i ? " %hu" : "%hu", summary.servers[i]);
+    }
+    fprintf(out, "),%hu,%lu,%lu,%lu,%lu", summary.rootServer,
+            summary.startNanoseconds, summary.endToEndNanoseconds,
+            summary.totalNanoseconds, summary.criticalPathNanoseconds);
+#define WRITE_SUM(sum, n) \
+    if (summary.n) { \
+        fprintf(out, ",%lu", summary.sum); \
+    } else { \
+        fprintf(out, ",NA"); \
+    }
+    WRITE_SUM(userspaceCycles, numUserspaceCycles)
+    WRITE_SUM(l3Misses, numL3Misses)
+    WRITE_SUM(l3References, numL3References)
+#undef WRITE_SUM
+    fprintf(out, ",%d\n", summary.complete ? 1 : 0);
+}
+
+} // End DDTrace
@@ -0,0 +1,83 @@
+#ifndef PERFGRAPH_REQUESTSUMMARY_H
+#define PERFGRAPH_REQUESTSUMMARY_H
+
+#include <cstdio>
+#include <vector>
+
+#include "DDTrace.h"
+#include "DDTrace/CriticalPath.h"
+#include "DDTrace/RequestGraph.h"
+
+namespace DDTrace {
+
+/**
+ * What one request (VectorClock::id) cost, end to end. Times are in
+ * nanoseconds. Counter sums only cover the intervals taken with the
+ * matching CounterType, which are counted next to them.
+ */
+struct RequestSummary {
+    uint64_t id;
+    size_t numIntervals;
+    /**
+      * Every server the request touched, in increasing order
+      */
+    std::vector<uint16_t> servers;
+    /**
+      * The server of the earliest interval by vector clock (the one the
+      * request came in on) and when it started there, in nanoseconds on
+      * that server's clock
+      */
+    uint16_t rootServer;
+    uint64_t startNanoseconds;
+    /**
+      * From the first start to the last end of the intervals on the root
+      * server
+      */
+    uint64_t endToEndNanoseconds;
+    /**
+      * Sum of the elapsed time of every interval
+      */
+    uint64_t totalNanoseconds;
+    /**
+      * Length of the CriticalPath of the request's RequestGraph
+      */
+    uint64_t criticalPathNanoseconds;
+    uint64_t userspaceCycles;
+    size_t numUserspaceCycles;
+    uint64_t l3Misses;
+    size_t numL3Misses;
+    uint64_t l3References;
+    size_t numL3References;
+    /**
+      * False if the summary was made before the request was known to be
+      * over, eg to bound memory, so it may miss intervals
+      */
+    bool complete;
+};
+
+class RequestSummaryUtils {
+  public:
+    /**
+      * Summarizes the count records of one request, which may be in any
+      * order. graph and path are rebuilt for the request, so a caller
+      * summarizing many can pass the same ones every time and reuse their
+      * memory.
+      */
+    static void summarize(const IntervalRecord* records, size_t count,
+                          RequestSummary* summary, RequestGraph* graph,
+                          CriticalPath* path);
+
+    /**
+      * Writes the column names of write
+      */
+    static void writeHeader(FILE* out);
+
+    /**
+      * Writes summary as a line of comma separated values. Servers are
+      * written as (<server> <server> ...) and missing counter sums as NA.
+      */
+    static void write(FILE* out, const RequestSummary& summary);
+};
+
+} // End DDTrace
+#endif
@@ -0,0 +1,444 @@
+#include <unistd.h>
+
+#include <unordered_set>
+
+#include "ShardedRecordSource.h"
+
+namespace DDTrace {
+
+/**
+  * One consumer thread and the channels it owns.
+  *
+  * Everything but the inbox is only touched by the shard's own thread (or by
+  * the thread calling stop, once the shard's thread has been joined).
+  */
+class ShardedRecordSource::Shard {
+  public:
+    enum CommandType {
+        /**
+          * Take ownership of channel
+          */
+        ADOPT,
+        /**
+          * The producer of the channel is dead, close it once drained
+          */
+        RETIRE,
+        /**
+          * Hand the channel over to shard toShard
+          */
+        MIGRATE
+    };
+
+    struct Command {
+        CommandType type;
+        Channel channel;
+        /**
+          * For ADOPT, whether the channel was already being retired
+          */
+        bool retiring;
+        size_t toShard;
+    };
+
+    Shard(ShardedRecordSource* owner, size_t index) :
+    owner(owner),
+    index(index),
+    channels(),
+    retiring(),
+    inboxMutex(),
+    inbox(),
+    inboxPending(false),
+    batch(SHARD_BATCH_SIZE),
+    stopping(false),
+    thread() {}
+
+    /**
+      * Called from any thread
+      */
+    void post(const Command& command){
+        std::lock_guard<std::mutex> lock(inboxMutex);
+        inbox.push_back(command);
+        inboxPending.store(true, std::memory_order_release);
+    }
+
+    bool hasPendingCommands() const {
+        return inboxPending.load(std::memory_order_acquire);
+    }
+
+    void start(){
+        thread = std::thread(&Shard::run, this);
+    }
+
+    void requestStop(){
+        stopping.store(true, std::memory_order_release);
+    }
+
+    void join(){
+        if (thread.joinable()){
+            thread.join();
+        }
+    }
+
+    /**
+      * Applies pending commands and drains every channel until empty.
+      * Used by stop, after every shard thread has been joined, to pick up
+      * channels that were migrated to a shard after it exited.
+      */
+    void finish(){
+        do {
+            applyCommands();
+        } while (drain() > 0);
+        retireDrainedChannels();
+    }
+
+    /**
+      * Unmaps every channel we own, leaving them for the next consumer.
+      * Used by stop, once finish has drained them.
+      */
+    void closeChannels(){
+        while (channels.size() > 0){
+            Channel channel;
+            std::string fileName = channels.get(channels.size() - 1).fileName;
+            channels.remove(fileName, &channel);
+            ChannelUtils::closeChannel(&channel);
+        }
+        retiring.clear();
+    }
+
+  private:
+    void run(){
+        while (true){
+            if (hasPendingCommands()){
+                applyCommands();
+            }
+            if (drain() > 0){
+                continue;
+            }
+            if (!retiring.empty()){
+                retireDrainedChannels();
+            }
+            if (stopping.load(std::memory_order_acquire)){
+                finish();
+                return;
+            }
+            waitForRecords();
+        }
+    }
+
+    /**
+      * Waits for a producer to ring our doorbell. Commands do not ring it,
+      * so we look at the inbox at least every SHARD_IDLE_WAIT.
+      */
+    void waitForRecords(){
+        Doorbell* doorbell = owner->discovery.getDoorbell(getDoorbellIndex());
+        uint32_t ticket = doorbell->prepareWait();
+        if (!channels.hasRecords() && !hasPendingCommands()){
+            doorbell->wait(ticket, SHARD_IDLE_WAIT);
+        }
+        doorbell->finishWait();
+    }
+
+    /**
+      * Doorbell 0 is the one rung for new channels, which the coordinator
+      * finds by polling instead
+      */
+    uint32_t getDoorbellIndex() const {
+        return static_cast<uint32_t>(index + 1);
+    }
+
+    void applyCommands(){
+        std::vector<Command> commands;
+        {
+            std::lock_guard<std::mutex> lock(inboxMutex);
+            commands.swap(inbox);
+            inboxPending.store(false, std::memory_order_relaxed);
+        }
+        for(auto cmd = commands.begin(); cmd != commands.end(); ++cmd){
+            const std::string& fileName = cmd->channel.fileName;
+            switch (cmd->type){
+            case ADOPT:
+                ChannelUtils::setConsumerDoorbell(cmd->channel,
+                                                  getDoorbellIndex());
+                channels.add(cmd->channel);
+                if (cmd->retiring){
+                    retiring.insert(fileName);
+                }
+                break;
+            case RETIRE:
+                //May arrive before the ADOPT of a channel still being
+                //migrated to us, so only remember the name
+                retiring.insert(fileName);
+                break;
+            case MIGRATE: {
+                Command adopt = {ADOPT, Channel(), false, 0};
+                if (!channels.remove(fileName, &adopt.channel)){
+                    break;
+                }
+                adopt.retiring = retiring.erase(fileName) > 0;
+                owner->shards[cmd->toShard]->post(adopt);
+                break;
+            }
+            }
+        }
+    }
+
+    /**
+      * Pops up to a batch from each kind of queue and hands them off.
+      * Returns the number of records popped.
+      */
+    size_t drain(){
+        size_t count = 0;
+        while (count < SHARD_BATCH_SIZE && channels.popRecord(&batch[count])){
+            count++;
+        }
+        if (count > 0){
+            owner->onRecords(index, &batch[0], count);
+        }
+
+        size_t SLAcount = 0;
+        while (SLAcount < SHARD_BATCH_SIZE &&
+               channels.popSLAExceededRecord(&batch[SLAcount])){
+            SLAcount++;
+        }
+        if (SLAcount > 0 && owner->onSLAExceededRecords){
+            owner->onSLAExceededRecords(index, &batch[0], SLAcount);
+        }
+        return count + SLAcount;
+    }
+
+    void retireDrainedChannels(){
+        for(auto itr = retiring.begin(); itr != retiring.end(); ){
+            const Channel* channel = channels.find(*itr);
+            if (!channel || !ChannelUtils::isDrained(*channel)){
+                ++itr;
+                continue;
+            }
+            Channel removed;
+            channels.remove(*itr, &removed);
+            ChannelUtils::closeAndRemoveChannel(&removed);
+            owner->reportRetired(*itr);
+            itr = retiring.erase(itr);
+        }
+    }
+
+    ShardedRecordSource* owner;
+    size_t index;
+    ChannelSet channels;
+    /**
+      * Names of channels to close once drained
+      */
+    std::unordered_set<std::string> retiring;
+
+    std::mutex inboxMutex;
+    std::vector<Command> inbox;
+    /**
+      * Lets the shard skip taking inboxMutex when there is nothing to do
+      */
+    std::atomic<bool> inboxPending;
+
+    std::vector<IntervalRecord> batch;
+    std::atomic<bool> stopping;
+    std::thread thread;
+};
+
+ShardedRecordSource::ShardedRecordSource() :
+shards(),
+discovery(),
+onRecords(),
+onSLAExceededRecords(),
+ownedChannels(),
+shardLoads(),
+droppedByRetiredChannels(0),
+retiredMutex(),
+retired(),
+droppedRecords(0),
+running(false),
+coordinator() {}
+
+ShardedRecordSource::~ShardedRecordSource(){
+    stop();
+}
+
+void ShardedRecordSource::init(const std::string& baseName,
+                               size_t numShards,
+                               const BatchCallback& onRecords,
+                               const BatchCallback& onSLAExceededRecords){
+    if (numShards == 0){
+        throw std::runtime_error("ShardedRecordSource needs at least one shard");
+    }
+    if (numShards >= CHANNEL_DOORBELLS){
+        throw std::runtime_error("ShardedRecordSource has a doorbell for at "
+                                 "most CHANNEL_DOORBELLS - 1 shards");
+    }
+    discovery.init(baseName);
+    this->onRecords = onRecords;
+    this->onSLAExceededRecords = onSLAExceededRecords;
+    shards.clear();
+    for(size_t i = 0; i < numShards; i++){
+        shards.emplace_back(new Shard(this, i));
+    }
+    shardLoads.assign(numShards, 0);
+}
+
+void ShardedRecordSource::start(){
+    assert(!shards.empty());
+    running.store(true, std::memory_order_release);
+    for(auto itr = shards.begin(); itr != shards.end(); ++itr){
+        (*itr)->start();
+    }
+    coordinator = std::thread(&ShardedRecordSource::coordinate, this);
+}
+
+void ShardedRecordSource::stop(){
+    if (!coordinator.joinable()){
+        return;
+    }
+    //No more commands after this, so shards can wind down
+    running.store(false, std::memory_order_release);
+    coordinator.join();
+    for(auto itr = shards.begin(); itr != shards.end(); ++itr){
+        (*itr)->requestStop();
+    }
+    for(auto itr = shards.begin(); itr != shards.end(); ++itr){
+        (*itr)->join();
+    }
+    //A shard may have migrated a channel to one that had already exited
+    bool pending = true;
+    while (pending){
+        pending = false;
+        for(auto itr = shards.begin(); itr != shards.end(); ++itr){
+            if ((*itr)->hasPendingCommands()){
+                (*itr)->finish();
+                pending = true;
+            }
+        }
+    }
+    collectRetiredChannels();
+    for(auto itr = shards.begin(); itr != shards.end(); ++itr){
+        (*itr)->closeChannels();
+    }
+    ownedChannels.clear();
+    shardLoads.assign(shards.size(), 0);
+}
+
+void ShardedRecordSource::coordinate(){
+    discoverChannels(true);
+    uint64_t timeLastDeadCheck = Cycles::rdtsc();
+    while (running.load(std::memory_order_acquire)){
+        if (discovery.hasNewChannels()){
+            discoverChannels(false);
+        }
+        collectRetiredChannels();
+        if (Cycles::toMicroseconds(Cycles::rdtsc() - timeLastDeadCheck) >
+            CHECK_RECORDS_INTERVAL){
+            checkForDeadChannels();
+            timeLastDeadCheck = Cycles::rdtsc();
+        }
+        rebalance();
+        usleep(CHANNEL_DISCOVERY_INTERVAL);
+    }
+}
+
+void ShardedRecordSource::discoverChannels(bool scanDirectory){
+    std::vector<std::string> fileNames;
+    if (scanDirectory){
+        discovery.scanDirectory(&fileNames);
+    } else {
+        discovery.poll(&fileNames);
+    }
+    for(auto itr = fileNames.begin(); itr != fileNames.end(); ++itr){
+        if (ownedChannels.find(*itr) != ownedChannels.end()){
+            continue;
+        }
+        //The channel may already have died and been removed
+        if (access(itr->c_str(), F_OK) != 0){
+            continue;
+        }
+        size_t shard = 0;
+        for(size_t i = 1; i < shardLoads.size(); i++){
+            if (shardLoads[i] < shardLoads[shard]){
+                shard = i;
+            }
+        }
+        OwnedChannel owned = {ChannelUtils::openChannel(*itr), shard, false};
+        ownedChannels[*itr] = owned;
+        shardLoads[shard]++;
+        Shard::Command adopt = {Shard::ADOPT, owned.channel, false, 0};
+        shards[shard]->post(adopt);
+    }
+}
+
+void ShardedRecordSource::checkForDeadChannels(){
+    uint64_t dropped = 0;
+    for(auto itr = ownedChannels.begin(); itr != ownedChannels.end(); ++itr){
+        OwnedChannel& owned = itr->second;
+        if (owned.retiring){
+            continue;
+        }
+        //Read the count before the shard can unmap the channel
+        uint64_t channelDropped = ChannelUtils::getDroppedRecords(owned.channel);
+        if (ChannelUtils::isDead(owned.channel)){
+            owned.retiring = true;
+            droppedByRetiredChannels += channelDropped;
+            Shard::Command retire = {Shard::RETIRE, owned.channel, false, 0};
+            shards[owned.shard]->post(retire);
+        } else {
+            dropped += channelDropped;
+        }
+    }
+    droppedRecords.store(droppedByRetiredChannels + dropped,
+                         std::memory_order_relaxed);
+}
+
+void ShardedRecordSource::collectRetiredChannels(){
+    std::vector<std::string> fileNames;
+    {
+        std::lock_guard<std::mutex> lock(retiredMutex);
+        fileNames.swap(retired);
+    }
+    for(auto itr = fileNames.begin(); itr != fileNames.end(); ++itr){
+        auto owned = ownedChannels.find(*itr);
+        assert(owned != ownedChannels.end());
+        shardLoads[owned->second.shard]--;
+        ownedChannels.erase(owned);
+    }
+}
+
+void ShardedRecordSource::rebalance(){
+    while (true){
+        size_t most = 0, least = 0;
+        for(size_t i = 1; i < shardLoads.size(); i++){
+            if (shardLoads[i] > shardLoads[most]){
+                most = i;
+            }
+            if (shardLoads[i] < shardLoads[least]){
+                least = i;
+            }
+        }
+        if (shardLoads[most] - shardLoads[least] <= 1){
+            return;
+        }
+        //Retiring channels are about to go away on their own
+        OwnedChannel* moved = NULL;
+        for(auto itr = ownedChannels.begin(); itr != ownedChannels.end(); ++itr){
+            if (itr->second.shard == most && !itr->second.retiring){
+                moved = &itr->second;
+                break;
+            }
+        }
+        if (!moved){
+            return;
+        }
+        Shard::Command migrate = {Shard::MIGRATE, moved->channel, false, least};
+        shards[most]->post(migrate);
+        moved->shard = least;
+        shardLoads[most]--;
+        shardLoads[least]++;
+    }
+}
+
+void ShardedRecordSource::reportRetired(const std::string& fileName){
+    std::lock_guard<std::mutex> lock(retiredMutex);
+    retired.push_back(fileName);
+}
+
+} //namespace DDTrace
@@ -0,0 +1,150 @@
+#ifndef PERFGRAPH_SHARDEDRECORDSOURCE_H
+#define PERFGRAPH_SHARDEDRECORDSOURCE_H
+
+#include <functional>
+#include <memory>
+
+#include "DDTrace.h"
+
+namespace DDTrace {
+
+/**
+  * Maximum number of records a shard hands to its callback at once
+  */
+const size_t SHARD_BATCH_SIZE = 256;
+
+/**
+  * Time interval, in microseconds, between checks of the ChannelRegistry for
+  * new channels by the ShardedRecordSource's coordinator thread
+  */
+const uint64_t CHANNEL_DISCOVERY_INTERVAL = 1000;
+
+/**
+  * Longest time, in microseconds, an idle shard sleeps on its Doorbell
+  * before checking for commands from the coordinator
+  */
+const uint64_t SHARD_IDLE_WAIT = 1000;
+
+/**
+ * A RecordSource that drains channels on several consumer threads at once.
+ *
+ * Each shard thread owns a disjoint ChannelSet and hands what it pops to a
+ * callback, in batches, on its own thread. A coordinator thread discovers
+ * new channels and gives each to the shard with the fewest channels,
+ * retires dead channels once their shard has drained them, and moves
+ * channels between shards so that their channel counts never differ by
+ * more than one.
+ *
+ * Ownership of a channel only changes hands through a shard's inbox, which
+ * is protected by a mutex, so each channel always has a single consumer.
+ */
+class ShardedRecordSource {
+  public:
+    /**
+      * Called on shard thread `shard` with `count` records popped from the
+      * channels that shard owns.
+      */
+    typedef std::function<void(size_t shard,
+                               const IntervalRecord* records,
+                               size_t count)> BatchCallback;
+
+    ShardedRecordSource();
+    ~ShardedRecordSource();
+
+    /**
+      * \param baseName
+      *   a name of the sink to connect to, see RecordSource::init
+      * \param numShards
+      *   number of consumer threads to drain channels on, less than
+      *   CHANNEL_DOORBELLS since each sleeps on a Doorbell of its own
+      * \param onRecords
+      *   receives batches from the ALL queues
+      * \param onSLAExceededRecords
+      *   receives batches from the SLAexceeded queues, the exceptional
+      *   records that did not fit on the ALL queues. May be empty, in
+      *   which case those records are popped and discarded (a channel can
+      *   only be retired once both of its queues are empty).
+      */
+    void init(const std::string& baseName,
+              size_t numShards,
+              const BatchCallback& onRecords,
+              const BatchCallback& onSLAExceededRecords = BatchCallback());
+
+    /**
+      * Starts the coordinator and shard threads
+      */
+    void start();
+
+    /**
+      * Stops discovering channels, lets every shard drain the channels it
+      * owns, and joins all threads. Channels are then unmapped but left in
+      * place for the next consumer.
+      */
+    void stop();
+
+    size_t getNumShards() const {
+        return shards.size();
+    }
+
+    /**
+      * Returns the number of records producers have had to drop, summed
+      * over every channel this source has been connected to.
+      * Updated by the coordinator every CHECK_RECORDS_INTERVAL.
+      */
+    uint64_t getDroppedRecords() const {
+        return droppedRecords.load(std::memory_order_relaxed);
+    }
+
+  private:
+    class Shard;
+
+    /**
+      * What the coordinator knows about a channel it handed to a shard
+      */
+    struct OwnedChannel {
+        Channel channel;
+        size_t shard;
+        /**
+          * The producer is dead and the shard has been told to retire the
+          * channel once drained. The shard may unmap it at any time, so
+          * the coordinator must not touch channel.records any more.
+          */
+        bool retiring;
+    };
+
+    void coordinate();
+    void discoverChannels(bool scanDirectory);
+    void checkForDeadChannels();
+    void collectRetiredChannels();
+    void rebalance();
+
+    /**
+      * Called on a shard thread once it has closed a retired channel
+      */
+    void reportRetired(const std::string& fileName);
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    ChannelDiscovery discovery;
+    BatchCallback onRecords;
+    BatchCallback onSLAExceededRecords;
+
+    /**
+      * Only touched by the coordinator thread
+      */
+    std::unordered_map<std::string, OwnedChannel> ownedChannels;
+    std::vector<size_t> shardLoads;
+    uint64_t droppedByRetiredChannels;
+
+    /**
+      * Channels shards have finished retiring, waiting for the coordinator
+      */
+    std::mutex retiredMutex;
+    std::vector<std::string> retired;
+
+    std::atomic<uint64_t> droppedRecords;
+    std::atomic<bool> running;
+    std::thread coordinator;
+};
+
+} // End DDTrace
+#endif
@@ -0,0 +1,238 @@
+#include <string.h>
+
+#include <map>
+#include <string>
+
+#include "TraceCodec.h"
+
+namespace DDTrace {
+
+typedef std::vector<char> Bytes;
+
+static inline uint64_t zigzag(int64_t value){
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t value){
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+static inline void putVarint(Bytes* out, uint64_t value){
+    while (value >= 0x80){
+        out->push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out->push_back(static_cast<char>(value));
+}
+
+static inline void putDelta(Bytes* out, uint64_t value, uint64_t* previous){
+    putVarint(out, zigzag(static_cast<int64_t>(value - *previous)));
+    *previous = value;
+}
+
+/**
+  * Reads one column, throwing if it runs past its end
+  */
+class ColumnReader {
+  public:
+    ColumnReader() : cursor(NULL), end(NULL) {}
+
+    void reset(const char* begin, size_t size){
+        cursor = begin;
+        end = begin + size;
+    }
+
+    uint64_t getVarint(){
+        uint64_t value = 0;
+        for(int shift = 0; shift < 64; shift += 7){
+            if (cursor == end){
+                throw std::runtime_error("Truncated compressed block");
+            }
+            uint8_t byte = static_cast<uint8_t>(*cursor++);
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80)){
+                return value;
+            }
+        }
+        throw std::runtime_error("Malformed varint in compressed block");
+    }
+
+    uint64_t getDelta(uint64_t* previous){
+        *previous += static_cast<uint64_t>(unzigzag(getVarint()));
+        return *previous;
+    }
+
+    const char* getBytes(size_t size){
+        if (static_cast<size_t>(end - cursor) < size){
+            throw std::runtime_error("Truncated compressed block");
+        }
+        const char* bytes = cursor;
+        cursor += size;
+        return bytes;
+    }
+
+  private:
+    const char* cursor;
+    const char* end;
+};
+
+void TraceCodec::encode(const IntervalRecord* records, size_t count,
+                        std::vector<char>* out){
+    Bytes columns[NUM_COLUMNS];
+
+    //Only worth a dictionary if annotations repeat
+    std::map<std::string, uint64_t> dictionary;
+    for(size_t i = 0; i < count && dictionary.size() * 2 <= count; i++){
+        dictionary.insert(std::make_pair(records[i].getAnnotation(), 0));
+    }
+    bool useDictionary = dictionary.size() * 2 <= count;
+    if (useDictionary){
+        Bytes& column = columns[ANNOTATION];
+        putVarint(&column, dictionary.size());
+        uint64_t next = 0;
+        for(auto itr = dictionary.begin(); itr != dictionary.end(); ++itr){
+            itr->second = next++;
+            putVarint(&column, itr->first.size());
+            column.insert(column.end(), itr->first.begin(), itr->first.end());
+        }
+    }
+
+    uint64_t previousStart = 0, previousId = 0, previousServer = 0;
+    uint64_t previousCyclesPerSec = 0, previousCounterType = 0;
+    for(size_t i = 0; i < count; i++){
+        const IntervalRecord& r = records[i];
+        putDelta(&columns[START_CYCLES], r.getStartCycles(), &previousStart);
+        putVarint(&columns[DURATION], zigzag(static_cast<int64_t>(
+                        r.getEndCycles() - r.getStartCycles())));
+
+        const VectorClock& clock = r.getClock();
+        putDelta(&columns[REQUEST_ID], clock.id, &previousId);
+        uint64_t length = std::min<uint64_t>(clock.length,
+                                             MAX_VECTORCLOCK_ENTRIES);
+        putVarint(&columns[CLOCK_ENTRIES], length);
+        for(uint64_t e = 0; e < length; e++){
+            putVarint(&columns[CLOCK_ENTRIES], clock.entries[e].serverId);
+            columns[CLOCK_ENTRIES].push_back(
+                    static_cast<char>(clock.entries[e].count));
+        }
+
+        putDelta(&columns[SERVER_ID], r.getServerID(), &previousServer);
+
+        double cyclesPerSec = r.getCyclesPerSec();
+        uint64_t cyclesPerSecBits;
+        memcpy(&cyclesPerSecBits, &cyclesPerSec, sizeof(cyclesPerSecBits));
+        putDelta(&columns[CYCLES_PER_SEC], cyclesPerSecBits,
+                 &previousCyclesPerSec);
+
+        const PerfRecord& counters = r.getCountersDiff();
+        putDelta(&columns[COUNTERS], counters.recordCounterType,
+                 &previousCounterType);
+        for(size_t c = 0; c < MAX_COUNTERS_PER_COUNTERTYPE; c++){
+            putVarint(&columns[COUNTERS],
+                      zigzag(static_cast<int64_t>(counters.counters[c])));
+        }
+
+        const char* annotation = r.getAnnotation();
+        size_t annotationLength = strnlen(annotation, MAX_ANNOTATION_LENGTH);
+        if (useDictionary){
+            putVarint(&columns[ANNOTATION],
+                      dictionary[std::string(annotation, annotationLength)]);
+        } else {
+            putVarint(&columns[ANNOTATION], annotationLength);
+            columns[ANNOTATION].insert(columns[ANNOTATION].end(), annotation,
+                                       annotation + annotationLength);
+        }
+    }
+
+    out->push_back(useDictionary ? COMPRESSED_ANNOTATION_DICTIONARY : 0);
+    for(size_t c = 0; c < NUM_COLUMNS; c++){
+        putVarint(out, columns[c].size());
+    }
+    for(size_t c = 0; c < NUM_COLUMNS; c++){
+        out->insert(out->end(), columns[c].begin(), columns[c].end());
+    }
+}
+
+void TraceCodec::decode(const char* data, size_t size, size_t count,
+                        std::vector<IntervalRecord>* out){
+    ColumnReader header;
+    header.reset(data, size);
+    uint8_t flags = static_cast<uint8_t>(*header.getBytes(1));
+    size_t lengths[NUM_COLUMNS];
+    for(size_t c = 0; c < NUM_COLUMNS; c++){
+        lengths[c] = header.getVarint();
+    }
+    ColumnReader columns[NUM_COLUMNS];
+    for(size_t c = 0; c < NUM_COLUMNS; c++){
+        columns[c].reset(header.getBytes(lengths[c]), lengths[c]);
+    }
+
+    std::vector<std::string> dictionary;
+    if (flags & COMPRESSED_ANNOTATION_DICTIONARY){
+        uint64_t entries = columns[ANNOTATION].getVarint();
+        if (entries > count){
+            throw std::runtime_error("Malformed annotation dictionary");
+        }
+        for(uint64_t i = 0; i < entries; i++){
+            uint64_t length = columns[ANNOTATION].getVarint();
+            dictionary.push_back(std::string(
+                        columns[ANNOTATION].getBytes(length), length));
+        }
+    }
+
+    out->resize(count);
+    uint64_t previousStart = 0, previousId = 0, previousServer = 0;
+    uint64_t previousCyclesPerSec = 0, previousCounterType = 0;
+    char annotation[MAX_ANNOTATION_LENGTH + 1];
+    for(size_t i = 0; i < count; i++){
+        uint64_t start = columns[START_CYCLES].getDelta(&previousStart);
+        uint64_t end = start + static_cast<uint64_t>(
+                unzigzag(columns[DURATION].getVarint()));
+
+        VectorClock clock(columns[REQUEST_ID].getDelta(&previousId));
+        clock.length = columns[CLOCK_ENTRIES].getVarint();
+        if (clock.length > MAX_VECTORCLOCK_ENTRIES){
+            throw std::runtime_error("Vector clock too long for this build");
+        }
+        for(uint64_t e = 0; e < clock.length; e++){
+            clock.entries[e].serverId = columns[CLOCK_ENTRIES].getVarint();
+            clock.entries[e].count =
+                static_cast<uint8_t>(*columns[CLOCK_ENTRIES].getBytes(1));
+        }
+
+        uint16_t serverId = columns[SERVER_ID].getDelta(&previousServer);
+
+        uint64_t cyclesPerSecBits =
+            columns[CYCLES_PER_SEC].getDelta(&previousCyclesPerSec);
+        double cyclesPerSec;
+        memcpy(&cyclesPerSec, &cyclesPerSecBits, sizeof(cyclesPerSec));
+
+        PerfRecord counters;
+        counters.recordCounterType = static_cast<CounterType>(
+                columns[COUNTERS].getDelta(&previousCounterType));
+        for(size_t c = 0; c < MAX_COUNTERS_PER_COUNTERTYPE; c++){
+            counters.counters[c] = static_cast<uint64_t>(
+                    unzigzag(columns[COUNTERS].getVarint()));
+        }
+
+        if (flags & COMPRESSED_ANNOTATION_DICTIONARY){
+            uint64_t id = columns[ANNOTATION].getVarint();
+            if (id >= dictionary.size()){
+                throw std::runtime_error("Malformed annotation dictionary");
+            }
+            strncpy(annotation, dictionary[id].c_str(), MAX_ANNOTATION_LENGTH);
+        } else {
+            uint64_t length = columns[ANNOTATION].getVarint();
+            const char* bytes = columns[ANNOTATION].getBytes(length);
+            length = std::min<uint64_t>(length, MAX_ANNOTATION_LENGTH);
+            memcpy(annotation, bytes, length);
+            annotation[length] = 0;
+        }
+        annotation[MAX_ANNOTATION_LENGTH] = 0;
+
+        (*out)[i] = IntervalRecord(start, end, clock, serverId, cyclesPerSec,
+                                   counters, annotation);
+    }
+}
+
+} //namespace DDTrace
@@ -0,0 +1,63 @@
+#ifndef PERFGRAPH_TRACECODEC_H
+#define PERFGRAPH_TRACECODEC_H
+
+#include <vector>
+
+#include "DDTrace.h"
+
+namespace DDTrace {
+
+/**
+ * Compresses blocks of IntervalRecords for TRACE_BLOCK_COMPRESSED blocks of
+ * .ddt files.
+ *
+ * Each field is stored as its own column so that similar values sit
+ * together: start cycles as deltas from the previous record, end cycles as
+ * the duration, request ids and serverIds as deltas, counters as is (they
+ * are already differences), all zigzag + varint encoded. Annotations are
+ * either stored inline or, when few distinct ones repeat (the usual case),
+ * as indices into a dictionary at the head of their column.
+ *
+ * The encoding spells out every field, so unlike raw blocks it can be read
+ * back by a build with a different IntervalRecord layout.
+ *
+ * Payload layout:
+ *     flags byte (COMPRESSED_ANNOTATION_DICTIONARY)
+ *     varint byte length of each of the NUM_COLUMNS columns
+ *     the columns, in Column order
+ */
+class TraceCodec {
+  public:
+    /**
+      * Appends the encoding of records to out
+      */
+    static void encode(const IntervalRecord* records, size_t count,
+                       std::vector<char>* out);
+
+    /**
+      * Replaces the contents of out with the count records encoded in data.
+      * Throws a std::runtime_error if data is malformed.
+      */
+    static void decode(const char* data, size_t size, size_t count,
+                       std::vector<IntervalRecord>* out);
+
+  private:
+    enum Column {
+        START_CYCLES = 0,
+        DURATION,
+        REQUEST_ID,
+        CLOCK_ENTRIES,
+        SERVER_ID,
+        CYCLES_PER_SEC,
+        COUNTERS,
+        ANNOTATION,
+        NUM_COLUMNS
+    };
+
+    enum Flags {
+        COMPRESSED_ANNOTATION_DICTIONARY = 1,
+    };
+};
+
+} // End DDTrace
+#endif
@@ -0,0 +1,594 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+#include "TraceFile.h"
+#include "TraceCodec.h"
+#include "Cycles.h"
+
+namespace DDTrace {
+
+static const char TRACE_FILE_MAGIC[8] = {'D', 'D', 'T', 'R', 'A', 'C', 'E', 0};
+static const char TRACE_FOOTER_MAGIC[8] = {'D', 'D', 'T', 'I', 'N', 'D', 'E', 'X'};
+//"DDTB" read as a little endian word
+static const uint32_t TRACE_BLOCK_MAGIC = 0x42544444;
+
+//Version 1 structs are a prefix of the current ones
+static const size_t TRACE_FILE_HEADER_V1_SIZE = 40;
+static const size_t TRACE_BLOCK_HEADER_V1_SIZE = 56;
+static const size_t TRACE_BLOCK_INFO_V1_SIZE = 48;
+
+/**
+  * Fills in the fields a version 1 block lacks so it matches anything
+  */
+template<typename Block>
+static void fillVersion1Block(Block* block){
+    block->maxEndCycles = std::numeric_limits<uint64_t>::max();
+    block->minServerId = 0;
+    block->maxServerId = std::numeric_limits<uint16_t>::max();
+    block->reserved = 0;
+}
+
+uint64_t TraceFileUtils::checksum(const void* data, size_t size){
+    const uint64_t FNV_PRIME = 1099511628211UL;
+    uint64_t hash = 14695981039346656037UL;
+    const char* bytes = static_cast<const char*>(data);
+    size_t i = 0;
+    for(; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)){
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        hash = (hash ^ word) * FNV_PRIME;
+    }
+    for(; i < size; i++){
+        hash = (hash ^ static_cast<uint8_t>(bytes[i])) * FNV_PRIME;
+    }
+    return hash;
+}
+
+TraceFileWriter::TraceFileWriter() :
+file(NULL),
+encoding(TRACE_BLOCK_COMPRESSED),
+wroteHeader(false),
+bytesWritten(0),
+pending(),
+index(),
+payload(),
+onBlock() {}
+
+TraceFileWriter::~TraceFileWriter(){
+    //A destructor must not throw, so errors can only be reported here
+    try {
+        close();
+    } catch (const std::exception& e) {
+        fprintf(stderr, "Could not finish trace file: %s\n", e.what());
+    }
+}
+
+void TraceFileWriter::open(const std::string& fileName,
+                           TraceBlockEncoding _encoding){
+    assert(!file);
+    encoding = _encoding;
+    file = fopen(fileName.c_str(), "wb");
+    if (!file){
+        fprintf(stderr, "Could not open %s for writing\n", fileName.c_str());
+        throw std::runtime_error("Could not open trace file");
+    }
+    wroteHeader = false;
+    bytesWritten = 0;
+    pending.clear();
+    pending.reserve(TRACE_FILE_BLOCK_RECORDS);
+    index.clear();
+}
+
+void TraceFileWriter::write(const void* data, size_t size){
+    if (fwrite(data, 1, size, file) != size){
+        throw std::runtime_error("Short write to trace file");
+    }
+    bytesWritten += size;
+}
+
+void TraceFileWriter::writeHeader(const IntervalRecord* first){
+    TraceFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_FILE_VERSION;
+    header.recordSize = sizeof(IntervalRecord);
+    strncpy(header.schema, getRecordStateSchema(), sizeof(header.schema) - 1);
+    header.blockRecords = TRACE_FILE_BLOCK_RECORDS;
+    if (first){
+        header.serverId = first->getServerID();
+        header.counterType = first->getCountersDiff().getCounterType();
+        header.cyclesPerSec = first->getCyclesPerSec();
+    } else {
+        header.serverId = INVALID_SERVER_ID;
+        header.counterType = INVALID_COUNTER_TYPE;
+        header.cyclesPerSec = 0;
+    }
+    //Take the two clocks as close together as we can
+    struct timespec now;
+    uint64_t before = Cycles::rdtsc();
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t after = Cycles::rdtsc();
+    header.anchorCycles = before + (after - before) / 2;
+    header.anchorUnixNanoseconds = now.tv_sec * 1000000000UL + now.tv_nsec;
+    write(&header, sizeof(header));
+    wroteHeader = true;
+}
+
+void TraceFileWriter::writeBlock(){
+    if (pending.empty()){
+        return;
+    }
+    TraceBlockHeader block;
+    memset(&block, 0, sizeof(block));
+    block.magic = TRACE_BLOCK_MAGIC;
+    block.encoding = encoding;
+    block.recordCount = pending.size();
+    const char* data;
+    if (encoding == TRACE_BLOCK_COMPRESSED){
+        payload.clear();
+        TraceCodec::encode(&pending[0], pending.size(), &payload);
+        data = payload.data();
+        block.payloadBytes = payload.size();
+    } else {
+        data = reinterpret_cast<const char*>(&pending[0]);
+        block.payloadBytes = pending.size() * sizeof(IntervalRecord);
+    }
+    block.minStartCycles = std::numeric_limits<uint64_t>::max();
+    block.minRequestId = std::numeric_limits<uint64_t>::max();
+    block.minServerId = std::numeric_limits<uint16_t>::max();
+    for(auto r = pending.begin(); r != pending.end(); ++r){
+        block.minStartCycles = std::min(block.minStartCycles, r->getStartCycles());
+        block.maxStartCycles = std::max(block.maxStartCycles, r->getStartCycles());
+        block.maxEndCycles = std::max(block.maxEndCycles, r->getEndCycles());
+        block.minRequestId = std::min(block.minRequestId, r->getClock().id);
+        block.maxRequestId = std::max(block.maxRequestId, r->getClock().id);
+        block.minServerId = std::min(block.minServerId, r->getServerID());
+        block.maxServerId = std::max(block.maxServerId, r->getServerID());
+    }
+    block.checksum = TraceFileUtils::checksum(data, block.payloadBytes);
+
+    TraceBlockInfo info;
+    info.offset = bytesWritten;
+    info.recordCount = block.recordCount;
+    info.payloadBytes = block.payloadBytes;
+    info.minStartCycles = block.minStartCycles;
+    info.maxStartCycles = block.maxStartCycles;
+    info.minRequestId = block.minRequestId;
+    info.maxRequestId = block.maxRequestId;
+    info.maxEndCycles = block.maxEndCycles;
+    info.minServerId = block.minServerId;
+    info.maxServerId = block.maxServerId;
+    info.reserved = 0;
+    index.push_back(info);
+
+    write(&block, sizeof(block));
+    write(data, block.payloadBytes);
+    if (onBlock){
+        onBlock(index.size() - 1, info, &pending[0], pending.size());
+    }
+    pending.clear();
+}
+
+void TraceFileWriter::append(const IntervalRecord* records, size_t count){
+    assert(file);
+    if (count > 0 && !wroteHeader){
+        writeHeader(records);
+    }
+    while (count > 0){
+        size_t batch = std::min<size_t>(count,
+                TRACE_FILE_BLOCK_RECORDS - pending.size());
+        pending.insert(pending.end(), records, records + batch);
+        records += batch;
+        count -= batch;
+        if (pending.size() == TRACE_FILE_BLOCK_RECORDS){
+            writeBlock();
+        }
+    }
+}
+
+void TraceFileWriter::close(){
+    if (!file){
+        return;
+    }
+    if (!wroteHeader){
+        writeHeader(NULL);
+    }
+    writeBlock();
+    TraceFileFooter footer;
+    footer.indexOffset = bytesWritten;
+    footer.numBlocks = index.size();
+    memcpy(footer.magic, TRACE_FOOTER_MAGIC, sizeof(footer.magic));
+    if (!index.empty()){
+        write(&index[0], index.size() * sizeof(TraceBlockInfo));
+    }
+    write(&footer, sizeof(footer));
+    int rc = fclose(file);
+    file = NULL;
+    if (rc != 0){
+        throw std::runtime_error("Could not close trace file");
+    }
+}
+
+TraceFileReader::TraceFileReader() :
+fileName(),
+mapping(NULL),
+fileSize(0),
+rawDump(false),
+header(),
+headerSize(sizeof(TraceFileHeader)),
+blockHeaderSize(sizeof(TraceBlockHeader)),
+index(),
+blocksByStart(),
+prefixMaxEndCycles(),
+decoded() {}
+
+TraceFileReader::~TraceFileReader(){
+    close();
+}
+
+void TraceFileReader::close(){
+    if (mapping){
+        munmap(const_cast<char*>(mapping), fileSize);
+        mapping = NULL;
+    }
+    fileSize = 0;
+    index.clear();
+    blocksByStart.clear();
+    prefixMaxEndCycles.clear();
+    decoded.clear();
+}
+
+const char* TraceFileReader::at(uint64_t offset, size_t size) const {
+    if (offset > fileSize || size > fileSize - offset){
+        fprintf(stderr, "Truncated trace file %s\n", fileName.c_str());
+        throw std::runtime_error("Truncated trace file");
+    }
+    return mapping + offset;
+}
+
+void TraceFileReader::open(const std::string& _fileName){
+    assert(!mapping);
+    fileName = _fileName;
+    int fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd < 0){
+        fprintf(stderr, "Could not open %s\n", fileName.c_str());
+        throw std::runtime_error("Could not open trace file");
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0){
+        ::close(fd);
+        throw std::runtime_error("Could not stat trace file");
+    }
+    fileSize = st.st_size;
+    if (fileSize > 0){
+        void* map = mmap(NULL, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED){
+            ::close(fd);
+            fprintf(stderr, "Could not map %s\n", fileName.c_str());
+            throw std::runtime_error("Could not map trace file");
+        }
+        mapping = static_cast<const char*>(map);
+        //Blocks are read front to back, start reading ahead right away
+        madvise(map, fileSize, MADV_SEQUENTIAL);
+        madvise(map, fileSize, MADV_WILLNEED);
+    }
+    ::close(fd);
+
+    index.clear();
+    blocksByStart.clear();
+    prefixMaxEndCycles.clear();
+    rawDump = fileSize < TRACE_FILE_HEADER_V1_SIZE ||
+        memcmp(mapping, TRACE_FILE_MAGIC, sizeof(TRACE_FILE_MAGIC)) != 0;
+    memset(&header, 0, sizeof(header));
+    if (rawDump){
+        indexRawDump();
+        return;
+    }
+
+    memcpy(&header, at(0, TRACE_FILE_HEADER_V1_SIZE), TRACE_FILE_HEADER_V1_SIZE);
+    size_t blockInfoSize;
+    if (header.version == TRACE_FILE_VERSION){
+        headerSize = sizeof(TraceFileHeader);
+        blockHeaderSize = sizeof(TraceBlockHeader);
+        blockInfoSize = sizeof(TraceBlockInfo);
+        memcpy(&header, at(0, headerSize), headerSize);
+    } else if (header.version == 1){
+        headerSize = TRACE_FILE_HEADER_V1_SIZE;
+        blockHeaderSize = TRACE_BLOCK_HEADER_V1_SIZE;
+        blockInfoSize = TRACE_BLOCK_INFO_V1_SIZE;
+    } else {
+        fprintf(stderr, "%s has version %u, we read versions 1 to %u\n",
+                fileName.c_str(), header.version, TRACE_FILE_VERSION);
+        close();
+        throw std::runtime_error("Unsupported trace file version");
+    }
+
+    TraceFileFooter footer;
+    bool hasFooter = false;
+    if (fileSize >= headerSize + sizeof(footer)){
+        memcpy(&footer, at(fileSize - sizeof(footer), sizeof(footer)),
+               sizeof(footer));
+        hasFooter =
+            memcmp(footer.magic, TRACE_FOOTER_MAGIC, sizeof(footer.magic)) == 0 &&
+            footer.indexOffset + footer.numBlocks * blockInfoSize +
+                sizeof(footer) == fileSize;
+    }
+    if (hasFooter){
+        index.resize(footer.numBlocks);
+        const char* entries = at(footer.indexOffset,
+                                 index.size() * blockInfoSize);
+        for(size_t i = 0; i < index.size(); i++){
+            memcpy(&index[i], entries + i * blockInfoSize, blockInfoSize);
+            if (blockInfoSize != sizeof(TraceBlockInfo)){
+                fillVersion1Block(&index[i]);
+            }
+        }
+    } else {
+        fprintf(stderr, "%s has no block index, it was not closed cleanly."
+                " Scanning blocks\n", fileName.c_str());
+        scanBlocks();
+    }
+}
+
+void TraceFileReader::readBlockHeader(uint64_t offset,
+                                      TraceBlockHeader* block) const {
+    memcpy(block, at(offset, blockHeaderSize), blockHeaderSize);
+    if (blockHeaderSize != sizeof(TraceBlockHeader)){
+        fillVersion1Block(block);
+    }
+}
+
+void TraceFileReader::scanBlocks(){
+    uint64_t offset = headerSize;
+    TraceBlockHeader block;
+    while (offset + blockHeaderSize <= fileSize){
+        readBlockHeader(offset, &block);
+        if (block.magic != TRACE_BLOCK_MAGIC ||
+            offset + blockHeaderSize + block.payloadBytes > fileSize){
+            break;
+        }
+        TraceBlockInfo info;
+        info.offset = offset;
+        info.recordCount = block.recordCount;
+        info.payloadBytes = block.payloadBytes;
+        info.minStartCycles = block.minStartCycles;
+        info.maxStartCycles = block.maxStartCycles;
+        info.minRequestId = block.minRequestId;
+        info.maxRequestId = block.maxRequestId;
+        info.maxEndCycles = block.maxEndCycles;
+        info.minServerId = block.minServerId;
+        info.maxServerId = block.maxServerId;
+        info.reserved = 0;
+        index.push_back(info);
+        offset += blockHeaderSize + block.payloadBytes;
+    }
+}
+
+void TraceFileReader::indexRawDump(){
+    //A trailing partial record is from a writer that died mid-write
+    uint64_t numRecords = fileSize / sizeof(IntervalRecord);
+    for(uint64_t first = 0; first < numRecords;
+        first += TRACE_FILE_BLOCK_RECORDS){
+        TraceBlockInfo info;
+        info.offset = first * sizeof(IntervalRecord);
+        info.recordCount = std::min<uint64_t>(TRACE_FILE_BLOCK_RECORDS,
+                                              numRecords - first);
+        info.payloadBytes = info.recordCount * sizeof(IntervalRecord);
+        info.minStartCycles = 0;
+        info.maxStartCycles = std::numeric_limits<uint64_t>::max();
+        info.minRequestId = 0;
+        info.maxRequestId = std::numeric_limits<uint64_t>::max();
+        fillVersion1Block(&info);
+        index.push_back(info);
+    }
+}
+
+RecordSpan TraceFileReader::getBlock(size_t i){
+    if (i >= index.size()){
+        fprintf(stderr, "%s has no block %zu\n", fileName.c_str(), i);
+        throw std::runtime_error("No such block");
+    }
+    const TraceBlockInfo& info = index[i];
+    RecordSpan span;
+    if (rawDump){
+        span.records = reinterpret_cast<const IntervalRecord*>(
+                at(info.offset, info.payloadBytes));
+        span.count = info.recordCount;
+        return span;
+    }
+
+    TraceBlockHeader block;
+    readBlockHeader(info.offset, &block);
+    if (block.magic != TRACE_BLOCK_MAGIC ||
+        block.payloadBytes != info.payloadBytes){
+        fprintf(stderr, "Bad block header at offset %lu of %s\n",
+                info.offset, fileName.c_str());
+        throw std::runtime_error("Corrupt trace file");
+    }
+    const char* payload = at(info.offset + blockHeaderSize, block.payloadBytes);
+    if (TraceFileUtils::checksum(payload, block.payloadBytes) !=
+        block.checksum){
+        fprintf(stderr, "Checksum mismatch in block %zu of %s\n", i,
+                fileName.c_str());
+        throw std::runtime_error("Corrupt trace file");
+    }
+
+    switch (block.encoding){
+        case TRACE_BLOCK_RAW:
+            if (header.recordSize != sizeof(IntervalRecord) ||
+                strncmp(header.schema, getRecordStateSchema(),
+                        sizeof(header.schema)) != 0){
+                fprintf(stderr, "%s was written with schema %.8s and %u byte"
+                        " records, we have schema %s and %zu byte records\n",
+                        fileName.c_str(), header.schema, header.recordSize,
+                        getRecordStateSchema(), sizeof(IntervalRecord));
+                throw std::runtime_error("Incompatible trace file");
+            }
+            if (block.payloadBytes != block.recordCount * sizeof(IntervalRecord)){
+                throw std::runtime_error("Corrupt trace file");
+            }
+            //Blocks follow compressed blocks of any length in files that mix
+            //encodings, only hand out the mapping if it is aligned
+            if (reinterpret_cast<uintptr_t>(payload) %
+                alignof(IntervalRecord) == 0){
+                span.records = reinterpret_cast<const IntervalRecord*>(payload);
+            } else {
+                decoded.resize(block.recordCount);
+                if (block.recordCount){
+                    memcpy(&decoded[0], payload, block.payloadBytes);
+                }
+                span.records = decoded.data();
+            }
+            span.count = block.recordCount;
+            return span;
+        case TRACE_BLOCK_COMPRESSED:
+            TraceCodec::decode(payload, block.payloadBytes, block.recordCount,
+                               &decoded);
+            span.records = decoded.data();
+            span.count = decoded.size();
+            return span;
+        default:
+            fprintf(stderr, "Unknown block encoding %u in %s\n",
+                    block.encoding, fileName.c_str());
+            throw std::runtime_error("Unsupported trace file encoding");
+    }
+}
+
+void TraceFileReader::readBlock(size_t i, std::vector<IntervalRecord>* out){
+    RecordSpan span = getBlock(i);
+    out->assign(span.begin(), span.end());
+}
+
+void TraceFileReader::findBlocks(uint64_t fromCycles, uint64_t toCycles,
+                                 uint16_t serverId,
+                                 std::vector<size_t>* blocks){
+    if (blocksByStart.size() != index.size()){
+        blocksByStart.resize(index.size());
+        for(size_t i = 0; i < index.size(); i++){
+            blocksByStart[i] = i;
+        }
+        std::stable_sort(blocksByStart.begin(), blocksByStart.end(),
+                [this](size_t a, size_t b){
+                    return index[a].minStartCycles < index[b].minStartCycles;
+                });
+        prefixMaxEndCycles.resize(index.size());
+        uint64_t prefixMax = 0;
+        for(size_t i = 0; i < blocksByStart.size(); i++){
+            prefixMax = std::max(prefixMax, index[blocksByStart[i]].maxEndCycles);
+            prefixMaxEndCycles[i] = prefixMax;
+        }
+    }
+
+    size_t first = blocks->size();
+    //First block that starts after the range, only blocks before it can
+    //overlap it
+    size_t upper = std::upper_bound(blocksByStart.begin(), blocksByStart.end(),
+            toCycles, [this](uint64_t cycles, size_t block){
+                return cycles < index[block].minStartCycles;
+            }) - blocksByStart.begin();
+    for(size_t i = upper; i > 0 && prefixMaxEndCycles[i - 1] >= fromCycles; i--){
+        const TraceBlockInfo& info = index[blocksByStart[i - 1]];
+        if (info.maxEndCycles >= fromCycles &&
+            (serverId == INVALID_SERVER_ID ||
+             (info.minServerId <= serverId && serverId <= info.maxServerId))){
+            blocks->push_back(blocksByStart[i - 1]);
+        }
+    }
+    std::sort(blocks->begin() + first, blocks->end());
+}
+
+uint64_t TraceFileUtils::toUnixNanoseconds(const TraceFileHeader& header,
+                                           uint64_t cycles,
+                                           double cyclesPerSec){
+    if (cycles >= header.anchorCycles){
+        return header.anchorUnixNanoseconds +
+            Cycles::toNanoseconds(cycles - header.anchorCycles, cyclesPerSec);
+    }
+    uint64_t before = Cycles::toNanoseconds(header.anchorCycles - cycles,
+                                            cyclesPerSec);
+    return before < header.anchorUnixNanoseconds ?
+        header.anchorUnixNanoseconds - before : 0;
+}
+
+uint64_t TraceFileUtils::toCycles(const TraceFileHeader& header,
+                                  uint64_t unixNanoseconds,
+                                  double cyclesPerSec){
+    if (unixNanoseconds >= header.anchorUnixNanoseconds){
+        return header.anchorCycles + Cycles::fromNanoseconds(
+                unixNanoseconds - header.anchorUnixNanoseconds, cyclesPerSec);
+    }
+    uint64_t before = Cycles::fromNanoseconds(
+            header.anchorUnixNanoseconds - unixNanoseconds, cyclesPerSec);
+    return before < header.anchorCycles ? header.anchorCycles - before : 0;
+}
+
+bool TraceFileUtils::isTraceFile(const std::string& fileName){
+    FILE* file = fopen(fileName.c_str(), "rb");
+    if (!file){
+        return false;
+    }
+    char magic[sizeof(TRACE_FILE_MAGIC)];
+    bool isTrace = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+        memcmp(magic, TRACE_FILE_MAGIC, sizeof(magic)) == 0;
+    fclose(file);
+    return isTrace;
+}
+
+void TraceFileUtils::readRecords(const std::string& fileName,
+                                 const RecordCallback& onRecords){
+    TraceFileReader reader;
+    reader.open(fileName);
+    for(size_t i = 0; i < reader.getNumBlocks(); i++){
+        RecordSpan records = reader.getBlock(i);
+        if (!records.empty()){
+            onRecords(records.records, records.count);
+        }
+    }
+}
+
+void TraceFileUtils::readTimeRange(const std::string& fileName,
+                                   uint64_t fromUnixNanoseconds,
+                                   uint64_t toUnixNanoseconds,
+                                   uint16_t serverId,
+                                   const RecordCallback& onRecords){
+    TraceFileReader reader;
+    reader.open(fileName);
+    const TraceFileHeader& header = reader.getHeader();
+    if (header.anchorUnixNanoseconds == 0 || header.cyclesPerSec <= 0){
+        fprintf(stderr, "%s has no wallclock anchor\n", fileName.c_str());
+        throw std::runtime_error("Trace file has no wallclock anchor");
+    }
+    uint64_t fromCycles = toCycles(header, fromUnixNanoseconds,
+                                   header.cyclesPerSec);
+    uint64_t toCyclesInclusive = toCycles(header, toUnixNanoseconds,
+                                          header.cyclesPerSec);
+    std::vector<size_t> blocks;
+    reader.findBlocks(fromCycles, toCyclesInclusive, serverId, &blocks);
+
+    std::vector<IntervalRecord> matches;
+    for(size_t i = 0; i < blocks.size(); i++){
+        RecordSpan records = reader.getBlock(blocks[i]);
+        matches.clear();
+        for(auto& record : records){
+            if (record.getStartCycles() <= toCyclesInclusive &&
+                record.getEndCycles() >= fromCycles &&
+                (serverId == INVALID_SERVER_ID ||
+                 record.getServerID() == serverId)){
+                matches.push_back(record);
+            }
+        }
+        if (!matches.empty()){
+            onRecords(matches.data(), matches.size());
+        }
+    }
+}
+
+} //namespace DDTrace
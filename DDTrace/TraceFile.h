@@ -0,0 +1,409 @@
+#ifndef PERFGRAPH_TRACEFILE_H
+#define PERFGRAPH_TRACEFILE_H
+
+#include <cstdio>
+#include <functional>
+
+#include "DDTrace.h"
+
+namespace DDTrace {
+
+/**
+  * Version of the .ddt container written by TraceFileWriter. Bump whenever
+  * a change to the structs below makes old files unreadable.
+  *
+  * Version 2 added the wallclock anchor to TraceFileHeader and the end time
+  * and serverId range of each block. TraceFileReader still reads version 1
+  * files, which have no anchor and whose blocks claim every end time and
+  * serverId.
+  */
+const uint32_t TRACE_FILE_VERSION = 2;
+
+/**
+  * Number of records in every block of a .ddt file except the last one.
+  * Readers that skip blocks skip this many records at a time.
+  */
+const uint32_t TRACE_FILE_BLOCK_RECORDS = 4096;
+
+/**
+  * The layout of a .ddt file is
+  *
+  *     TraceFileHeader
+  *     TraceBlockHeader, payload    (repeated)
+  *     TraceBlockInfo               (one per block, the block index)
+  *     TraceFileFooter
+  *
+  * All integers are little endian. A file whose writer died before writing
+  * the index is still readable, by walking the block headers.
+  */
+struct TraceFileHeader {
+    /**
+      * TRACE_FILE_MAGIC
+      */
+    char magic[8];
+    uint32_t version;
+    /**
+      * sizeof(IntervalRecord) of the writer, and its RecordState schema.
+      * Blocks stored raw can only be read by a build that agrees on both.
+      */
+    uint32_t recordSize;
+    char schema[8];
+    /**
+      * serverId, CounterType and cycles per second of the first record in
+      * the file. Every record also carries its own.
+      */
+    uint16_t serverId;
+    uint16_t counterType;
+    uint32_t blockRecords;
+    double cyclesPerSec;
+    /**
+      * The rdtsc and CLOCK_REALTIME of the writer at the same moment, taken
+      * when the header was written. Every channel on a host shares the TSC,
+      * so this converts the cycles of any record in the file to wallclock
+      * time. anchorUnixNanoseconds is 0 if the file has no anchor.
+      */
+    uint64_t anchorCycles;
+    uint64_t anchorUnixNanoseconds;
+};
+
+enum TraceBlockEncoding {
+    /**
+      * The payload is recordCount IntervalRecords, as laid out in memory
+      */
+    TRACE_BLOCK_RAW = 0,
+    /**
+      * The payload is the TraceCodec encoding of recordCount records
+      */
+    TRACE_BLOCK_COMPRESSED = 1,
+};
+
+/**
+  * Precedes the payload of every block
+  */
+struct TraceBlockHeader {
+    /**
+      * TRACE_BLOCK_MAGIC
+      */
+    uint32_t magic;
+    uint32_t encoding;
+    uint32_t recordCount;
+    uint32_t payloadBytes;
+    uint64_t minStartCycles;
+    uint64_t maxStartCycles;
+    uint64_t minRequestId;
+    uint64_t maxRequestId;
+    /**
+      * TraceFileUtils::checksum of the payload
+      */
+    uint64_t checksum;
+    uint64_t maxEndCycles;
+    uint16_t minServerId;
+    uint16_t maxServerId;
+    uint32_t reserved;
+};
+
+/**
+  * An entry in the block index: where a block is, and enough of its header
+  * to decide whether to read it
+  */
+struct TraceBlockInfo {
+    /**
+      * Offset of the block's TraceBlockHeader from the start of the file
+      */
+    uint64_t offset;
+    uint32_t recordCount;
+    uint32_t payloadBytes;
+    uint64_t minStartCycles;
+    uint64_t maxStartCycles;
+    uint64_t minRequestId;
+    uint64_t maxRequestId;
+    uint64_t maxEndCycles;
+    uint16_t minServerId;
+    uint16_t maxServerId;
+    uint32_t reserved;
+};
+
+/**
+  * Last thing in a complete file
+  */
+struct TraceFileFooter {
+    uint64_t indexOffset;
+    uint64_t numBlocks;
+    /**
+      * TRACE_FOOTER_MAGIC
+      */
+    char magic[8];
+};
+
+static_assert(sizeof(TraceFileHeader) == 56, "TraceFileHeader layout changed");
+static_assert(sizeof(TraceBlockHeader) == 72, "TraceBlockHeader layout changed");
+static_assert(sizeof(TraceBlockInfo) == 64, "TraceBlockInfo layout changed");
+static_assert(sizeof(TraceFileFooter) == 24, "TraceFileFooter layout changed");
+
+/**
+ * Writes IntervalRecords to a .ddt file, one TRACE_FILE_BLOCK_RECORDS block
+ * at a time.
+ * Throws a std::runtime_error if the file cannot be written.
+ */
+class TraceFileWriter {
+  public:
+    typedef std::function<void(size_t block, const TraceBlockInfo& info,
+                               const IntervalRecord* records,
+                               size_t count)> BlockCallback;
+
+    TraceFileWriter();
+    /**
+      * Closes the file if it is still open, printing any error instead of
+      * throwing it. Call close first to handle errors.
+      */
+    ~TraceFileWriter();
+
+    /**
+      * Starts a new file whose blocks will be stored with encoding
+      */
+    void open(const std::string& fileName,
+              TraceBlockEncoding encoding = TRACE_BLOCK_COMPRESSED);
+
+    void append(const IntervalRecord* records, size_t count);
+
+    /**
+      * Writes any partial block, the block index and the footer.
+      * Throws a std::runtime_error if they cannot be written.
+      */
+    void close();
+
+    bool isOpen() const {
+        return file != NULL;
+    }
+
+    /**
+      * Has onBlock called with every block as it is written, to build
+      * indexes of the file alongside it. Stays set across open and close.
+      */
+    void setBlockCallback(const BlockCallback& onBlock){
+        this->onBlock = onBlock;
+    }
+
+    /**
+      * Returns the size of the file so far, counting records not yet
+      * written out in a block at their uncompressed size
+      */
+    uint64_t getBytesWritten() const {
+        return bytesWritten + pending.size() * sizeof(IntervalRecord);
+    }
+
+  private:
+    void write(const void* data, size_t size);
+    void writeHeader(const IntervalRecord* first);
+    void writeBlock();
+
+    FILE* file;
+    TraceBlockEncoding encoding;
+    bool wroteHeader;
+    uint64_t bytesWritten;
+    /**
+      * Records of the block being filled
+      */
+    std::vector<IntervalRecord> pending;
+    std::vector<TraceBlockInfo> index;
+    /**
+      * Encoded payload of the block being written
+      */
+    std::vector<char> payload;
+    BlockCallback onBlock;
+};
+
+/**
+  * A run of records, contiguous in memory. Spans handed out by
+  * TraceFileReader point into the reader and are only valid as long as it
+  * says.
+  */
+struct RecordSpan {
+    const IntervalRecord* records;
+    size_t count;
+
+    const IntervalRecord* begin() const {
+        return records;
+    }
+
+    const IntervalRecord* end() const {
+        return records + count;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    const IntervalRecord& operator[](size_t i) const {
+        return records[i];
+    }
+};
+
+/**
+ * Reads a .ddt file written by TraceFileWriter, or a raw dump of
+ * IntervalRecords from before the container existed.
+ *
+ * The file is mmapped rather than read, with the kernel told to read ahead,
+ * and raw blocks are handed out as spans pointing into the mapping, so
+ * nothing is copied until the caller copies it. Compressed blocks are
+ * decoded into a buffer owned by the reader.
+ *
+ * Throws a std::runtime_error if the file is corrupt or was written by an
+ * incompatible build.
+ */
+class TraceFileReader {
+  public:
+    TraceFileReader();
+    ~TraceFileReader();
+
+    void open(const std::string& fileName);
+    /**
+      * Unmaps the file. Spans returned by getBlock are invalid afterwards.
+      */
+    void close();
+
+    /**
+      * True if the file is a raw dump rather than a .ddt container. A raw
+      * dump has a zeroed header, and its blocks are runs of
+      * TRACE_FILE_BLOCK_RECORDS records whose index entries cover every
+      * start time and request id.
+      */
+    bool isRawDump() const {
+        return rawDump;
+    }
+
+    const TraceFileHeader& getHeader() const {
+        return header;
+    }
+
+    size_t getNumBlocks() const {
+        return index.size();
+    }
+
+    /**
+      * Returns the index entry of block i, to decide whether to read it
+      */
+    const TraceBlockInfo& getBlockInfo(size_t i) const {
+        return index[i];
+    }
+
+    /**
+      * Returns the records of block i, after checking the block's checksum.
+      * The span is valid until the next call to getBlock or close.
+      */
+    RecordSpan getBlock(size_t i);
+
+    /**
+      * Replaces the contents of out with the records of block i
+      */
+    void readBlock(size_t i, std::vector<IntervalRecord>* out);
+
+    /**
+      * Appends to blocks, in increasing order, the blocks that may hold
+      * intervals overlapping [fromCycles, toCycles] on serverId (any server
+      * if serverId is INVALID_SERVER_ID). Binary searches the blocks sorted
+      * by start time, which are sorted the first time this is called.
+      */
+    void findBlocks(uint64_t fromCycles, uint64_t toCycles, uint16_t serverId,
+                    std::vector<size_t>* blocks);
+
+  private:
+    /**
+      * Rebuilds the index by walking the block headers, for files whose
+      * writer never got to write one. Stops at the first incomplete block.
+      */
+    void scanBlocks();
+
+    /**
+      * Splits a raw dump into blocks
+      */
+    void indexRawDump();
+
+    /**
+      * Reads the block header at offset, filling in what a version 1 header
+      * lacks
+      */
+    void readBlockHeader(uint64_t offset, TraceBlockHeader* block) const;
+
+    /**
+      * Returns a pointer to size bytes at offset, throwing if the file is
+      * too short
+      */
+    const char* at(uint64_t offset, size_t size) const;
+
+    std::string fileName;
+    const char* mapping;
+    uint64_t fileSize;
+    bool rawDump;
+    TraceFileHeader header;
+    /**
+      * Size of the file's TraceFileHeader and TraceBlockHeaders, which
+      * depend on its version
+      */
+    size_t headerSize;
+    size_t blockHeaderSize;
+    std::vector<TraceBlockInfo> index;
+    /**
+      * Blocks by minStartCycles, and the largest maxEndCycles of each block
+      * and those before it in that order. Filled by findBlocks.
+      */
+    std::vector<size_t> blocksByStart;
+    std::vector<uint64_t> prefixMaxEndCycles;
+    /**
+      * Records of the last compressed block returned by getBlock
+      */
+    std::vector<IntervalRecord> decoded;
+};
+
+class TraceFileUtils {
+  public:
+    typedef std::function<void(const IntervalRecord* records,
+                               size_t count)> RecordCallback;
+
+    /**
+      * Returns true iff fileName starts with a TraceFileHeader, as opposed
+      * to being a raw dump of IntervalRecords from before the container
+      * existed
+      */
+    static bool isTraceFile(const std::string& fileName);
+
+    /**
+      * Calls onRecords with every record in fileName, one block at a time,
+      * whether it is a .ddt container or a raw dump. The records are only
+      * valid during the call.
+      */
+    static void readRecords(const std::string& fileName,
+                            const RecordCallback& onRecords);
+
+    /**
+      * Calls onRecords with the intervals of fileName that overlap
+      * [fromUnixNanoseconds, toUnixNanoseconds] on serverId (any server if
+      * INVALID_SERVER_ID), reading only the blocks that may hold some.
+      * Throws a std::runtime_error if the file has no wallclock anchor.
+      */
+    static void readTimeRange(const std::string& fileName,
+                              uint64_t fromUnixNanoseconds,
+                              uint64_t toUnixNanoseconds, uint16_t serverId,
+                              const RecordCallback& onRecords);
+
+    /**
+      * Converts between the cycles of a record with cyclesPerSec and
+      * wallclock time, using the anchor in header
+      */
+    static uint64_t toUnixNanoseconds(const TraceFileHeader& header,
+                                      uint64_t cycles, double cyclesPerSec);
+    static uint64_t toCycles(const TraceFileHeader& header,
+                             uint64_t unixNanoseconds, double cyclesPerSec);
+
+    /**
+      * 64-bit FNV-1a, taken a word at a time
+      */
+    static uint64_t checksum(const void* data, size_t size);
+};
+
+} // End DDTrace
+#endif
@@ -25,6 +25,9 @@
 #include <linux/perf_event.h>
 #include <sys/ioctl.h>
 #include <asm/unistd.h>
+#include <poll.h>
+#include <linux/futex.h>
+#include <errno.h>
 #include <cstdio>
 #include <cstdlib>
 
@@ -105,59 +108,91 @@ gettid()
 }
 
 /**
-  * Returns the number of processes referencing the file named by
-  * fileName. Relies on the fuser and the wc commands.
+  * Returns a pidfd referring to process pid, or -1 if the kernel does not
+  * support pidfds (Linux < 5.3) or the process does not exist.
   *
-  * WARNING: fileName is injected into a shell command, so code injection is
-  * possible. The argument to this method should not be produced by data
-  * taken from an untrusted user.
+  * Unlike the pid itself, the pidfd keeps referring to the same process
+  * after it exits, so it is safe against pid reuse.
+  */
+static
+int pidfdOpen(pid_t pid) __attribute__ ((unused));
+
+static
+int pidfdOpen(pid_t pid){
+#ifdef __NR_pidfd_open
+    return static_cast<int>(syscall(__NR_pidfd_open, pid, 0));
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+  * Returns true iff the process referred to by pidfd has exited.
+  * Does not block.
+  */
+static
+bool pidfdExited(int pidfd) __attribute__ ((unused));
+
+static
+bool pidfdExited(int pidfd){
+    //A pidfd becomes readable when the process exits
+    struct pollfd pfd;
+    pfd.fd = pidfd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int rc = poll(&pfd, 1, 0);
+    return rc > 0;
+}
+
+/**
+  * Returns true iff thread tid of process pid is still running (or we cannot
+  * tell, because it belongs to another user).
   *
-  * BUGGY. This seems to be flakey and is not always reporting all
-  * processes referencing a file. Oh well, doesn't seem to be a problem
-  * (yet..)
-  */ 
-static 
-int getNumFileReferences(const std::string& fileName) 
-    __attribute__ ((unused));
+  * If pid has exited and its pid been reused, this will be fooled. Use a
+  * pidfd from pidfdOpen to check the process where that matters.
+  */
+static
+bool isThreadAlive(pid_t pid, pid_t tid) __attribute__ ((unused));
 
 static
-int getNumFileReferences(const std::string& fileName){
-    const int commandMaxLength = 1000;
-    char command[commandMaxLength];
-    const int dataLength = 32;
-    char data[dataLength];
-    int rc;
-    int numFileReferences;
-    char* fgetRet;
-    snprintf(command, 
-             commandMaxLength,
-             "fuser %s 2>/dev/null | wc -w",
-             fileName.c_str());
-    FILE * pf = popen(command, "r");
-    assert(pf);
-    if (!pf){
-        assert(false);
-        goto err;
+bool isThreadAlive(pid_t pid, pid_t tid){
+    //Signal 0 does error checking only, nothing is delivered
+    int rc = static_cast<int>(syscall(__NR_tgkill, pid, tid, 0));
+    if (rc == 0){
+        return true;
     }
-    fgetRet = fgets(data, dataLength, pf);
-    if (!fgetRet){
-        assert(false);
-        goto err;
-    }
-    rc = pclose(pf);
-    //TODO(bjmnbraun@gmail.com) figure out the error codes of pclose
-    assert(rc == 0);
-    if (!(rc == 0)){
-        goto err;
-    }
-    numFileReferences = atoi(data);
-    return numFileReferences;
-err:
-    fprintf(stderr, "Could not run fuser command on file handle %s\n",
-    fileName.c_str());
-    throw std::runtime_error("Could not get num open file handles");
+    return errno != ESRCH;
+}
+
+/**
+  * Sleeps until *word is woken by futexWake, if *word still equals expected
+  * when we go to sleep. Gives up after timeoutMicros microseconds, or when a
+  * signal arrives. word may live in memory shared between processes.
+  */
+static
+void futexWait(uint32_t* word, uint32_t expected, uint64_t timeoutMicros)
+    __attribute__ ((unused));
+
+static
+void futexWait(uint32_t* word, uint32_t expected, uint64_t timeoutMicros){
+    struct timespec timeout;
+    timeout.tv_sec = timeoutMicros / 1000000;
+    timeout.tv_nsec = (timeoutMicros % 1000000) * 1000;
+    //EAGAIN (word changed), ETIMEDOUT and EINTR all just mean "go look"
+    syscall(__NR_futex, word, FUTEX_WAIT, expected, &timeout, NULL, 0);
 }
 
+/**
+  * Wakes one thread, in any process, sleeping in futexWait on word
+  */
+static
+void futexWake(uint32_t* word) __attribute__ ((unused));
+
+static
+void futexWake(uint32_t* word){
+    syscall(__NR_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
 
 /**
  * This function pins the currently executing thread onto the CPU Core with
@@ -0,0 +1,105 @@
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+
+#include <algorithm>
+
+#include "VectorClock.h"
+
+namespace DDTrace {
+
+static_assert(sizeof(VectorClock::Entry) == 3 && MAX_VECTORCLOCK_ENTRIES == 8,
+              "compare unpacks 8 entries of 3 bytes");
+
+#ifdef __SSE4_1__
+/**
+  * Unpacks MAX_VECTORCLOCK_ENTRIES entries into their servers and their
+  * counts, one per 16 bit lane, zeroing the counts at or past length
+  */
+static inline void unpackEntries(const VectorClock::Entry* entries,
+                                 uint64_t length, __m128i* servers,
+                                 __m128i* counts){
+    //Entry i is bytes 3i and 3i + 1 (server) and 3i + 2 (count). Entries 0
+    //to 4 are in the first 16 bytes, and 5 to 7 in the 16 from byte 8.
+    const char* bytes = reinterpret_cast<const char*>(entries);
+    __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes));
+    __m128i high = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(bytes + 8));
+    *servers = _mm_or_si128(
+        _mm_shuffle_epi8(low, _mm_setr_epi8(0, 1, 3, 4, 6, 7, 9, 10, 12, 13,
+                                            -1, -1, -1, -1, -1, -1)),
+        _mm_shuffle_epi8(high, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+                                             -1, -1, 7, 8, 10, 11, 13, 14)));
+    __m128i allCounts = _mm_or_si128(
+        _mm_shuffle_epi8(low, _mm_setr_epi8(2, -1, 5, -1, 8, -1, 11, -1, 14,
+                                            -1, -1, -1, -1, -1, -1, -1)),
+        _mm_shuffle_epi8(high, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+                                             -1, -1, 9, -1, 12, -1, 15, -1)));
+    __m128i used = _mm_cmpgt_epi16(_mm_set1_epi16(static_cast<short>(length)),
+                                   _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7));
+    *counts = _mm_and_si128(allCounts, used);
+}
+#endif
+
+static inline VectorClock::Order makeOrder(bool lessOrEqual,
+                                           bool greaterOrEqual){
+    return static_cast<VectorClock::Order>(lessOrEqual | greaterOrEqual << 1);
+}
+
+VectorClock::Order VectorClock::compare(const Entry* a, uint64_t aLength,
+                                        const Entry* b, uint64_t bLength){
+    aLength = std::min<uint64_t>(aLength, MAX_VECTORCLOCK_ENTRIES);
+    bLength = std::min<uint64_t>(bLength, MAX_VECTORCLOCK_ENTRIES);
+#ifdef __SSE4_1__
+    __m128i aServers, aCounts, bServers, bCounts;
+    unpackEntries(a, aLength, &aServers, &aCounts);
+    unpackEntries(b, bLength, &bServers, &bCounts);
+    //Rotating b one lane at a time lines every entry of b up with every
+    //entry of a once. Matching servers leave b's count for each lane of a
+    //in matchedB, and a's count for each lane of b in matchedA, which
+    //rotates along with b and is back in place after the last rotation.
+    //Unused entries have a count of 0, so whatever server they hold never
+    //raises a count.
+    __m128i matchedB = _mm_setzero_si128();
+    __m128i matchedA = _mm_setzero_si128();
+    for(size_t i = 0; i < MAX_VECTORCLOCK_ENTRIES; i++){
+        __m128i same = _mm_cmpeq_epi16(aServers, bServers);
+        matchedB = _mm_max_epu16(matchedB, _mm_and_si128(same, bCounts));
+        matchedA = _mm_max_epu16(matchedA, _mm_and_si128(same, aCounts));
+        bServers = _mm_alignr_epi8(bServers, bServers, 2);
+        bCounts = _mm_alignr_epi8(bCounts, bCounts, 2);
+        matchedA = _mm_alignr_epi8(matchedA, matchedA, 2);
+    }
+    return makeOrder(
+        _mm_movemask_epi8(_mm_cmpgt_epi16(aCounts, matchedB)) == 0,
+        _mm_movemask_epi8(_mm_cmpgt_epi16(bCounts, matchedA)) == 0);
+#else
+    bool lessOrEqual = true;
+    bool greaterOrEqual = true;
+    for(uint64_t i = 0; i < aLength; i++){
+        for(uint64_t j = 0; j < bLength; j++){
+            if (b[j].serverId != a[i].serverId) continue;
+            lessOrEqual &= a[i].count <= b[j].count;
+            greaterOrEqual &= b[j].count <= a[i].count;
+        }
+    }
+    //Entries of one clock the other has no server for
+    for(uint64_t i = 0; i < aLength; i++){
+        bool found = false;
+        for(uint64_t j = 0; j < bLength; j++){
+            found |= b[j].serverId == a[i].serverId;
+        }
+        lessOrEqual &= found || !a[i].count;
+    }
+    for(uint64_t j = 0; j < bLength; j++){
+        bool found = false;
+        for(uint64_t i = 0; i < aLength; i++){
+            found |= a[i].serverId == b[j].serverId;
+        }
+        greaterOrEqual &= found || !b[j].count;
+    }
+    return makeOrder(lessOrEqual, greaterOrEqual);
+#endif
+}
+
+} // End DDTrace
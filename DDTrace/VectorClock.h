@@ -14,6 +14,13 @@ namespace DDTrace {
   */
 const size_t MAX_VECTORCLOCK_ENTRIES = 8;
 
+/**
+  * Most bytes VectorClock::serialize writes: the length byte, the id, and
+  * MAX_VECTORCLOCK_ENTRIES entries
+  */
+const size_t MAX_SERIALIZED_VECTORCLOCK_SIZE = 1 + sizeof(uint64_t) +
+    MAX_VECTORCLOCK_ENTRIES * (sizeof(uint16_t) + sizeof(uint8_t));
+
 /**
  * This class tracks the server which has touched a particular Rpc, and the
  * count of the number of touches.
@@ -96,6 +103,103 @@ struct VectorClock {
         }
         return true;
     }
+
+    /**
+      * Bytes serialize will write for this clock
+      */
+    size_t getSerializedSize() const {
+        return 1 + sizeof(id) + length * sizeof(Entry);
+    }
+
+    /**
+      * Writes this clock to out, which must have room for
+      * MAX_SERIALIZED_VECTORCLOCK_SIZE bytes, for an Rpc header, and
+      * returns the bytes written. Only the used entries are written:
+      *
+      *     length (1 byte)
+      *     id (8 bytes)
+      *     per entry: serverId (2 bytes), count (1 byte)
+      *
+      * The id and serverIds are in host byte order, as in the struct.
+      */
+    size_t serialize(char* out) const {
+        out[0] = static_cast<char>(length);
+        memcpy(out + 1, &id, sizeof(id));
+        memcpy(out + 1 + sizeof(id), entries, length * sizeof(Entry));
+        return getSerializedSize();
+    }
+
+    /**
+      * Replaces this clock with the one serialized at the start of the size
+      * bytes of data, and returns the bytes it took. Returns 0, leaving the
+      * clock as it was, if data is truncated or is not a clock serialized by
+      * serialize, eg has more than MAX_VECTORCLOCK_ENTRIES entries.
+      */
+    size_t deserialize(const char* data, size_t size) {
+        if (size < 1 + sizeof(id)) return 0;
+        uint8_t newLength = static_cast<uint8_t>(data[0]);
+        size_t used = 1 + sizeof(id) + newLength * sizeof(Entry);
+        if (newLength > MAX_VECTORCLOCK_ENTRIES || size < used) return 0;
+        memcpy(&id, data + 1, sizeof(id));
+        // Fixed size copies: variable length memcpy and memset calls cost
+        // several times what copying the entries does
+        const char* cursor = data + 1 + sizeof(id);
+        for (uint8_t i = 0; i < MAX_VECTORCLOCK_ENTRIES; i++) {
+            if (i < newLength) {
+                memcpy(&entries[i], cursor + i * sizeof(Entry), sizeof(Entry));
+            } else {
+                entries[i] = Entry();
+            }
+        }
+        length = newLength;
+        return used;
+    }
+
+    /**
+      * How two clocks are ordered: whether one happened before the other,
+      * they have the same counts, or neither. The first bit is set iff the
+      * first clock is less or equal to the second, the second bit iff it is
+      * greater or equal.
+      */
+    enum Order {
+        CONCURRENT = 0,
+        BEFORE = 1,
+        AFTER = 2,
+        EQUAL = 3
+    };
+
+    /**
+      * Orders this clock against other. An entry of one clock is compared
+      * to the other's entry for the same server, a server missing from a
+      * clock counting as 0, so entries may be in any order in either clock.
+      */
+    Order compare(const VectorClock& other) const {
+        return compare(entries, length, other.entries, other.length);
+    }
+
+    /**
+      * Returns true iff no entry of this clock is ahead of other's
+      */
+    bool lessOrEqual(const VectorClock& other) const {
+        return compare(other) & BEFORE;
+    }
+
+    /**
+      * Returns true iff this clock happened before other: it is less or
+      * equal, and some entry is behind
+      */
+    bool happenedBefore(const VectorClock& other) const {
+        return compare(other) == BEFORE;
+    }
+
+    /**
+      * compare on the first aLength and bLength entries of two arrays of
+      * MAX_VECTORCLOCK_ENTRIES entries. Lengths past MAX_VECTORCLOCK_ENTRIES
+      * are clamped. With SSE4.1 the servers and counts of all entries are
+      * compared at once, without branches.
+      */
+    static Order compare(const Entry* a, uint64_t aLength,
+                         const Entry* b, uint64_t bLength);
 } __attribute__((packed));
 } // End DDTrace
 #endif
@@ -1,6 +1,8 @@
 #include <string>
 
 #include <DDTrace.h>
+#include <DDTrace/ClockOffsets.h>
+#include <DDTrace/RequestGraph.h>
 //#include <VectorClock.h>
 
 #include "DDTraceGraph.h"
@@ -133,29 +135,16 @@ class IntervalGraphRow {
     IntervalGraphRow(int whichRow) :
     whichRow(whichRow),
     offsetNs(0),
+    numDrawn(0),
     lastSeenIntervalStart(0)
     {
     }
 
-    /*
-    void adjustMinimumOffset(uint64_t ns){
-        if (!hasMinimumOffset){
-            offsetNs = ns;
-            hasMinimumOffset = true;
-        }
-        lastSeenIntervalStart = ns;
-    }
-    */
-
-    uint64_t offsetInRow(uint64_t ns){
+    int64_t offsetInRow(int64_t ns){
         return ns - offsetNs;
     }
 
-    uint64_t getElapsedNS(){
-        return lastSeenIntervalStart - offsetNs;
-    }
-
-    float getX(uint64_t ns){
+    float getX(int64_t ns){
         return offx + offsetInRow(ns) * pixPerNanosecond;
     }
     float getY(){
@@ -163,56 +152,64 @@ class IntervalGraphRow {
     }
 
     int whichRow;
-    uint64_t offsetNs;
+    /**
+      * Time at the left edge of the graph, on the reference server's clock
+      */
+    int64_t offsetNs;
     int numDrawn;
-    //bool hasMinimumOffset;
 
-    uint64_t lastSeenIntervalStart;
+    /**
+      * Start of the last interval drawn in this row, on the reference
+      * server's clock
+      */
+    int64_t lastSeenIntervalStart;
 };
 
 class IntervalGraphState {
   public:
     ofTrueTypeFont* font;
-    IntervalGraphState(ofTrueTypeFont* font):
-    font(font)
+    IntervalGraphState(ofTrueTypeFont* font,
+                       const DDTrace::ClockOffsets* offsets):
+    font(font),
+    offsets(offsets),
+    originNs(0),
+    hasOrigin(false)
     {
     }
 
-    //.4 microseconds
-    const uint16_t NETWORK_SEND_TIME_NS = 400;
-
     void drawInterval(const DDTrace::IntervalRecord& record,
         const DDTrace::IntervalRecord* predecessor){
         IntervalGraphRow* row = getRow(record.getServerID());  
-        
+        //Every row is drawn against the reference server's clock, so
+        //intervals on different servers line up without guessing at how long
+        //the network took.
+        int64_t startNs = offsets->toReferenceNanoseconds(
+            record.getServerID(), record.getStartNanoseconds());
+        int64_t endNs = offsets->toReferenceNanoseconds(
+            record.getServerID(), record.getEndNanoseconds());
 
         //First record should be the one on the farthest left.
-        //row->adjustMinimumOffset(record.getStartNanoseconds());
+        if (!hasOrigin){
+            originNs = startNs;
+            hasOrigin = true;
+        }
+        row->offsetNs = originNs;
         if (predecessor){
-            if (predecessor->getServerID() == record.getServerID()){
-                //Already set offset.
-            } else {
-                //Compute offset based on predecessor row's lastSeen
-                uint16_t preId = predecessor->getServerID();
-                IntervalGraphRow* preRow = getRow(preId);
-                row->offsetNs = record.getStartNanoseconds() - 
-                    (preRow->getElapsedNS() +
-                    NETWORK_SEND_TIME_NS);
-
+            if (predecessor->getServerID() != record.getServerID()){
                 //Draw the link
+                IntervalGraphRow* preRow = getRow(predecessor->getServerID());
                 ofSetColor(128);
                 ofLine(preRow->getX(preRow->lastSeenIntervalStart),
                        preRow->getY() - 1,
-                       row->getX(record.getStartNanoseconds()),
+                       row->getX(startNs),
                        row->getY() + rowThickness + 1);
             }
         } else {
             row->numDrawn = 0;
-            row->offsetNs = record.getStartNanoseconds();
         }
-        row->lastSeenIntervalStart = record.getStartNanoseconds();
-        float sx = row->getX(record.getStartNanoseconds());
-        float ex = row->getX(record.getEndNanoseconds());
+        row->lastSeenIntervalStart = startNs;
+        float sx = row->getX(startNs);
+        float ex = row->getX(endNs);
         float y = row->getY();
 
 
@@ -262,6 +259,9 @@ class IntervalGraphState {
     }
 
     std::unordered_map<uint64_t, std::unique_ptr<IntervalGraphRow>> rows;
+    const DDTrace::ClockOffsets* offsets;
+    int64_t originNs;
+    bool hasOrigin;
 };
 
 //--------------------------------------------------------------
@@ -287,6 +287,16 @@ void DDTraceGraph::draw(){
             readEvents(argv[i], &eventMap);
         }
 
+        // Line up the servers' clocks using every request we read, not just
+        // the one we draw
+        DDTrace::ClockOffsetEstimator estimator;
+        for (auto kv = eventMap.begin(); kv != eventMap.end(); kv++) {
+            estimator.addRequest(kv->second);
+        }
+        DDTrace::ClockOffsets offsets;
+        estimator.solve(&offsets);
+        offsets.print(stdout);
+
         ofVec2f origin(offx,offy);
         Axis myHorAxis(
         "Real Time (microseconds)",
@@ -329,30 +339,17 @@ void DDTraceGraph::draw(){
             }
             #endif
 
-            IntervalGraphState currentGraph(&font);
-
-            PartialOrderGraph dag;
-            dag.resize(V);
-            for(int i = 0; i < V; i++){
-                dag[i].resize(V);
-                for(int j = 0; j < V; j++){
-                    dag[i][j] = vectorClockLessThan(v[i], v[j]);
-                }
-            }
+            IntervalGraphState currentGraph(&font, &offsets);
 
-            // Copy the dag to an intermediate and compute transitive reduction
-            //(I.e. remove edges i,j if there is a path from i to j through at least
-            //one other node k
-            Adjacencies adj;
-            makeClosestAdjacencies(&dag, &adj);
+            // The transitive reduction of the partial order: an edge i,j iff
+            // i happened before j and nothing happened in between
+            DDTrace::RequestGraph graph;
+            graph.build(&v[0], V);
 
-            std::vector<std::vector<int>> incomingEdges;
             std::vector<int> numIncomingEdges;
             numIncomingEdges.resize(V);
-            incomingEdges.resize(V);
             for(int i = 0; i < V; i++){
-                getIncomingEdges(&adj, i, &incomingEdges[i]);
-                numIncomingEdges[i] = incomingEdges[i].size();
+                numIncomingEdges[i] = graph.getNumPredecessors(i);
             }
 
             std::stack<int> printOrdering;
@@ -368,12 +365,12 @@ void DDTraceGraph::draw(){
                 printOrdering.pop();
 
                 DDTrace::IntervalRecord* predecessor = NULL;
-                switch (incomingEdges[thisNode].size()){
+                switch (graph.getNumPredecessors(thisNode)){
                 case 0:
                 //K.
                     break; 
                 case 1:
-                    predecessor = &v[incomingEdges[thisNode][0]];
+                    predecessor = &v[graph.getPredecessors(thisNode)[0]];
                     break;
                 default:
                     assert(false);
@@ -384,28 +381,28 @@ void DDTraceGraph::draw(){
                 printf("(%c: %p %d ->", hashID(thisNode), &v[thisNode],
                 predecessor != NULL);
                 std::vector<int> forkNexts;
-                for(int i = 0; i < V; i++){
-                    if (adj[thisNode][i]){
-                        printf("%c, ", hashID(i));
-                        assert(numIncomingEdges[i] > 0);
-                        int otherIncomingEdges = numIncomingEdges[i] - 1;
-                        //Decrement numIncomingEdges[i]
-                        numIncomingEdges[i] = otherIncomingEdges;
-                        if (otherIncomingEdges == 0){
-                            //If the next node is on a different server, do it
-                            //before we do the nodes on this server
-                            //Because printOrdering is a stack, this
-                            //means we defer the push of nodes on a
-                            //different server until after we
-                            //push the nodes from the same node.
-                            if (v[i].getServerID() == v[thisNode].getServerID()){
-                                printf("Nonfork\n");
-                                //Print the node next
-                                printOrdering.push(i);
-                            } else {
-                                printf("Fork\n");
-                                forkNexts.push_back(i);
-                            }
+                const uint32_t* successors = graph.getSuccessors(thisNode);
+                for(size_t s = 0; s < graph.getNumSuccessors(thisNode); s++){
+                    int i = successors[s];
+                    printf("%c, ", hashID(i));
+                    assert(numIncomingEdges[i] > 0);
+                    int otherIncomingEdges = numIncomingEdges[i] - 1;
+                    //Decrement numIncomingEdges[i]
+                    numIncomingEdges[i] = otherIncomingEdges;
+                    if (otherIncomingEdges == 0){
+                        //If the next node is on a different server, do it
+                        //before we do the nodes on this server
+                        //Because printOrdering is a stack, this
+                        //means we defer the push of nodes on a
+                        //different server until after we
+                        //push the nodes from the same node.
+                        if (v[i].getServerID() == v[thisNode].getServerID()){
+                            printf("Nonfork\n");
+                            //Print the node next
+                            printOrdering.push(i);
+                        } else {
+                            printf("Fork\n");
+                            forkNexts.push_back(i);
                         }
                     }
                 }
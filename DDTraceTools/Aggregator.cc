@@ -0,0 +1,178 @@
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "DDTrace.h"
+#include "DDTrace/Aggregator.h"
+#include "DDTrace/AggregatorSinks.h"
+
+void usage() {
+    fprintf(stderr, "Usage: ddtrace-aggregator [options] <sink name>\n");
+    fprintf(stderr, "    -j   number of drain threads (default 1)\n");
+    fprintf(stderr, "    -d   write rotating .ddt files into this directory\n");
+    fprintf(stderr, "    -p   prefix of .ddt file names (defaults to the sink name)\n");
+    fprintf(stderr, "    -s   start a new file after this many megabytes (default 256, 0 for no limit)\n");
+    fprintf(stderr, "    -r   start a new file after this many seconds (default 3600, 0 for no limit)\n");
+    fprintf(stderr, "    -t   with -d, only write requests that breached an SLA, buffering each request\n");
+    fprintf(stderr, "         for this many seconds to catch all of its intervals\n");
+    fprintf(stderr, "    -R   with -t, also write this fraction (0 to 1) of the other requests\n");
+    fprintf(stderr, "    -H   print per-annotation latency histograms every this many seconds\n");
+    fprintf(stderr, "    -S   append HDR histogram snapshots per server and annotation to this file\n");
+    fprintf(stderr, "    -I   seconds between snapshots with -S (default 60)\n");
+    fprintf(stderr, "    -q   write a summary line per request to this file (- for stdout) once it is\n");
+    fprintf(stderr, "         over: intervals, servers, end to end, total and critical path time, counters\n");
+    fprintf(stderr, "    -T   with -q, a request is over once idle for this many seconds (default 1)\n");
+    fprintf(stderr, "    -e   stream records to host:port\n");
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    size_t numDrainThreads = 1;
+    const char* directory = NULL;
+    const char* prefix = NULL;
+    double maxMegabytes = 256;
+    double maxSeconds = 3600;
+    double histogramInterval = 0;
+    double tailWindow = 0;
+    double sampleRate = 0;
+    const char* exportAddress = NULL;
+    const char* snapshotFile = NULL;
+    double snapshotInterval = 60;
+    const char* summaryFile = NULL;
+    double idleSeconds = 1;
+
+    int c;
+    while ((c = getopt (argc, argv, "j:d:p:s:r:t:R:H:S:I:q:T:e:")) != -1)
+    switch (c)
+    {
+        case 'j':
+            numDrainThreads = atoi(optarg);
+            break;
+        case 'd':
+            directory = optarg;
+            break;
+        case 'p':
+            prefix = optarg;
+            break;
+        case 's':
+            maxMegabytes = atof(optarg);
+            break;
+        case 'r':
+            maxSeconds = atof(optarg);
+            break;
+        case 't':
+            tailWindow = atof(optarg);
+            break;
+        case 'R':
+            sampleRate = atof(optarg);
+            break;
+        case 'H':
+            histogramInterval = atof(optarg);
+            break;
+        case 'S':
+            snapshotFile = optarg;
+            break;
+        case 'I':
+            snapshotInterval = atof(optarg);
+            break;
+        case 'q':
+            summaryFile = optarg;
+            break;
+        case 'T':
+            idleSeconds = atof(optarg);
+            break;
+        case 'e':
+            exportAddress = optarg;
+            break;
+        case '?':
+        default:
+            usage();
+    }
+    if (optind != argc - 1 || numDrainThreads == 0) usage();
+    const char* sinkName = argv[optind];
+    if (!directory && histogramInterval <= 0 && !snapshotFile && !summaryFile &&
+        !exportAddress) {
+        fprintf(stderr, "Nothing to do, give at least one of -d, -H, -S, -q, -e\n");
+        usage();
+    }
+
+    DDTrace::init();
+    DDTrace::Aggregator aggregator;
+    DDTrace::TailSamplingSink* tailSampling = NULL;
+    if (directory) {
+        DDTrace::AggregatorSink* files = new DDTrace::RotatingFileSink(directory,
+                    prefix ? prefix : sinkName,
+                    static_cast<uint64_t>(maxMegabytes * (1 << 20)),
+                    maxSeconds);
+        if (tailWindow > 0) {
+            // Whole requests that breached an SLA (and a sample of the
+            // rest) instead of every record
+            tailSampling = new DDTrace::TailSamplingSink(files, tailWindow,
+                    sampleRate);
+            files = tailSampling;
+        }
+        aggregator.addSink(files);
+    }
+    if (histogramInterval > 0) {
+        aggregator.addSink(new DDTrace::HistogramSink(stdout,
+                    histogramInterval));
+    }
+    if (snapshotFile) {
+        aggregator.addSink(new DDTrace::HdrHistogramSink(snapshotFile,
+                    snapshotInterval));
+    }
+    DDTrace::RequestAssemblySink* requestAssembly = NULL;
+    FILE* summaryOut = NULL;
+    if (summaryFile) {
+        summaryOut = strcmp(summaryFile, "-") ? fopen(summaryFile, "a") : stdout;
+        if (!summaryOut) PG_DIE("Could not open %s for appending\n", summaryFile);
+        requestAssembly = new DDTrace::RequestAssemblySink(summaryOut,
+                    idleSeconds);
+        aggregator.addSink(requestAssembly);
+    }
+    if (exportAddress) {
+        const char* colon = strrchr(exportAddress, ':');
+        if (!colon)
+            PG_DIE("Expected host:port, got %s\n", exportAddress);
+        aggregator.addSink(new DDTrace::NetworkSink(
+                    std::string(exportAddress, colon - exportAddress),
+                    colon + 1));
+    }
+
+    // Blocked before any thread starts, so that every thread inherits the
+    // mask and the signals stay pending until we wait for them
+    sigset_t exitSignals;
+    sigemptyset(&exitSignals);
+    sigaddset(&exitSignals, SIGTERM);
+    sigaddset(&exitSignals, SIGINT);
+    int rc = pthread_sigmask(SIG_BLOCK, &exitSignals, NULL);
+    if (rc != 0) PG_DIE("Could not block SIGTERM and SIGINT\n");
+
+    aggregator.init(sinkName, numDrainThreads);
+    aggregator.start();
+    int signal;
+    while (sigwait(&exitSignals, &signal) != 0) {
+    }
+
+    fprintf(stderr, "Draining channels\n");
+    aggregator.stop();
+    fprintf(stderr, "Consumed %lu records, dropped %lu\n",
+            aggregator.getConsumedRecords(), aggregator.getDroppedRecords());
+    if (tailSampling) {
+        fprintf(stderr, "Kept %lu requests that breached an SLA and sampled %lu,"
+                " discarded %lu (%lu decided early for lack of memory)\n",
+                tailSampling->getPromotedRequests(),
+                tailSampling->getSampledRequests(),
+                tailSampling->getDiscardedRequests(),
+                tailSampling->getEarlyRequests());
+    }
+    if (requestAssembly) {
+        fprintf(stderr, "Summarized %lu requests (%lu before they were idle, for"
+                " lack of memory)\n", requestAssembly->getSummarizedRequests(),
+                requestAssembly->getEarlyRequests());
+        if (summaryOut != stdout) fclose(summaryOut);
+    }
+    return 0;
+}
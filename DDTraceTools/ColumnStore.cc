@@ -0,0 +1,107 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "DDTrace.h"
+#include "DDTrace/ColumnStore.h"
+
+void usage() {
+    fprintf(stderr, "Usage: ddtrace-columnar -o <store> <eventfile1> <eventfile2> ...\n");
+    fprintf(stderr, "       ddtrace-columnar -r <store> [-s serverId]\n");
+    fprintf(stderr, "    -o   convert .ddt files into a column store in this directory\n");
+    fprintf(stderr, "    -r   print per-annotation latency percentiles of a column store\n");
+    fprintf(stderr, "    -s   only report records of this server\n");
+    exit(1);
+}
+
+double percentile(std::vector<double>& values, double fraction) {
+    size_t rank = std::min(values.size() - 1,
+                           static_cast<size_t>(fraction * values.size()));
+    std::nth_element(values.begin(), values.begin() + rank, values.end());
+    return values[rank];
+}
+
+/**
+ * Prints count, mean, median, 99th percentile and max latency of every
+ * annotation in microseconds. Only the annotation, duration and cycles per
+ * second columns are read (and serverId, if filtering on it).
+ */
+void report(DDTrace::ColumnStoreReader& store, int serverId) {
+    uint64_t numRecords = store.getNumRecords();
+    const uint32_t* annotationIds = store.getAnnotationIds();
+    const uint64_t* durations = store.getDurationCycles();
+    const double* cyclesPerSec = store.getCyclesPerSec();
+    const uint16_t* serverIds = serverId >= 0 ? store.getServerIds() : NULL;
+
+    std::vector<std::vector<double> > latencies(store.getNumAnnotations());
+    for (uint64_t i = 0; i < numRecords; i++) {
+        if (serverIds && serverIds[i] != serverId) continue;
+        latencies[annotationIds[i]].push_back(
+                durations[i] * 1e6 / cyclesPerSec[i]);
+    }
+
+    printf("%-18s %10s %12s %12s %12s %12s\n", "annotation", "count",
+           "mean us", "p50 us", "p99 us", "max us");
+    for (uint32_t a = 0; a < latencies.size(); a++) {
+        std::vector<double>& values = latencies[a];
+        if (values.empty()) continue;
+        double sum = 0;
+        for (size_t i = 0; i < values.size(); i++) {
+            sum += values[i];
+        }
+        double max = *std::max_element(values.begin(), values.end());
+        double mean = sum / values.size();
+        double p50 = percentile(values, 0.5);
+        double p99 = percentile(values, 0.99);
+        printf("%-18s %10zu %12.2f %12.2f %12.2f %12.2f\n",
+               store.getAnnotation(a).empty() ? "(none)"
+                   : store.getAnnotation(a).c_str(),
+               values.size(), mean, p50, p99, max);
+    }
+}
+
+/**
+ * Converts .ddt files into a column store, or reports latencies out of one.
+ * See DDTrace/ColumnStore.h for the layout of a store.
+ */
+int main(int argc, char** argv) {
+    const char* output = NULL;
+    const char* input = NULL;
+    int serverId = -1;
+
+    int c;
+    while ((c = getopt (argc, argv, "o:r:s:")) != -1)
+    switch (c)
+    {
+        case 'o':
+            output = optarg;
+            break;
+        case 'r':
+            input = optarg;
+            break;
+        case 's':
+            serverId = atoi(optarg);
+            break;
+        case '?':
+        default:
+            usage();
+    }
+    if (!output == !input) usage();
+
+    if (output) {
+        if (optind == argc) usage();
+        std::vector<std::string> traceFiles(argv + optind, argv + argc);
+        uint64_t numRecords = DDTrace::ColumnStoreUtils::convert(traceFiles,
+                                                                 output);
+        fprintf(stderr, "Wrote %lu records to %s\n", numRecords, output);
+        return 0;
+    }
+
+    DDTrace::ColumnStoreReader store;
+    store.open(input);
+    report(store, serverId);
+    return 0;
+}
@@ -4,12 +4,17 @@
 #include <stdio.h>
 #include <utility>
 #include <algorithm>
+#include <thread>
+#include <string.h>
+#include <time.h>
 //#include "VectorClock.h"
 #include "DDTrace.h"
-
-
-// The number of records we attempt to read.
-#define READ_BATCH_SIZE 1000
+#include "DDTrace/ClockOffsets.h"
+#include "DDTrace/CriticalPath.h"
+#include "DDTrace/Query.h"
+#include "DDTrace/RequestGraph.h"
+#include "DDTrace/RequestGroups.h"
+#include "DDTrace/TraceFile.h"
 
 using DDTrace::VectorClock;
 using std::unordered_map;
@@ -18,83 +23,298 @@ using std::vector;
 void usage() {
     fprintf(stderr, "Usage: LogParser [options] <eventfile1> <eventfile2> ...\n");
     fprintf(stderr, "    -o   specify output file (defaults to stdout)\n");
+    fprintf(stderr, "    -a   align servers' clocks, printing nanoseconds on a common clock instead of cycles\n");
+    fprintf(stderr, "    -j   number of threads reading files (defaults to the number of cores)\n");
+    fprintf(stderr, "    -m   group requests in at most this many megabytes, spilling to disk\n");
+    fprintf(stderr, "    -T   directory to spill to with -m (defaults to $TMPDIR or /tmp)\n");
+    fprintf(stderr, "    -w   only print the intervals overlapping <from>,<to>, as unix nanoseconds, reading\n");
+    fprintf(stderr, "         only the blocks that hold them. Times are unix seconds, \"YYYY-MM-DD HH:MM:SS[.f]\"\n");
+    fprintf(stderr, "         or \"HH:MM:SS[.f]\" on the day each file was written, in local time\n");
+    fprintf(stderr, "    -s   with -w, only print the intervals of this server\n");
+    fprintf(stderr, "    -g   print the happened-before DAG of each request, in Graphviz dot format, with\n");
+    fprintf(stderr, "         its critical path in bold and the slack of every other interval\n");
+    fprintf(stderr, "    -c   print how much of the requests' critical paths each annotation accounts for\n");
+    fprintf(stderr, "    -q   print aggregates instead of records, eg\n");
+    fprintf(stderr, "         -q \"select count,p99(duration) where duration > 1ms and annotation = read by server,time(1s)\"\n");
+    fprintf(stderr, "         See DDTrace/Query.h for the syntax\n");
     exit(1);
 }
 
 /**
- * Read the IntervalRecords out of a particular file and add them to the
- * structure which is passed in.
- * */
-void readEvents(const char* filename, 
-        unordered_map<uint64_t, std::vector<DDTrace::IntervalRecord> >& eventMap) {
-    FILE* eventFile = fopen(filename, "r");
-    if (!eventFile)
-        PG_DIE("file read error on %s", filename);
-
-    // Here we simply convert from cycles to nanoseconds.
-    // When we actually process an individual event and sort, the vector clocks
-    // will tell us whether we actually went to a new machine and we can decide
-    // whether startTime - previousEndTime is meaningful.
-    DDTrace::CounterType toRet = DDTrace::INVALID_COUNTER_TYPE;
-
-    int recordsRead = 0;
-    DDTrace::IntervalRecord* buffer = (DDTrace::IntervalRecord*) 
-        malloc(READ_BATCH_SIZE * sizeof(DDTrace::IntervalRecord));
-    while ((recordsRead = 
-                fread(buffer, sizeof(DDTrace::IntervalRecord), READ_BATCH_SIZE, eventFile))) {
-        //printf("readBytes = %d\n", recordsRead); 
-        for (int i = 0; i < recordsRead; i++) {
-            uint64_t id = buffer[i].getClock().id;
-            if (!eventMap.count(id))
-                eventMap[id] = std::vector<DDTrace::IntervalRecord>();
-
-            eventMap[id].push_back(buffer[i]);
-        }
+ * Prints one record as a line of comma separated values, with start and end
+ * given by the caller
+ */
+void printRecord(FILE* output, const DDTrace::IntervalRecord* e,
+        int64_t start, int64_t end) {
+    auto clock = e->getClock();
+    // Format is RequestID, ServerID, (Vector Clock in id-count id-count form), startCycles, endCycles, PerfRecord
+    fprintf(output, "%zu,%u,(", clock.id, e->getServerID());
+    for (int i = 0; i < clock.length; i++) {
+       if (i == 0)
+           fprintf(output, "%hu-%hu", clock.entries[i].serverId, clock.entries[i].count);
+       else
+           fprintf(output, " %hu-%hu", clock.entries[i].serverId, clock.entries[i].count);
+    }
+    fprintf(output, "),%ld,%ld,", start, end);
 
+    // Print the perfRecrod
+    auto perfRecord =  e->getCountersDiff();
+    bool hasCounter;
+    uint64_t value;
+#define PRINT_COUNTER(x) hasCounter = perfRecord . x (&value); \
+    if (hasCounter) { \
+        fprintf(output,"%ld", value); \
+    } else { \
+        fprintf(output,"NA"); \
     }
-    fclose(eventFile);
+
+    PRINT_COUNTER(getUserspaceCycles)
+    putc(',',output);
+    PRINT_COUNTER(getL2Misses)
+    putc(',',output);
+    PRINT_COUNTER(getL3Misses)
+    putc('\n',output);
+#undef PRINT_COUNTER
 }
 
+/**
+ * Dumps every record as a line of comma separated values. If offsets is
+ * non-NULL, start and end are printed as nanoseconds on the reference
+ * server's clock instead of as raw cycles.
+ *
+ * Requests is RequestGroups or ExternalRequestGroups.
+ */
+template<typename Requests>
+void dumpToTSV(const Requests& requests, const char* filename,
+        const DDTrace::ClockOffsets* offsets) {
+    FILE* output = filename? fopen(filename, "w") : stdout;
+    if (!output) {
+        PG_DIE("Could not open %s for writing\n", filename);
+    }
+    requests.forEach([output, offsets](uint64_t id,
+                const DDTrace::IntervalRecord* records, size_t count) {
+        for (auto e = records; e != records + count; e++) {
+            if (offsets) {
+                printRecord(output, e,
+                        offsets->toReferenceNanoseconds(e->getServerID(), e->getStartNanoseconds()),
+                        offsets->toReferenceNanoseconds(e->getServerID(), e->getEndNanoseconds()));
+            } else {
+                printRecord(output, e, e->getStartCycles(), e->getEndCycles());
+            }
+        }
+    });
+    if (output != stdout) fclose(output);
+}
 
+/**
+ * Parses a time given to -w into unix nanoseconds. A time of day without a
+ * date is taken on the local date of referenceNanoseconds.
+ */
+uint64_t parseWallclock(const char* text, uint64_t referenceNanoseconds) {
+    struct tm fields;
+    memset(&fields, 0, sizeof(fields));
+    const char* rest = strptime(text, "%Y-%m-%d %H:%M:%S", &fields);
+    if (!rest) {
+        time_t reference = referenceNanoseconds / 1000000000UL;
+        localtime_r(&reference, &fields);
+        rest = strptime(text, "%H:%M:%S", &fields);
+    }
+    if (rest) {
+        fields.tm_isdst = -1;
+        time_t seconds = mktime(&fields);
+        double fraction = 0;
+        if (*rest == '.') {
+            char* end;
+            fraction = strtod(rest, &end);
+            rest = end;
+        }
+        if (seconds >= 0 && *rest == '\0') {
+            return seconds * 1000000000UL +
+                static_cast<uint64_t>(fraction * 1e9 + 0.5);
+        }
+    } else {
+        char* end;
+        double seconds = strtod(text, &end);
+        if (end != text && *end == '\0' && seconds >= 0) {
+            return static_cast<uint64_t>(seconds * 1e9 + 0.5);
+        }
+    }
+    PG_DIE("Bad time %s\n", text);
+    return 0;
+}
 
-int dumpToTSV(unordered_map<uint64_t,std::vector<DDTrace::IntervalRecord> >& eventMap, const char* filename) {
-    FILE* output = filename? fopen(filename, "r") : stdout;
-    for (auto kv = eventMap.begin(); kv != eventMap.end(); kv++) {
-        auto& v = kv->second;
-        for (auto e = v.begin(); e != v.end(); e++) {
-            auto clock = e->getClock();
-            // Format is RequestID, ServerID, (Vector Clock in id-count id-count form), startCycles, endCycles, PerfRecord
-            fprintf(output, "%zu,%u,(", clock.id, e->getServerID());
-            for (int i = 0; i < clock.length; i++) {
-               if (i == 0)
-                   fprintf(output, "%hu-%hu", clock.entries[i].serverId, clock.entries[i].count);
-               else
-                   fprintf(output, " %hu-%hu", clock.entries[i].serverId, clock.entries[i].count);
-            }
-            fprintf(output, "),%zu,%zu,", e->getStartCycles(), e->getEndCycles());
+/**
+ * Prints the intervals of files that overlap the window given to -w, with
+ * start and end as unix nanoseconds. Each file's block index is searched for
+ * the blocks that may hold them, so only those are read.
+ */
+void dumpTimeRange(const std::vector<std::string>& files, const char* window,
+        int serverId, const char* filename) {
+    const char* comma = strchr(window, ',');
+    if (!comma) usage();
+    std::string from(window, comma);
+    std::string to(comma + 1);
 
-            // Print the perfRecrod
-            auto perfRecord =  e->getCountersDiff();
-            bool hasCounter;
-            uint64_t value;
-#define PRINT_COUNTER(x) hasCounter = perfRecord . x (&value); \
-            if (hasCounter) { \
-                fprintf(output,"%ld", value); \
-            } else { \
-                fprintf(output,"NA"); \
+    FILE* output = filename? fopen(filename, "w") : stdout;
+    if (!output) {
+        PG_DIE("Could not open %s for writing\n", filename);
+    }
+    for (auto& file : files) {
+        DDTrace::TraceFileHeader header;
+        {
+            DDTrace::TraceFileReader reader;
+            reader.open(file);
+            header = reader.getHeader();
+        }
+        if (header.anchorUnixNanoseconds == 0) {
+            fprintf(stderr, "Skipping %s, it has no wallclock anchor\n", file.c_str());
+            continue;
+        }
+        uint64_t fromNanoseconds = parseWallclock(from.c_str(), header.anchorUnixNanoseconds);
+        uint64_t toNanoseconds = parseWallclock(to.c_str(), header.anchorUnixNanoseconds);
+        DDTrace::TraceFileUtils::readTimeRange(file, fromNanoseconds, toNanoseconds,
+                serverId < 0 ? DDTrace::INVALID_SERVER_ID : serverId,
+                [output, &header](const DDTrace::IntervalRecord* records, size_t count) {
+            for (auto e = records; e != records + count; e++) {
+                printRecord(output, e,
+                        DDTrace::TraceFileUtils::toUnixNanoseconds(header,
+                            e->getStartCycles(), e->getCyclesPerSec()),
+                        DDTrace::TraceFileUtils::toUnixNanoseconds(header,
+                            e->getEndCycles(), e->getCyclesPerSec()));
             }
+        });
+    }
+    if (output != stdout) fclose(output);
+}
 
-            PRINT_COUNTER(getUserspaceCycles)
-            putc(',',output);
-            PRINT_COUNTER(getL2Misses)
-            putc(',',output);
-            PRINT_COUNTER(getL3Misses)
-            putc('\n',output);
+/**
+ * Prints the happened-before DAG of every request (see RequestGraph) as a
+ * Graphviz digraph named after the request id, with a node per interval
+ * labeled with its server, annotation and elapsed time. The critical path
+ * (see CriticalPath) is drawn in bold and every other interval is labeled
+ * with its slack.
+ */
+template<typename Requests>
+void dumpGraphs(const Requests& requests, const char* filename) {
+    FILE* output = filename? fopen(filename, "w") : stdout;
+    if (!output) {
+        PG_DIE("Could not open %s for writing\n", filename);
+    }
+    DDTrace::RequestGraph graph;
+    DDTrace::CriticalPath path;
+    requests.forEach([output, &graph, &path](uint64_t id,
+                const DDTrace::IntervalRecord* records, size_t count) {
+        graph.build(records, count);
+        path.compute(graph, records);
+        fprintf(output, "digraph \"%lu\" {\n", id);
+        for (size_t i = 0; i < count; i++) {
+            fprintf(output, "    n%zu [label=\"%u %s\\n%.3fus", i,
+                    records[i].getServerID(), records[i].getAnnotation(),
+                    records[i].getElapsedNanoseconds() / 1e3);
+            if (path.isOnPath(i)) {
+                fprintf(output, "\", style=bold];\n");
+            } else {
+                fprintf(output, "\\nslack %.3fus\"];\n",
+                        path.getSlackNanoseconds(i) / 1e3);
+            }
         }
+        for (size_t i = 0; i < count; i++) {
+            const uint32_t* successors = graph.getSuccessors(i);
+            for (size_t s = 0; s < graph.getNumSuccessors(i); s++) {
+                // Path nodes only have an edge between them if they are next
+                // to each other on the path
+                bool onPath = path.isOnPath(i) && path.isOnPath(successors[s]);
+                fprintf(output, "    n%zu -> n%u%s;\n", i, successors[s],
+                        onPath ? " [style=bold]" : "");
+            }
+        }
+        fprintf(output, "}\n");
+    });
+    if (output != stdout) fclose(output);
+}
+
+/**
+ * Calls onRequest(thread, id, records, count) for every request, on up to
+ * numThreads threads. Out of core groups are merged on one thread, so their
+ * requests are all handed to thread 0.
+ */
+void forEachRequest(const DDTrace::RequestGroups& requests, size_t numThreads,
+        const DDTrace::RequestGroups::ParallelRequestCallback& onRequest) {
+    requests.forEachInParallel(numThreads, onRequest);
+}
+
+void forEachRequest(const DDTrace::ExternalRequestGroups& requests,
+        size_t numThreads,
+        const DDTrace::RequestGroups::ParallelRequestCallback& onRequest) {
+    requests.forEach([&onRequest](uint64_t id,
+                const DDTrace::IntervalRecord* records, size_t count) {
+        onRequest(0, id, records, count);
+    });
+}
+
+/**
+ * Finds the critical path of every request in parallel and prints, per
+ * annotation, how much of the critical paths it accounts for and how much
+ * slack its intervals off them had (see CriticalPathStats)
+ */
+template<typename Requests>
+void dumpCriticalPaths(const Requests& requests, const char* filename,
+        size_t numThreads) {
+    FILE* output = filename? fopen(filename, "w") : stdout;
+    if (!output) {
+        PG_DIE("Could not open %s for writing\n", filename);
     }
+    numThreads = std::max<size_t>(1, numThreads);
+    std::vector<DDTrace::RequestGraph> graphs(numThreads);
+    std::vector<DDTrace::CriticalPath> paths(numThreads);
+    std::vector<DDTrace::CriticalPathStats> stats(numThreads);
+    forEachRequest(requests, numThreads, [&](size_t t, uint64_t id,
+                const DDTrace::IntervalRecord* records, size_t count) {
+        graphs[t].build(records, count);
+        paths[t].compute(graphs[t], records);
+        stats[t].add(records, count, paths[t]);
+    });
+    for (size_t t = 1; t < numThreads; t++) {
+        stats[0].merge(stats[t]);
+    }
+    fprintf(stderr, "%lu requests, mean critical path %.3fus\n",
+            stats[0].getNumRequests(), stats[0].getNumRequests() ?
+            stats[0].getPathNanoseconds() / 1e3 / stats[0].getNumRequests() : 0);
+    stats[0].print(output);
     if (output != stdout) fclose(output);
 }
 
+/**
+ * Runs the analyses asked for over requests, which is RequestGroups or
+ * ExternalRequestGroups
+ */
+template<typename Requests>
+void analyze(const Requests& requests, const char* outfile, bool alignClocks,
+        bool printGraphs, bool criticalPaths, size_t numThreads) {
+    if (printGraphs) {
+        dumpGraphs(requests, outfile);
+        return;
+    }
+    if (criticalPaths) {
+        dumpCriticalPaths(requests, outfile, numThreads);
+        return;
+    }
+    // Estimate each server's clock relative to the others from the
+    // happens-before edges of every request
+    DDTrace::ClockOffsets offsets;
+    if (alignClocks) {
+        DDTrace::ClockOffsetEstimator estimator;
+        requests.forEach([&estimator](uint64_t id,
+                    const DDTrace::IntervalRecord* records, size_t count) {
+            estimator.addRequest(records, count);
+        });
+        estimator.solve(&offsets);
+        offsets.print(stderr);
+    }
+
+    dumpToTSV(requests, outfile, alignClocks ? &offsets : NULL);
+}
+
 /**
  * This is a tool that is designed to parse a collection of binary log files from the
  * DDTrace library and extract useful information out of them.
@@ -107,22 +327,57 @@ int dumpToTSV(unordered_map<uint64_t,std::vector<DDTrace::IntervalRecord> >& eve
  */
 int main(int argc, char** argv) {
     // Read all the event files and pull them by RpcId so it is easy to consider
-    // each piece individually.
-    // We should probably do batch reading.
+    // each piece individually. Files are read in parallel, see RequestGroups.
 
     if (argc == 1) usage();
 
     const char* outfile = NULL;
+    bool alignClocks = false;
+    size_t numThreads = std::max(1u, std::thread::hardware_concurrency());
+    double memoryBudget = 0;
+    const char* tempDirectory = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    const char* window = NULL;
+    const char* queryText = NULL;
+    int serverId = -1;
+    bool printGraphs = false;
+    bool criticalPaths = false;
 
     char c;
     // Only one option can be selected or none
     // Mutually conflicting options will have the last one win
-    while ((c = getopt (argc, argv, "o:")) != -1)
+    while ((c = getopt (argc, argv, "o:aj:m:T:w:s:gcq:")) != -1)
     switch (c)
     {
         case 'o':
             outfile = optarg;
             break;
+        case 'a':
+            alignClocks = true;
+            break;
+        case 'j':
+            numThreads = atoi(optarg);
+            break;
+        case 'm':
+            memoryBudget = atof(optarg);
+            break;
+        case 'T':
+            tempDirectory = optarg;
+            break;
+        case 'w':
+            window = optarg;
+            break;
+        case 's':
+            serverId = atoi(optarg);
+            break;
+        case 'g':
+            printGraphs = true;
+            break;
+        case 'c':
+            criticalPaths = true;
+            break;
+        case 'q':
+            queryText = optarg;
+            break;
         case '?':
         default:
             usage();
@@ -130,15 +385,44 @@ int main(int argc, char** argv) {
             return 1;
     }
 
-    // Map of Rpc ID to events associated with it
-    unordered_map<uint64_t, std::vector<DDTrace::IntervalRecord> > eventMap;
-
-    // Read in each file
-    for (int i = optind; i < argc; i++) {
-        readEvents(argv[i], eventMap);
+    std::vector<std::string> files(argv + optind, argv + argc);
+    if (queryText) {
+        // Aggregates only, no need to group requests either
+        DDTrace::Query query;
+        try {
+            query = DDTrace::QueryUtils::parse(queryText);
+        } catch (std::runtime_error& e) {
+            usage();
+        }
+        DDTrace::QueryEngine engine(query);
+        engine.read(files, numThreads);
+        fprintf(stderr, "%lu of %lu records matched\n", engine.getNumMatched(),
+                engine.getNumRecords());
+        FILE* output = outfile ? fopen(outfile, "w") : stdout;
+        if (!output) {
+            PG_DIE("Could not open %s for writing\n", outfile);
+        }
+        engine.print(output);
+        if (output != stdout) fclose(output);
+    } else if (window) {
+        // A slice of the files, no need to group requests
+        dumpTimeRange(files, window, serverId, outfile);
+    } else if (memoryBudget > 0) {
+        // Out of core: sorted runs are spilled to tempDirectory and merged
+        // back one request at a time
+        DDTrace::ExternalRequestGroups requests(tempDirectory,
+                static_cast<uint64_t>(memoryBudget * (1 << 20)));
+        requests.read(files, numThreads);
+        fprintf(stderr, "Spilled %lu records to %zu runs\n",
+                requests.getNumRecords(), requests.getNumRuns());
+        analyze(requests, outfile, alignClocks, printGraphs, criticalPaths,
+                numThreads);
+    } else {
+        // Read every file, grouping the events by request ID
+        DDTrace::RequestGroups requests;
+        requests.read(files, numThreads);
+        analyze(requests, outfile, alignClocks, printGraphs, criticalPaths,
+                numThreads);
     }
-
-    dumpToTSV(eventMap, outfile);
-
-    int count = 0;
+    return 0;
 }
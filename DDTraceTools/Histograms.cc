@@ -0,0 +1,139 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "DDTrace.h"
+#include "DDTrace/Histogram.h"
+
+void usage() {
+    fprintf(stderr, "Usage: ddtrace-histograms [options] <snapshotfile1> <snapshotfile2> ...\n");
+    fprintf(stderr, "    -f   only merge snapshots that end after this unix time (seconds)\n");
+    fprintf(stderr, "    -t   only merge snapshots that start before this unix time (seconds)\n");
+    fprintf(stderr, "    -s   only report this server\n");
+    fprintf(stderr, "    -A   merge the histograms of every server\n");
+    fprintf(stderr, "    -x   also print an example request id for p99 and p999 of elapsed times\n");
+    fprintf(stderr, "    -k   also list the this many slowest intervals of each annotation, with request ids\n");
+    exit(1);
+}
+
+/**
+ * Merges the HDR histogram snapshots written by ddtrace-aggregator -S, of
+ * any number of servers and intervals, and prints count, mean, median, 99th
+ * and 99.9th percentile and max of every (server, annotation, field).
+ *
+ * The request ids it prints with -x and -k can be handed to ddtrace-lookup
+ * to reconstruct those requests.
+ */
+int main(int argc, char** argv) {
+    double from = 0;
+    double to = 0;
+    int serverId = -1;
+    bool acrossServers = false;
+    bool exemplars = false;
+    size_t numSlowest = 0;
+
+    int c;
+    while ((c = getopt (argc, argv, "f:t:s:Axk:")) != -1)
+    switch (c)
+    {
+        case 'f':
+            from = atof(optarg);
+            break;
+        case 't':
+            to = atof(optarg);
+            break;
+        case 's':
+            serverId = atoi(optarg);
+            break;
+        case 'A':
+            acrossServers = true;
+            break;
+        case 'x':
+            exemplars = true;
+            break;
+        case 'k':
+            numSlowest = atoi(optarg);
+            break;
+        case '?':
+        default:
+            usage();
+    }
+    if (optind == argc) usage();
+    uint64_t fromNanoseconds = from * 1e9;
+    uint64_t toNanoseconds = to > 0 ? to * 1e9 : UINT64_MAX;
+
+    typedef std::tuple<int, std::string, int> Key;
+    std::map<Key, DDTrace::HdrHistogram> merged;
+    std::map<std::string, DDTrace::SlowestIntervals> slowest;
+    uint64_t snapshotStart = UINT64_MAX, snapshotEnd = 0;
+    for (int f = optind; f < argc; f++) {
+        DDTrace::HistogramUtils::readSnapshots(argv[f],
+            [&](uint64_t start, uint64_t end, uint16_t server,
+                const std::string& annotation, DDTrace::HistogramField field,
+                const DDTrace::HdrHistogram& histogram) {
+                if (end <= fromNanoseconds || start >= toNanoseconds) return;
+                if (serverId >= 0 && server != serverId) return;
+                snapshotStart = std::min(snapshotStart, start);
+                snapshotEnd = std::max(snapshotEnd, end);
+                merged[Key(acrossServers ? -1 : server, annotation, field)]
+                    .merge(histogram);
+            },
+            [&](uint64_t start, uint64_t end, uint16_t server,
+                const std::string& annotation,
+                const DDTrace::SlowestIntervals& intervals) {
+                if (end <= fromNanoseconds || start >= toNanoseconds) return;
+                if (serverId >= 0 && server != serverId) return;
+                auto itr = slowest.find(annotation);
+                if (itr == slowest.end()) {
+                    itr = slowest.insert(std::make_pair(annotation,
+                                DDTrace::SlowestIntervals(numSlowest))).first;
+                }
+                itr->second.merge(intervals);
+            });
+    }
+    if (merged.empty()) {
+        fprintf(stderr, "No snapshots in range\n");
+        return 0;
+    }
+
+    fprintf(stderr, "Snapshots from %.3f to %.3f\n", snapshotStart / 1e9,
+            snapshotEnd / 1e9);
+    printf("%-8s %-18s %-10s %12s %12s %12s %12s %12s %12s", "server",
+           "annotation", "field", "count", "mean", "p50", "p99", "p999", "max");
+    if (exemplars) printf(" %18s %18s", "p99 request", "p999 request");
+    putchar('\n');
+    for (auto itr = merged.begin(); itr != merged.end(); ++itr) {
+        const DDTrace::HdrHistogram& h = itr->second;
+        std::string server = std::get<0>(itr->first) < 0 ? "*" :
+            std::to_string(std::get<0>(itr->first));
+        const std::string& annotation = std::get<1>(itr->first);
+        printf("%-8s %-18s %-10s %12lu %12.1f %12lu %12lu %12lu %12lu",
+               server.c_str(), annotation.empty() ? "-" : annotation.c_str(),
+               DDTrace::HistogramUtils::getFieldName(
+                   static_cast<DDTrace::HistogramField>(std::get<2>(itr->first))),
+               h.getCount(), static_cast<double>(h.getSum()) / h.getCount(),
+               h.getValueAtQuantile(0.5), h.getValueAtQuantile(0.99),
+               h.getValueAtQuantile(0.999), h.getMax());
+        if (exemplars && std::get<2>(itr->first) == DDTrace::HISTOGRAM_ELAPSED) {
+            printf(" %#18lx %#18lx", h.getExemplarAtQuantile(0.99),
+                   h.getExemplarAtQuantile(0.999));
+        }
+        putchar('\n');
+    }
+
+    for (auto itr = slowest.begin(); numSlowest && itr != slowest.end(); ++itr) {
+        printf("\nSlowest %s:\n", itr->first.empty() ? "-" : itr->first.c_str());
+        std::vector<DDTrace::SlowestIntervals::Interval> intervals =
+            itr->second.getSorted();
+        for (size_t i = 0; i < intervals.size(); i++) {
+            printf("    %12lu ns  request %#lx\n",
+                   intervals[i].elapsedNanoseconds, intervals[i].requestId);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,98 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "DDTrace.h"
+#include "DDTrace/RequestIndex.h"
+
+void usage() {
+    fprintf(stderr, "Usage: ddtrace-lookup [options] -r <id>[,<id>...] <eventfile1> <eventfile2> ...\n");
+    fprintf(stderr, "    -r   request ids to look up, decimal or 0x hex (can be repeated)\n");
+    fprintf(stderr, "    -b   build the request index of files that have none or a stale one\n");
+    exit(1);
+}
+
+void parseIds(const char* list, std::vector<uint64_t>* ids) {
+    std::vector<char> copy(list, list + strlen(list) + 1);
+    for (char* id = strtok(&copy[0], ","); id; id = strtok(NULL, ",")) {
+        char* end;
+        ids->push_back(strtoull(id, &end, 0));
+        if (*end) PG_DIE("Bad request id %s\n", id);
+    }
+}
+
+/**
+ * Prints every interval of the given requests found in the given .ddt
+ * files, one per line as
+ *
+ *     file,RequestID,ServerID,(vector clock),startCycles,endCycles,annotation
+ *
+ * reading only the blocks that the files' request indexes point at.
+ */
+int main(int argc, char** argv) {
+    std::vector<uint64_t> ids;
+    bool buildIndexes = false;
+
+    int c;
+    while ((c = getopt (argc, argv, "r:b")) != -1)
+    switch (c)
+    {
+        case 'r':
+            parseIds(optarg, &ids);
+            break;
+        case 'b':
+            buildIndexes = true;
+            break;
+        case '?':
+        default:
+            usage();
+    }
+    if (ids.empty() || optind == argc) usage();
+    std::vector<std::string> files(argv + optind, argv + argc);
+
+    if (buildIndexes) {
+        for (size_t i = 0; i < files.size(); i++) {
+            std::string index = DDTrace::RequestIndexUtils::getIndexFileName(files[i]);
+            if (access(index.c_str(), R_OK) == 0) {
+                FILE* file = fopen(files[i].c_str(), "rb");
+                if (!file) PG_DIE("Could not open %s\n", files[i].c_str());
+                fseeko(file, 0, SEEK_END);
+                uint64_t size = ftello(file);
+                fclose(file);
+                DDTrace::RequestIndexReader reader;
+                try {
+                    reader.open(index);
+                    if (reader.getHeader().traceFileSize == size) continue;
+                } catch (const std::runtime_error&) {
+                    //Corrupt, or from another version (open says which),
+                    //so rebuild it like a stale one
+                }
+            }
+            fprintf(stderr, "Indexing %s\n", files[i].c_str());
+            DDTrace::RequestIndexUtils::build(files[i]);
+        }
+    }
+
+    uint64_t found = 0;
+    uint64_t blocksRead = DDTrace::RequestIndexUtils::lookup(files, ids,
+        [&found](const std::string& file,
+                 const DDTrace::IntervalRecord* records, size_t count) {
+            for (size_t i = 0; i < count; i++) {
+                auto& clock = records[i].getClock();
+                printf("%s,%lu,%u,(", file.c_str(), clock.id,
+                       records[i].getServerID());
+                for (uint64_t e = 0; e < clock.length; e++) {
+                    printf(e ? " %hu-%hu" : "%hu-%hu", clock.entries[e].serverId,
+                           clock.entries[e].count);
+                }
+                printf("),%lu,%lu,%s\n", records[i].getStartCycles(),
+                       records[i].getEndCycles(), records[i].getAnnotation());
+            }
+            found += count;
+        });
+    fprintf(stderr, "Found %lu intervals in %lu blocks\n", found, blocksRead);
+    return 0;
+}
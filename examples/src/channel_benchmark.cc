@@ -0,0 +1,111 @@
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "DDTrace.h"
+
+using namespace DDTrace;
+
+/**
+ * Measures the fraction of records dropped as the number of channels (traced
+ * threads) grows, when a few hot threads produce most of the records.
+ *
+ * For each channel count, we fork a process whose threads produce bursts of
+ * records every millisecond, thread i at 1/(i+1) the rate of the hottest
+ * thread, while this process drains every channel through a RecordSource.
+ *
+ * Usage: channel_benchmark [seconds per run] [records per second on the
+ * hottest thread]
+ */
+
+const char* RECORD_SINK_NAME = "ddtrace_channel_benchmark";
+
+//Time between bursts on each producer thread
+const uint64_t BURST_INTERVAL_US = 1000;
+
+/**
+  * Lives in memory shared with the producer process
+  */
+struct ProducerStats {
+    std::atomic<uint64_t> produced;
+};
+
+void produce(size_t numThreads, double seconds, double hottestRate,
+             ProducerStats* stats){
+    std::vector<std::thread> threads;
+    for(size_t i = 0; i < numThreads; i++){
+        threads.emplace_back([=](){
+            initThreadSink(RECORD_SINK_NAME);
+            double rate = hottestRate / static_cast<double>(i + 1);
+            double perBurst = rate * BURST_INTERVAL_US / 1e6;
+            double owed = 0;
+            uint64_t produced = 0;
+            uint64_t stop = Cycles::rdtsc() + Cycles::fromSeconds(seconds);
+            VectorClock clock(i);
+            while (Cycles::rdtsc() < stop){
+                owed += perBurst;
+                for(; owed >= 1; owed -= 1){
+                    Interval _(&clock);
+                    produced++;
+                }
+                usleep(BURST_INTERVAL_US);
+            }
+            stats->produced.fetch_add(produced);
+        });
+    }
+    for(auto itr = threads.begin(); itr != threads.end(); ++itr){
+        itr->join();
+    }
+}
+
+int main(int argc, char** argv){
+    double seconds = argc >= 2 ? atof(argv[1]) : 2;
+    double hottestRate = argc >= 3 ? atof(argv[2]) : 100000;
+
+    DDTrace::init(TIME_ONLY, 1);
+    recordSource.init(RECORD_SINK_NAME);
+
+    ProducerStats* stats = static_cast<ProducerStats*>(mmap(NULL,
+                sizeof(ProducerStats), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    assert(stats != MAP_FAILED);
+
+    printf("channels\tproduced\tpopped\tdropped\tdrop rate\n");
+    for(size_t numThreads = 1; numThreads <= MAX_THREADS; numThreads *= 2){
+        stats->produced.store(0);
+        uint64_t droppedBefore = recordSource.getDroppedRecords();
+
+        pid_t child = fork();
+        if (child == 0){
+            produce(numThreads, seconds, hottestRate, stats);
+            _exit(0);
+        }
+        assert(child > 0);
+
+        uint64_t popped = 0;
+        IntervalRecord record;
+        bool producing = true;
+        while (producing || recordSource.getNumChannels() > 0){
+            if (recordSource.popRecord(&record)){
+                popped++;
+                continue;
+            }
+            //Records that overflowed the ALL queue
+            if (recordSource.popSLAExceededRecord(&record)){
+                popped++;
+                continue;
+            }
+            if (producing){
+                producing = waitpid(child, NULL, WNOHANG) == 0;
+            } else {
+                //Everything popped, retire the producer's channels
+                recordSource.cleanupDeadChannels();
+            }
+        }
+
+        uint64_t produced = stats->produced.load();
+        uint64_t dropped = recordSource.getDroppedRecords() - droppedBefore;
+        printf("%zu\t%lu\t%lu\t%lu\t%.2f%%\n", numThreads, produced, popped,
+               dropped, produced ? 100.0 * dropped / produced : 0.0);
+    }
+}
@@ -2,6 +2,7 @@
 
 //Need to agree on RECORD_SINK_NAME
 #include "hello_world.h"
+#include "DDTrace/TraceFile.h"
 
 enum AggregationMode {
     COUNT_RECORDS = 0,
@@ -14,16 +15,16 @@ const char* filename = "hello_world.ddt";
 
 bool shouldExit = false;
 
+//How long to sleep waiting for records before checking shouldExit, in
+//microseconds. Signals cut the wait short anyway.
+const uint64_t WAIT_FOR_RECORDS_TIMEOUT = 100000;
+
 void logToDisk() {
     std::vector<IntervalRecord> tempStorage;
     IntervalRecord record;
     // buffer in memory 
-    FILE* logFile = fopen(filename, "wb");
-    if (!logFile) {
-        fprintf(stderr, 
-                "Error opening file for writing,...aborting\n");
-        abort();
-    }
+    TraceFileWriter logFile;
+    logFile.open(filename);
     while(!shouldExit) {
         bool could_poll = recordSource.popRecord(&record);
         // At least make an attempt to batch
@@ -32,15 +33,14 @@ void logToDisk() {
             could_poll = recordSource.popRecord(&record);
         }
         if (!tempStorage.empty()) {
-            fwrite(&tempStorage[0], sizeof(IntervalRecord),
-                    tempStorage.size(), logFile);
+            logFile.append(&tempStorage[0], tempStorage.size());
             tempStorage.clear();
         }
-        else { // Delay for a bit if we did not see a record
-            cpu_delay();
+        else { // Sleep until a producer has records for us
+            recordSource.waitForRecords(WAIT_FOR_RECORDS_TIMEOUT);
         }
     }
-    fclose(logFile);
+    logFile.close();
     printf("Stopping log\n");
 }
 void countRecords() {
@@ -52,7 +52,7 @@ void countRecords() {
             processedTraces++;
             continue;
         }
-        cpu_delay();
+        recordSource.waitForRecords(WAIT_FOR_RECORDS_TIMEOUT);
     }
 }
 
@@ -98,7 +98,7 @@ void printRecords() {
             printRecord(&record);
             continue;
         }
-        cpu_delay();
+        recordSource.waitForRecords(WAIT_FOR_RECORDS_TIMEOUT);
     }
     printf("Summary of traces processed:\n");
     printf("%d\n", processedTraces);
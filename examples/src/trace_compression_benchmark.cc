@@ -0,0 +1,147 @@
+#include <random>
+
+#include "DDTrace.h"
+#include "DDTrace/TraceFile.h"
+
+using namespace DDTrace;
+
+/**
+ * Compares the size, write throughput and read throughput of .ddt files in
+ * three forms: a raw dump of IntervalRecords (what we wrote before the
+ * container existed), the container with raw blocks, and the container with
+ * compressed blocks.
+ *
+ * The records are synthetic but shaped like real traces: requests hop
+ * between a few servers, many requests are in flight at once so their
+ * records interleave, and a handful of annotations repeat.
+ *
+ * Usage: trace_compression_benchmark [number of records] [scratch directory]
+ */
+
+const uint16_t NUM_SERVERS = 4;
+const size_t REQUESTS_IN_FLIGHT = 32;
+const char* ANNOTATIONS[] = {"parse", "lookup", "read", "write", "rpc", "reply"};
+//Records handed to the writer at a time, as the aggregator's sinks get them
+const size_t WRITE_BATCH_SIZE = 256;
+
+struct Request {
+    VectorClock clock;
+    size_t hopsLeft;
+    uint16_t server;
+};
+
+void makeRecords(size_t count, std::vector<IntervalRecord>* records){
+    std::mt19937_64 random(42);
+    std::lognormal_distribution<double> duration(9, 1.5);
+    const double cyclesPerSec = 2.4e9;
+    uint64_t now = 1000000000000UL;
+    uint64_t nextId = 1;
+    std::vector<Request> inFlight;
+    while (records->size() < count){
+        while (inFlight.size() < REQUESTS_IN_FLIGHT){
+            Request request = {VectorClock(nextId++), 3 + random() % 4,
+                static_cast<uint16_t>(random() % NUM_SERVERS)};
+            inFlight.push_back(request);
+        }
+        size_t i = random() % inFlight.size();
+        Request& request = inFlight[i];
+        request.clock.increment(request.server);
+        uint64_t start = now + random() % 5000;
+        uint64_t end = start + static_cast<uint64_t>(duration(random));
+        const char* annotation = ANNOTATIONS[random() % 6];
+        records->push_back(IntervalRecord(start, end, request.clock,
+                    request.server, cyclesPerSec, PerfRecord(), annotation));
+        now += random() % 2000;
+        request.server = (request.server + 1 + random() % (NUM_SERVERS - 1))
+            % NUM_SERVERS;
+        if (--request.hopsLeft == 0){
+            inFlight[i] = inFlight.back();
+            inFlight.pop_back();
+        }
+    }
+}
+
+bool sameRecord(const IntervalRecord& a, const IntervalRecord& b){
+    return a.getStartCycles() == b.getStartCycles() &&
+        a.getEndCycles() == b.getEndCycles() &&
+        a.getClock() == b.getClock() &&
+        a.getServerID() == b.getServerID() &&
+        a.getCyclesPerSec() == b.getCyclesPerSec() &&
+        strcmp(a.getAnnotation(), b.getAnnotation()) == 0;
+}
+
+uint64_t fileSize(const std::string& fileName){
+    FILE* file = fopen(fileName.c_str(), "rb");
+    assert(file);
+    fseeko(file, 0, SEEK_END);
+    uint64_t size = ftello(file);
+    fclose(file);
+    return size;
+}
+
+void report(const char* format, const std::string& fileName,
+            const std::vector<IntervalRecord>& records, double writeSeconds){
+    uint64_t start = Cycles::rdtsc();
+    std::vector<IntervalRecord> readBack;
+    readBack.reserve(records.size());
+    TraceFileUtils::readRecords(fileName,
+            [&](const IntervalRecord* batch, size_t count){
+                readBack.insert(readBack.end(), batch, batch + count);
+            });
+    double readSeconds = Cycles::toSeconds(Cycles::rdtsc() - start);
+
+    if (readBack.size() != records.size()){
+        PG_DIE("%s: read back %zu of %zu records\n", format, readBack.size(),
+               records.size());
+    }
+    for(size_t i = 0; i < records.size(); i++){
+        if (!sameRecord(records[i], readBack[i])){
+            PG_DIE("%s: record %zu differs after reading back\n", format, i);
+        }
+    }
+
+    double rawMB = records.size() * sizeof(IntervalRecord) / 1e6;
+    double MB = fileSize(fileName) / 1e6;
+    printf("%-22s %10.1f %8.2fx %12.0f %12.0f\n", format, MB, rawMB / MB,
+           rawMB / writeSeconds, rawMB / readSeconds);
+    unlink(fileName.c_str());
+}
+
+int main(int argc, char** argv){
+    size_t count = argc >= 2 ? atol(argv[1]) : 2000000;
+    std::string directory = argc >= 3 ? argv[2] : "/tmp";
+
+    std::vector<IntervalRecord> records;
+    records.reserve(count);
+    makeRecords(count, &records);
+
+    printf("%zu records of %zu bytes\n", count, sizeof(IntervalRecord));
+    printf("%-22s %10s %9s %12s %12s\n", "format", "MB", "ratio",
+           "write MB/s", "read MB/s");
+
+    //Throughputs are in MB of IntervalRecords per second
+    std::string rawDump = directory + "/trace_benchmark_dump.ddt";
+    uint64_t start = Cycles::rdtsc();
+    FILE* file = fopen(rawDump.c_str(), "wb");
+    assert(file);
+    fwrite(&records[0], sizeof(IntervalRecord), records.size(), file);
+    fclose(file);
+    report("raw dump", rawDump, records,
+           Cycles::toSeconds(Cycles::rdtsc() - start));
+
+    TraceBlockEncoding encodings[] = {TRACE_BLOCK_RAW, TRACE_BLOCK_COMPRESSED};
+    const char* names[] = {"container, raw", "container, compressed"};
+    for(int e = 0; e < 2; e++){
+        std::string fileName = directory + "/trace_benchmark.ddt";
+        start = Cycles::rdtsc();
+        TraceFileWriter writer;
+        writer.open(fileName, encodings[e]);
+        for(size_t i = 0; i < records.size(); i += WRITE_BATCH_SIZE){
+            writer.append(&records[i],
+                          std::min<size_t>(WRITE_BATCH_SIZE, records.size() - i));
+        }
+        writer.close();
+        report(names[e], fileName, records,
+               Cycles::toSeconds(Cycles::rdtsc() - start));
+    }
+}
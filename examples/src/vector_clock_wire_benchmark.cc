@@ -0,0 +1,101 @@
+#include <random>
+
+#include "DDTrace.h"
+
+using namespace DDTrace;
+
+/**
+ * Compares the size and speed of carrying a VectorClock in an Rpc header by
+ * copying the struct against VectorClock::serialize and deserialize, for
+ * clocks with 1 to MAX_VECTORCLOCK_ENTRIES servers. Clocks are decoded from
+ * a buffer of many headers so that, as on a real Rpc path, they are not all
+ * in registers.
+ *
+ * Usage: vector_clock_wire_benchmark [number of clocks] [rounds]
+ */
+
+/**
+  * Returns count clocks that went through servers servers, each a few
+  * times, in random orders
+  */
+std::vector<VectorClock> makeClocks(size_t count, size_t servers){
+    std::mt19937_64 random(42);
+    std::vector<VectorClock> clocks;
+    for(size_t i = 0; i < count; i++){
+        VectorClock clock(random());
+        for(size_t s = 0; s < servers; s++){
+            uint16_t server = static_cast<uint16_t>(random() % 1000);
+            for(size_t hop = 1 + random() % 4; hop > 0; hop--){
+                clock.increment(server);
+            }
+        }
+        clocks.push_back(clock);
+    }
+    return clocks;
+}
+
+int main(int argc, char** argv){
+    size_t count = argc >= 2 ? atol(argv[1]) : 100000;
+    size_t rounds = argc >= 3 ? atol(argv[2]) : 20;
+
+    printf("%zu clocks, %zu rounds, struct is %zu bytes\n", count, rounds,
+           sizeof(VectorClock));
+    printf("%-8s %8s %12s %12s %12s %12s\n", "servers", "bytes",
+           "copy to ns", "copy from ns", "encode ns", "decode ns");
+    for(size_t servers = 1; servers <= MAX_VECTORCLOCK_ENTRIES; servers *= 2){
+        std::vector<VectorClock> clocks = makeClocks(count, servers);
+        std::vector<VectorClock> decoded(count);
+        std::vector<char> structs(count * sizeof(VectorClock));
+        std::vector<char> wire(count * MAX_SERIALIZED_VECTORCLOCK_SIZE);
+        std::vector<size_t> offsets(count + 1, 0);
+        double copyTo = 0, copyFrom = 0, encode = 0, decode = 0;
+
+        for(size_t r = 0; r < rounds; r++){
+            uint64_t start = Cycles::rdtsc();
+            for(size_t i = 0; i < count; i++){
+                memcpy(&structs[i * sizeof(VectorClock)], &clocks[i],
+                       sizeof(VectorClock));
+            }
+            copyTo += Cycles::toSeconds(Cycles::rdtsc() - start);
+
+            start = Cycles::rdtsc();
+            for(size_t i = 0; i < count; i++){
+                memcpy(&decoded[i], &structs[i * sizeof(VectorClock)],
+                       sizeof(VectorClock));
+            }
+            copyFrom += Cycles::toSeconds(Cycles::rdtsc() - start);
+
+            start = Cycles::rdtsc();
+            char* cursor = &wire[0];
+            for(size_t i = 0; i < count; i++){
+                cursor += clocks[i].serialize(cursor);
+                offsets[i + 1] = cursor - &wire[0];
+            }
+            encode += Cycles::toSeconds(Cycles::rdtsc() - start);
+
+            start = Cycles::rdtsc();
+            const char* data = &wire[0];
+            const char* end = &wire[0] + offsets[count];
+            for(size_t i = 0; i < count; i++){
+                size_t used = decoded[i].deserialize(data, end - data);
+                if (!used){
+                    PG_DIE("Clock %zu did not decode\n", i);
+                }
+                data += used;
+            }
+            decode += Cycles::toSeconds(Cycles::rdtsc() - start);
+        }
+
+        for(size_t i = 0; i < count; i++){
+            if (!(decoded[i] == clocks[i]) ||
+                offsets[i + 1] - offsets[i] != clocks[i].getSerializedSize()){
+                PG_DIE("Clock %zu differs after decoding\n", i);
+            }
+        }
+        double perClock = 1e9 / (static_cast<double>(count) * rounds);
+        printf("%-8zu %8.1f %12.1f %12.1f %12.1f %12.1f\n", servers,
+               static_cast<double>(offsets[count]) / count,
+               copyTo * perClock, copyFrom * perClock, encode * perClock,
+               decode * perClock);
+    }
+}